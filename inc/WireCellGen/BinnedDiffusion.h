@@ -7,6 +7,7 @@
 #include "WireCellIface/IDepo.h"
 
 #include "WireCellGen/ImpactData.h"
+#include "WireCellGen/GausKernelCache.h"
 
 #include <deque>
 
@@ -73,12 +74,23 @@ namespace WireCell {
 	    /// drastically different response.
 	    ImpactData::pointer impact_data(int bin) const;
 
+            /// Sample every diffusion and calculate every ImpactData
+            /// now, using up to nthreads threads.  After this
+            /// impact_data() only reads and may be called from
+            /// several threads.  With fluctuation the diffusions are
+            /// sampled in a single thread in impact order, as walking
+            /// the wires with impact_data() would, so the result does
+            /// not depend on nthreads.
+            void calculate_all(int nthreads = 1);
+
 	    // test ... 
 	    //	    void get_charge_vec(std::vector<std::vector<std::tuple<int,int, double> > >& vec_vec_charge, std::vector<int>& vec_impact);
 
 	    
             /// Return the range of pitch containing depos out to
-            /// given nsigma and without bounds checking.
+            /// given nsigma and without bounds checking.  This is
+            /// kept as depos are added for nsigma of zero or as
+            /// given to the constructor, else the depos are scanned.
             std::pair<double,double> pitch_range(double nsigma=0.0) const;
 
             /// Return the half open bin range of impact bins,
@@ -94,6 +106,10 @@ namespace WireCell {
             std::pair<int,int> time_bin_range(double nsigma=0.0) const;
 
 	    double get_nsigma() const {return m_nsigma;};
+
+            /// Take the 1D Gaussian bin integrals from this cache,
+            /// which may be shared.  Null to integrate each depo.
+            void set_kernel_cache(std::shared_ptr<GausKernelCache> kcache) { m_kcache = kcache; }
 	    
 	private:
 	    
@@ -103,17 +119,22 @@ namespace WireCell {
 	    double m_nsigma;
             IRandom::pointer m_fluctuate;
             ImpactDataCalculationStrategy m_calcstrat;
+            std::shared_ptr<GausKernelCache> m_kcache;
 
 	    // current window set by user.
 	    std::pair<int,int> m_window;
 	    // the content of the current window
 	    std::map<int, ImpactData::mutable_pointer> m_impacts;
-            //std::vector<std::shared_ptr<GaussianDiffusion> > m_diffs;
-	    //std::set<std::shared_ptr<GaussianDiffusion>, GausDiffTimeCompare> m_diffs;
-	    std::set<std::shared_ptr<GaussianDiffusion> > m_diffs;
+            // In the order added.  Only used for ranges so an
+            // occasional repeat is harmless.
+            std::vector<std::shared_ptr<GaussianDiffusion> > m_diffs;
 
             int m_outside_pitch;
             int m_outside_time;
+
+            // Kept by add() at m_nsigma and at the centers.
+            GausDescRange m_pitch_extent, m_time_extent;
+            GausDescRange m_pitch_centers, m_time_centers;
 	};
 
 
@@ -7,7 +7,12 @@
 #include "WireCellIface/IDepo.h"
 
 #include "WireCellGen/ImpactData.h"
+#include "WireCellGen/GausKernelCache.h"
+#include "WireCellGen/GaussianDiffusion.h"
 
+#include "WireCellUtil/Array.h"
+
+#include <array>
 #include <deque>
 #include <Eigen/Sparse>
 
@@ -61,6 +66,37 @@ namespace WireCell {
 	    /// Return false if no activity falls within the domain.
 	    bool add(IDepo::pointer deposition, double sigma_time, double sigma_pitch);
 
+            /// Add a line segment of charge from the deposition to
+            /// end_pos at end_time, taken as drifted the same as the
+            /// deposition.  Its charge is uniform along the segment
+            /// and sampled as one patch, see GaussianDiffusion.  A
+            /// segment moving in both time and pitch fills its
+            /// bounding box so it is first cut into pieces, each
+            /// with its share of the charge, which span at most
+            /// max_bins time or impact bins.  Return false if no
+            /// activity falls within the domain.
+            bool add_segment(IDepo::pointer deposition, const Point& end_pos, double end_time,
+                             double sigma_time, double sigma_pitch, int max_bins = 64);
+
+            /// Reserve room for this many more depositions.
+            void reserve(size_t ndepos) { m_diffs.reserve(m_diffs.size() + ndepos); }
+
+            /// Count of the depos whose charge extent, as given by
+            /// get_charge_extents(), touches each cell of a grid of
+            /// cell_wires by cell_ticks starting at channel and tick
+            /// zero.  Counts are wire major.
+            struct Occupancy {
+                int cell_wires = 0, cell_ticks = 0;
+                int ncw = 0, nct = 0;
+                std::vector<int> counts;
+            };
+
+            /// Keep an occupancy of cells of this size as depos are
+            /// added.  Call before add().  Zero sizes turn it off.
+            void set_occupancy_cells(int cell_wires, int cell_ticks);
+
+            const Occupancy& occupancy() const { return m_occupancy; }
+
 	    /// Unconditionally associate an already built
 	    /// GaussianDiffusion to one impact.  
 	    //void add(std::shared_ptr<GaussianDiffusion> gd, int impact_index);
@@ -77,13 +113,46 @@ namespace WireCell {
 	    /// drastically different response.
 	    //ImpactData::pointer impact_data(int bin) const;
 
-	    // test ... 
-	    void get_charge_vec(std::vector<std::vector<std::tuple<int,int, double> > >& vec_vec_charge, std::vector<int>& vec_impact);
+            /// Dense accumulation of the charge of each impact group
+            /// in (channel, tick) windows.  A grid of cells of
+            /// cell_wires by cell_ticks starting at (start_ch,
+            /// start_tick) assigns each bin to a window, or to none
+            /// (-1) in which case its charge is dropped.
+            struct ChargeGrid {
+                struct Window {
+                    int start_ch, start_tick;
+                    std::vector<Array::array_xxf> groups; // per impact group
+                };
+                int start_ch, start_tick;
+                int cell_wires, cell_ticks;
+                int ncw, nct;
+                std::vector<int> cell_window; // ncw*nct, wire major
+                std::vector<Window> windows;
+            };
+
+            /// Sample the diffusions and add their charge, shared
+            /// between the two impact groups bounding each impact
+            /// bin, directly into the grid's windows.  The groups
+            /// are ordered as the reduced impacts in vec_impact.
+            ///
+            /// The diffusions are sampled on nthreads threads (0 for
+            /// all hardware threads).  When fluctuating, fixed size
+            /// blocks of diffusions each draw from their own random
+            /// substream so the result does not depend on nthreads.
+            void get_charge_grid(ChargeGrid& grid, const std::vector<int>& vec_impact, int nthreads = 1);
+
+            /// Append the half open (channel, tick) extents, as
+            /// {ch_begin, ch_end, tick_begin, tick_end}, of the charge
+            /// each diffusion will be sampled into.
+            void get_charge_extents(std::vector<std::array<int,4> >& extents) const;
+
 	    void get_charge_matrix(std::vector<Eigen::SparseMatrix<float>* >& vec_spmatrix, std::vector<int>& vec_impact);
 	    
 	    
             /// Return the range of pitch containing depos out to
-            /// given nsigma and without bounds checking.
+            /// given nsigma and without bounds checking.  This is
+            /// kept as depos are added for nsigma of zero or as
+            /// given to the constructor, else the depos are scanned.
             std::pair<double,double> pitch_range(double nsigma=0.0) const;
 
             /// Return the half open bin range of impact bins,
@@ -99,26 +168,45 @@ namespace WireCell {
             std::pair<int,int> time_bin_range(double nsigma=0.0) const;
 
 	    double get_nsigma() const {return m_nsigma;};
+
+            /// Take the 1D Gaussian bin integrals from this cache,
+            /// which may be shared.  Null to integrate each depo.
+            void set_kernel_cache(std::shared_ptr<GausKernelCache> kcache) { m_kcache = kcache; }
 	    
 	private:
-	    
+
             const Pimpos& m_pimpos;
             const Binning& m_tbins;
 
 	    double m_nsigma;
             IRandom::pointer m_fluctuate;
             ImpactDataCalculationStrategy m_calcstrat;
+            std::shared_ptr<GausKernelCache> m_kcache;
 
 	    // current window set by user.
 	    std::pair<int,int> m_window;
 	    // the content of the current window
 	    std::map<int, ImpactData::mutable_pointer> m_impacts;
-            //std::vector<std::shared_ptr<GaussianDiffusion> > m_diffs;
-	    //std::set<std::shared_ptr<GaussianDiffusion>, GausDiffTimeCompare> m_diffs;
-	    std::set<std::shared_ptr<GaussianDiffusion> > m_diffs;
+            // Held by value, in the order added.
+            std::vector<GaussianDiffusion> m_diffs;
 
             int m_outside_pitch;
             int m_outside_time;
+
+            Occupancy m_occupancy;
+            std::shared_ptr<const std::vector<int> > m_imp_channel; // while occupancy is on
+
+            bool add_diffusion(IDepo::pointer depo, const GausDesc& time_desc, const GausDesc& pitch_desc,
+                               double time_length, double pitch_length);
+
+            // Return false if the diffusion gives no charge.
+            bool charge_extent(const GaussianDiffusion& diff, const std::vector<int>& imp_channel,
+                               std::array<int,4>& extent) const;
+            void occupy(const std::array<int,4>& extent);
+
+            // Kept by add() at m_nsigma and at the centers.
+            GausDescRange m_pitch_extent, m_time_extent;
+            GausDescRange m_pitch_centers, m_time_centers;
 	};
 
 
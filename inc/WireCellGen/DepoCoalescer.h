@@ -0,0 +1,76 @@
+#ifndef WIRECELL_GEN_DEPOCOALESCER
+#define WIRECELL_GEN_DEPOCOALESCER
+
+#include "WireCellIface/IDrifter.h"
+#include "WireCellIface/IConfigurable.h"
+#include "WireCellUtil/Units.h"
+
+#include <map>
+#include <tuple>
+
+namespace WireCell {
+
+    namespace Gen {
+
+        /**
+           DepoCoalescer merges drifted depos which are so close in
+           time, transverse position and diffusion width that they
+           would diffuse to about the same charge.  It is meant to go
+           just after a Drifter to cut the work of the ductor for
+           dense showers and finely stepped tracks.
+
+           Depos are grouped in cells of "time_tolerance" in time,
+           "space_tolerance" in X, Y and Z and a relative
+           "sigma_tolerance" in each of the longitudinal and
+           transverse extents.  Each cell is output as one depo at
+           the charge weighted mean time and position.  Its extents
+           are widened so the charge keeps the same second moments,
+           using "drift_speed" to turn the spread in time into a
+           longitudinal one.  Charge and energy are summed.  The
+           prior() of a merged depo is the one in its cell holding
+           the most charge, whose id and pdg it also takes.  The
+           other constituents are not kept so provenance of a merged
+           depo is only that of its largest part.  A cell with a
+           single depo passes it through as is.  Binning X keeps
+           depos drifted to different faces or anodes apart.
+
+           Input must be ordered in time, as Drifter gives, and so is
+           the output.  At each EOS the number of depos in and out
+           is reported.
+         */
+        class DepoCoalescer : public IDrifter, public IConfigurable {
+        public:
+            DepoCoalescer();
+            virtual ~DepoCoalescer();
+            virtual bool operator()(const input_pointer& depo, output_queue& outq);
+            virtual void configure(const WireCell::Configuration& config);
+            virtual WireCell::Configuration default_configuration() const;
+        private:
+
+            // Charge weighted sums of the depos in one cell.
+            struct Cell {
+                double wsum = 0, qsum = 0, esum = 0;
+                double t = 0, x = 0, y = 0, z = 0;
+                double t2 = 0, y2 = 0, z2 = 0, long2 = 0, tran2 = 0;
+                int count = 0;
+                IDepo::pointer first, biggest;
+                void add(const IDepo::pointer& depo);
+            };
+            // time, x, y, z, extent_long, extent_tran bins
+            typedef std::tuple<long, long, long, long, long, long> key_t;
+
+            key_t key(const IDepo::pointer& depo) const;
+            IDepo::pointer merge(const Cell& cell) const;
+            // Output cells with a time bin below tbin, in time order.
+            void flush(output_queue& outq, long tbin);
+
+            double m_time_tol, m_space_tol, m_sigma_tol;
+            double m_drift_speed;
+
+            std::map<key_t, Cell> m_cells;
+            int m_nin, m_nout;
+        };
+    }
+}
+
+#endif
@@ -19,8 +19,9 @@ namespace WireCell {
             virtual ~DepoSplat();
 
         protected:
-            virtual ITrace::vector process_face(IAnodeFace::pointer face,
-                                                const IDepo::vector& depos);
+            virtual ITrace::vector process_plane(IWirePlane::pointer plane, int iplane,
+                                                 const IDepo::vector& depos,
+                                                 IRandom::pointer rng);
 
 
         };
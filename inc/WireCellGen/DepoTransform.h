@@ -12,6 +12,10 @@
 #include "WireCellIface/WirePlaneId.h"
 #include "WireCellIface/IDepo.h"
 
+#include "WireCellGen/GausKernelCache.h"
+#include "WireCellGen/ResponseSpectraCache.h"
+#include "WireCellUtil/Array.h"
+
 namespace WireCell {
     namespace Gen {
 
@@ -30,7 +34,7 @@ namespace WireCell {
             /// dummy depo modifier 
             /// used for the application of the charge scaling bases on dQdx calibration
             /// see the detailed implementation in larwirecell or uboonecode 
-            virtual IDepo::pointer modify_depo(WirePlaneId wpid, IDepo::pointer depo){
+            virtual IDepo::pointer modify_depo(WirePlaneId, IDepo::pointer depo){
                 return depo;
             }
 
@@ -46,6 +50,20 @@ namespace WireCell {
             double m_drift_speed;
             double m_nsigma;
             int m_frame_count;
+            int m_transform_threads;
+            int m_plane_threads;
+            bool m_pack_planes;
+            int m_tile_wires, m_tile_ticks;
+            double m_memory_budget; // MB
+            std::shared_ptr<GausKernelCache> m_kernel_cache;
+            std::shared_ptr<ResponseSpectraCache> m_resp_cache;
+
+            // Streaming: start of the next frame and the response
+            // tails, per channel row, which spill past it.
+            bool m_streaming;
+            int m_stream_tail; // ticks
+            double m_stream_time;
+            Array::array_xxf m_carry;
 
         };
     }
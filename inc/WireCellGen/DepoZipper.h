@@ -37,6 +37,7 @@ namespace WireCell {
             double m_drift_speed;
             double m_nsigma;
             int m_frame_count;
+            int m_wire_threads;
 
         };
     }
@@ -55,10 +55,19 @@ namespace WireCell {
             std::string m_mode;
 
             int m_frame_count;
+            int m_plane_threads;
+            int m_wire_threads;
 
             virtual void process(output_queue& frames);
-            virtual ITrace::vector process_face(IAnodeFace::pointer face,
-                                                const IDepo::vector& face_depos);
+
+            /// Return traces for one plane, the iplane'th of its
+            /// face, from the depos in the face's sensitive volume.
+            /// The rng is the plane's own random stream, null if not
+            /// fluctuating.  This may be called concurrently for
+            /// different planes.
+            virtual ITrace::vector process_plane(IWirePlane::pointer plane, int iplane,
+                                                 const IDepo::vector& face_depos,
+                                                 IRandom::pointer rng);
             bool start_processing(const input_pointer& depo);
 
         };
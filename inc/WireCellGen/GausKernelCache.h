@@ -0,0 +1,74 @@
+/**
+   A GausKernelCache keeps the binned integrals of Gaussians which
+   differ only by where the center falls in the bins and by sigma.
+
+   Depos drifted by about the same distance have about the same
+   diffusion sigma.  The cache quantizes sigma and the offset of the
+   center from the first bin edge to a precision given as a fraction
+   of the bin size and then integrates the quantized Gaussian once.
+   Results depend only on the quantized key, not on what was cached
+   before, so they do not depend on the order or thread of lookups.
+ */
+
+#ifndef WIRECELLGEN_GAUSKERNELCACHE
+#define WIRECELLGEN_GAUSKERNELCACHE
+
+#include "WireCellGen/GaussianDiffusion.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace WireCell {
+    namespace Gen {
+
+        class GausKernelCache {
+        public:
+
+            /// Bin integrals, normalized to the Gaussian, and if
+            /// asked the linear interpolation weights as given by
+            /// GausDesc::weight().
+            struct Kernel {
+                std::vector<double> bins, weights;
+            };
+            typedef std::shared_ptr<const Kernel> kernel_pointer;
+
+            /// Quantize to precision times the bin size and hold at
+            /// most capacity kernels.  The cache is emptied when full.
+            GausKernelCache(double precision = 0.01, size_t capacity = 10000);
+
+            /// Return the kernel for the Gaussian over nbins bins of
+            /// size step from start.  Returns nullptr if sigma is too
+            /// small to quantize, in which case the caller should
+            /// integrate it directly.  Safe to call from many threads.
+            kernel_pointer get(const GausDesc& desc, double start, double step, int nbins,
+                               bool want_weights = false);
+
+            double precision() const { return m_precision; }
+
+            size_t hits() const { return m_hits; }
+            size_t misses() const { return m_misses; }
+
+            /// Fraction of lookups found in the cache, or 0 if none.
+            double hit_rate() const;
+
+            /// Zero the hit and miss counts.
+            void reset_counts();
+
+        private:
+            typedef std::tuple<int, long, long, bool> key_t; // nbins, sigma, offset, weights
+
+            double m_precision;
+            size_t m_capacity;
+            std::mutex m_mutex;
+            std::map<key_t, kernel_pointer> m_kernels;
+            std::atomic<size_t> m_hits, m_misses;
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,54 @@
+/**
+   Batched Gaussian kernels used to sample diffusion.
+
+   These evaluate exp() and erf() over arrays with branch free code
+   which the compiler may vectorize.  On x86-64 with GCC a version is
+   built for AVX-512, AVX2 and the baseline and the best one the CPU
+   supports is picked at load time.  Contraction of multiply and add
+   into FMA, which only some of these have, is turned off so all
+   versions round the same and results do not depend on the CPU.
+ */
+
+#ifndef WIRECELLGEN_GAUSSKERNELS
+#define WIRECELLGEN_GAUSSKERNELS
+
+namespace WireCell {
+    namespace Gen {
+
+        /// Set y[i] = exp(x[i]) for i in [0,n).  Relative error is
+        /// a few ulp.  Arguments below -700 give exp(-700).
+        void exp_batch(const double* x, double* y, int n);
+
+        /// Set y[i] = erf(x[i]) for i in [0,n).  Absolute error is
+        /// about 1e-15.
+        void erf_batch(const double* x, double* y, int n);
+
+        /// One value of exp_batch() and erf_batch(), built for the
+        /// baseline instruction set only.  A reference for checking
+        /// that the batch versions give identical results.
+        double exp_scalar(double x);
+        double erf_scalar(double x);
+
+        /// Integrate a unit Gaussian of the given center and sigma
+        /// over nbins bins of size step starting at start.  The
+        /// integrals go to bins.  If weights is not null it is also
+        /// filled as GausDesc::weight(): the linear interpolation
+        /// weight of the charge in each bin toward its lower edge.
+        /// Edges are evaluated once for both.
+        void gauss_binint(double center, double sigma, double start, double step, int nbins,
+                          double* bins, double* weights = nullptr);
+
+        /// As gauss_binint() but for charge spread uniformly over
+        /// [lo,hi] and smeared by a Gaussian of the given sigma, as
+        /// from a line segment.  The bin integrals and weights are
+        /// the closed form averages of the Gaussian ones over the
+        /// segment.  A segment short compared to sigma is taken as
+        /// a Gaussian at its middle.  A zero sigma gives the plain
+        /// overlap of each bin with the segment.
+        void gauss_box_binint(double lo, double hi, double sigma, double start, double step, int nbins,
+                              double* bins, double* weights = nullptr);
+
+    }
+}
+
+#endif
@@ -6,12 +6,15 @@
 #include "WireCellIface/IDepo.h"
 #include "WireCellIface/IRandom.h"
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
 
 namespace WireCell {
     namespace Gen {
 
+        class GausKernelCache;
+
 	/** A GausDesc describes a Gaussian distribution.
          *
          * Two are used by GaussianDiffusion.  One describes the
@@ -43,7 +46,7 @@ namespace WireCell {
                 return ret;
             }
 
-            std::pair<double,double> sigma_range(double nsigma=3.0) {
+            std::pair<double,double> sigma_range(double nsigma=3.0) const {
                 return std::make_pair(center-sigma*nsigma, center+sigma*nsigma);
 
             }
@@ -63,6 +66,29 @@ namespace WireCell {
 	    
 	};
 
+        /** A GausDescRange keeps the range spanned by a growing set
+         * of GausDesc, each taken out to a fixed number of sigma. */
+        struct GausDescRange {
+            double nsigma;
+            size_t count = 0;
+            double lo = 0, hi = 0;
+
+            GausDescRange(double nsigma = 0.0) : nsigma(nsigma) { }
+
+            /// Add a Gaussian, or a segment of them spanning
+            /// length from its center.
+            void add(const GausDesc& gd, double length = 0.0) {
+                const double glo = std::min(gd.center, gd.center+length) - gd.sigma*nsigma;
+                const double ghi = std::max(gd.center, gd.center+length) + gd.sigma*nsigma;
+                lo = count ? std::min(lo, glo) : glo;
+                hi = count ? std::max(hi, ghi) : ghi;
+                ++count;
+            }
+
+            /// The range, (0,0) if nothing was added.
+            std::pair<double,double> range() const { return std::make_pair(lo, hi); }
+        };
+
 	
 	
 	class GaussianDiffusion {
@@ -86,28 +112,58 @@ namespace WireCell {
 			      const GausDesc& time_desc, 
 			      const GausDesc& pitch_desc);
 
+            /** Create a diffused line segment.  The depo charge is
+             * spread uniformly from the centers of the descriptions
+             * to the centers moved by time_length and pitch_length
+             * and smeared by their sigmas.  The patch integrates
+             * this line charge over the bins in closed form along
+             * the segment.
+             */
+            GaussianDiffusion(const IDepo::pointer& depo,
+                              const GausDesc& time_desc,
+                              const GausDesc& pitch_desc,
+                              double time_length, double pitch_length);
+
             
             /// This fills the patch once matching the given time and
             /// pitch binning. The patch is limited to the 2D sample
             /// points that cover the subdomain determined by the
-            /// number of sigma.  If there should be Poisson
-            /// fluctuations applied pass in an IRandom.  Total charge
-            /// is charge is preserved.  Each cell of the patch
+            /// number of sigma.  If there should be fluctuations
+            /// applied pass in an IRandom and the depo electrons are
+            /// spread over the patch as a multinomial.  Total charge
+            /// is preserved.  Each cell of the patch
             /// represents the 2D bin-centered sampling of the
-            /// Gaussian.
+            /// Gaussian.  If a kernel cache is given the 1D bin
+            /// integrals are taken from it.  A segment is not
+            /// cached and its patch is separable only if it is
+            /// short.
             
             void set_sampling(const Binning& tbin, const Binning& pbin,
                               double nsigma = 3.0, 
                               IRandom::pointer fluctuate=nullptr, 
-                              unsigned int weightstrat = 1/*see BinnedDiffusion ImpactDataCalculationStrategy*/);
+                              unsigned int weightstrat = 1/*see BinnedDiffusion ImpactDataCalculationStrategy*/,
+                              GausKernelCache* kcache = nullptr);
 	    void clear_sampling();
 
 	    /// Get the diffusion patch as an array of N_pitch rows X
 	    /// N_time columns.  Index as patch(i_pitch, i_time).
-	    /// Call set_sampling() first.
+	    /// Call set_sampling() first.  A separable patch is
+	    /// filled on the first call, which is not thread safe.
 	    const patch_t& patch() const;
 
-            const std::vector<double> weights() const;
+            /// Return true if, after set_sampling() without
+            /// fluctuation, the patch is held only as the outer
+            /// product patch(ip,it) = pitch_vec()[ip]*time_vec()[it].
+            bool separable() const { return !m_pvec.empty(); }
+
+            /// The pitch factor of a separable patch, scaled to the
+            /// depo charge.
+            const std::vector<double>& pitch_vec() const { return m_pvec; }
+
+            /// The time factor of a separable patch.
+            const std::vector<double>& time_vec() const { return m_tvec; }
+
+            const std::vector<double>& weights() const;
 
             /// Return the absolute time bin in the binning corresponding to column 0 of the patch.
             int toffset_bin() const { return m_toffset_bin; }
@@ -121,16 +177,35 @@ namespace WireCell {
 	    double depo_time() const { return m_deposition->time();}
 	    double depo_x() const { return m_deposition->pos().x();}
 	    
-	    const GausDesc pitch_desc() { return m_pitch_desc; }
-	    const GausDesc time_desc() { return m_time_desc; }
+	    const GausDesc& pitch_desc() const { return m_pitch_desc; }
+	    const GausDesc& time_desc() const { return m_time_desc; }
+
+            /// True if this is a line segment and not a point.
+            bool segment() const { return m_time_length != 0 || m_pitch_length != 0; }
+            double time_length() const { return m_time_length; }
+            double pitch_length() const { return m_pitch_length; }
+
+            /// The range covered out to nsigma, including the length
+            /// of a segment.
+            std::pair<double,double> time_range(double nsigma=3.0) const;
+            std::pair<double,double> pitch_range(double nsigma=3.0) const;
 
         private:
 
+            void sample_segment(const Binning& tbin, const Binning& pbin, double nsigma,
+                                IRandom::pointer fluctuate, unsigned int weightstrat);
+            // Fill the patch with the depo electrons thrown over
+            // probs, indexed as [it*npss + ip].
+            void fluctuate_patch(IRandom& rng, const std::vector<double>& probs,
+                                 size_t npss, size_t ntss);
+
 	    IDepo::pointer m_deposition; // just for provenance
 
 	    GausDesc m_time_desc, m_pitch_desc;
+            double m_time_length, m_pitch_length;
 
-	    patch_t m_patch;
+	    mutable patch_t m_patch;
+            std::vector<double> m_pvec, m_tvec;
             std::vector<double> m_qweights;
 
             int m_toffset_bin;
@@ -6,7 +6,9 @@
 #include "WireCellUtil/Waveform.h"
 #include "WireCellGen/GaussianDiffusion.h"
 
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #ifndef WIRECELLGEN_IMPACTDATA
@@ -16,11 +18,21 @@ namespace WireCell {
     namespace Gen {
 	/// Information that has been collected at one impact position
 	class ImpactData {
+          public:
+            /// Spectra of the charge and of the weighted charge.
+            typedef std::pair<Waveform::compseq_t, Waveform::compseq_t> window_spectra_t;
+          private:
 	    int m_impact;
+            // Charge and weighted charge over the window of ticks
+            // starting at m_tbin which the diffusions reach.
 	    mutable Waveform::realseq_t m_waveform;
-	    mutable Waveform::compseq_t m_spectrum;	    
 	    mutable Waveform::realseq_t m_weights;
-	    mutable Waveform::compseq_t m_weight_spectrum;
+            mutable int m_tbin;
+            mutable int m_nticks;
+            mutable bool m_calculated;
+            // Spectra of the window, zero padded, by their length.
+            mutable std::map<int, window_spectra_t> m_spectra;
+            mutable std::mutex m_mutex;
 
 	    // Record the diffusions and their pitch bin that contribute to this impact position.
 	    std::vector<GaussianDiffusion::pointer> m_diffusions;
@@ -58,15 +70,33 @@ namespace WireCell {
              */
 	    void calculate(int nticks) const;
 
+            /// True once calculate() has been called.
+            bool calculated() const { return m_calculated; }
 
+            /// The charge is kept only over the window of ticks
+            /// which the diffusions reach.  Return its first tick.
+            int window_begin() const { return m_tbin; }
+
+            /// The charge and the weighted charge over the window.
+            const Waveform::realseq_t& window_waveform() const { return m_waveform; }
+            const Waveform::realseq_t& window_weightform() const { return m_weights; }
+
+            /// Return the spectra of the window zero padded to nfft
+            /// ticks, which must be no less than its size, as if it
+            /// began at tick 0.  A start at tick t multiplies element
+            /// k by exp(-2*pi*i*k*t/nfft).  Spectra are kept for each
+            /// length asked for.  This may be called from several
+            /// threads.
+            const window_spectra_t& window_spectra(int nfft) const;
 
 	    /**  Return the time domain waveform of drifted/diffused
-             *  charge at this impact position. See `calculate()`. */
-	    Waveform::realseq_t& waveform() const;
+             *  charge at this impact position over the full readout.
+             *  See `calculate()`. */
+	    Waveform::realseq_t waveform() const;
 
 	    /** Return the discrete Fourier transform of the above.
              * See `calculate()`. */
-	    Waveform::compseq_t& spectrum() const;
+	    Waveform::compseq_t spectrum() const;
 
             /** The "weightform" is a waveform of weights and gives,
              * for each tick, a measure of where the charge is
@@ -76,8 +106,8 @@ namespace WireCell {
              * local (microscopic) charge distribution as well as
              * which `calculate_*()` method was used.
              */
-	    Waveform::realseq_t& weightform() const;
-	    Waveform::compseq_t& weight_spectrum() const;
+	    Waveform::realseq_t weightform() const;
+	    Waveform::compseq_t weight_spectrum() const;
 
 	    /** Return the associated impact number.  This provides a
 	    sample count along the pitch direction starting from some
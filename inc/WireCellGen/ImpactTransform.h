@@ -3,13 +3,20 @@
 
 #include "WireCellIface/IPlaneImpactResponse.h"
 #include "WireCellGen/BinnedDiffusion_transform.h"
+#include "WireCellGen/ResponseSpectraCache.h"
 #include "WireCellUtil/Array.h"
 
 #include <Eigen/Sparse>
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+
 namespace WireCell {
     namespace Gen {
 
+        class PlaneImpactResponse;
+
     
         /** An ImpactTransform transforms charge on impact positions
          * into waveforms via 2D FFT.
@@ -18,24 +25,76 @@ namespace WireCell {
         {
             IPlaneImpactResponse::pointer m_pir;
             BinnedDiffusion_transform& m_bd;
+            int m_nthreads;
 	    
 	    int m_num_group;  // how many 2D convolution is needed
 	    int m_num_pad_wire; // how many wires are needed to pad on each side
 	    std::vector<std::map<int, IImpactResponse::pointer> > m_vec_map_resp;
-	    std::vector<std::vector<std::tuple<int,int,double> > > m_vec_vec_charge; // ch, time, charge
 	    //std::vector<Eigen::SparseMatrix<float>* > m_vec_spmatrix;
 	    
-	    
 	    std::vector<int> m_vec_impact;
-	    Array::array_xxf m_decon_data;
-	    int m_start_ch;
-	    int m_end_ch;
-	    int m_start_tick;
-	    int m_end_tick;
+
+	    // A (wire, tick) window convolved with its own 2D FFTs.
+	    // There is one covering all the charge or, in tiled mode,
+	    // one per cluster of activity.
+	    struct Tile {
+	        int start_ch, end_ch;       // wires, including padding
+	        int start_tick, end_tick;   // ticks of data
+	        int fft_ticks;              // time size of the 2D FFTs
+	        // window of sampled charge, one array per impact group
+	        int charge_ch, charge_tick, charge_rows, charge_cols;
+	        std::vector<Array::array_xxf> charge;
+	        Array::array_xxf data;
+	    };
+	    std::vector<Tile> m_tiles;
+
+	    // Work memory budget in bytes, 0 for none, and the bytes of
+	    // large arrays held now and at most.
+	    size_t m_memory_budget;
+	    mutable std::atomic<long> m_mem_now, m_mem_peak;
+	    // set when the PIR provides split field and short responses
+	    std::shared_ptr<const PlaneImpactResponse> m_split_pir;
+	    // response spectra shared with other transforms, may be null
+	    std::shared_ptr<ResponseSpectraCache> m_cache;
+	    // long-range response spectrum, built on first use
+	    mutable std::once_flag m_long_once;
+	    mutable std::shared_ptr<const Waveform::compseq_t> m_long_spec;
+	    // waveforms of wires from m_long_wbeg after apply_long()
+	    Array::array_xxf m_long_data;
+	    int m_long_wbeg;
+	    bool m_long_done;
 	    
         public:
 
-            ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedDiffusion_transform& bd);
+            /// Create a transform of the charge in bd.  The impact
+            /// group convolutions are spread over nthreads threads
+            /// (0 means use all hardware threads).  If deferred,
+            /// only the charge is collected and one of the
+            /// transform() methods must be called before the
+            /// waveforms may be used.
+            ///
+            /// If tile_wires and tile_ticks are positive the charge
+            /// is clustered on cells of that many wires and ticks
+            /// and each cluster is convolved over its own padded
+            /// tile, with the tiles summed on output.  This is used
+            /// only when the tiles are smaller in total than the
+            /// bounding box of all charge.
+            ///
+            /// If memory_budget is nonzero and a tile's transform
+            /// would need more work memory than that many bytes, the
+            /// response spectra are built per group instead of held
+            /// for all groups and fewer threads are used.
+            ///
+            /// If a cache is given the response spectra are taken
+            /// from it and the FFT shapes are rounded up to its
+            /// canonical lengths so that they repeat between
+            /// transforms.  Otherwise the spectra are built for each
+            /// transform and freed after.
+            ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedDiffusion_transform& bd,
+                            int nthreads = 1, bool deferred = false,
+                            int tile_wires = 0, int tile_ticks = 0,
+                            size_t memory_budget = 0,
+                            std::shared_ptr<ResponseSpectraCache> cache = nullptr);
             virtual ~ImpactTransform();
 
             /// Return the wire's waveform.  If the response functions
@@ -50,7 +109,119 @@ namespace WireCell {
             // fixme: this should be a forward iterator so that it may cal bd.erase() safely to conserve memory
             Waveform::realseq_t waveform(int wire) const;
 
+            /// Add the waveforms of all wires directly into a dense
+            /// block of rows by ticks of the readout.  The
+            /// wire_rows vector gives the block row for each wire
+            /// index of the plane (negative to skip).  Wires sharing
+            /// a row, eg wrapped wires on the same channel, are
+            /// summed.
+            void add_to(Array::array_xxf& block, const std::vector<int>& wire_rows) const;
+
+            /// If there is a long-range response, convolve the
+            /// waveforms with it now, keeping them densely for the
+            /// wires holding charge over the readout and freeing the
+            /// tiles.  add_to() then only adds rows, so the DFTs may
+            /// be done by each thread before taking any lock on the
+            /// block.  Otherwise does nothing.
+            void apply_long();
+
+            /// Return the bytes of the large arrays held now, eg the
+            /// charge of a deferred transform.
+            size_t memory() const { return m_mem_now; }
+
+            /// Return the high-water mark in bytes of the large
+            /// arrays held while transforming.
+            size_t peak_memory() const { return m_mem_peak; }
+
+            /// Set the work memory budget of a deferred transform,
+            /// as given to the constructor.
+            void set_memory_budget(size_t nbytes) { m_memory_budget = nbytes; }
+
+            /// Return the (wire, tick) shape of the 2D FFTs, or (0,0)
+            /// if tiled.
+            std::pair<int,int> fft_shape() const;
+
+            /// Do the convolution of a deferred transform.
+            void transform();
+
+            /// Do the convolution of two deferred transforms, eg of
+            /// two planes or of the same plane on two faces.  If
+            /// neither is tiled and their FFT shapes match, the
+            /// central impact groups,
+            /// which are the only ones not already paired as real
+            /// and imaginary parts, share one complex 2D FFT.
+            /// Otherwise, or if together they would need more work
+            /// memory than their two budgets, each is done alone.
+            /// Arrays used by both are tallied in the memory of one.
+            static void transform(ImpactTransform& one, ImpactTransform& two);
+
+            /// Response spectra, one per impact group pair, over the
+            /// full (wire, tick) FFT shape.
+            typedef ResponseSpectraCache::spectra_pointer response_spectra_t;
+
+            /// Spectrum of the long-range response at some length.
+            typedef ResponseSpectraCache::long_pointer long_spectrum_t;
+
+        private:
+
+            /// Return the response spectra for the given FFT shape,
+            /// from the cache if there is one.
+            response_spectra_t response_spectra(int nwires, int nticks) const;
+
+            /// Return the long-range response spectrum for the given
+            /// length, which is the same for all calls.  It is built,
+            /// or found in the cache, on the first call.
+            long_spectrum_t long_spectrum(int nlength) const;
+
+            // Build the response spectrum of one impact group.
+            void response_spectrum(Array::array_xxc& resp_f_w, int igroup, int nwires, int nticks) const;
+
+            // Tally bytes of large arrays allocated (or freed if
+            // negative).
+            void mem_add(long nbytes) const;
+
+            // Return the number of threads to use if the tile must be
+            // done lean to meet the budget, else 0.
+            int lean_chunks(const Tile& tile) const;
+
+            // Return true if one and two transformed together need
+            // no more work memory than their two budgets.
+            static bool pair_fits(const ImpactTransform& one, const ImpactTransform& two);
+
+            // Add the tile data of the wires from wbeg into the rows
+            // of data, over the first nsamples ticks.
+            void add_tiles(Array::array_xxf& data, int wbeg, int nsamples) const;
+
+            // Return the half open range of wires holding charge.
+            std::pair<int,int> wire_range() const;
+
+            // Convolve the tile data of the wires in [wbeg,wend) with
+            // the long-range response in batches of wires, calling
+            // func(w0, data) for each with data holding the rows of
+            // wires from w0 over the padded length.
+            void long_batches(int wbeg, int wend,
+                              std::function<void(int w0, const Array::array_xxf& data)> func) const;
 
+            // Pad a charge window into a tile.
+            Tile make_tile(int start_ch, int end_ch, int start_tick, int end_tick) const;
+            // Cluster the charge into tiles and set the grid to fill
+            // them, leaving m_tiles empty if one tile would do.
+            void make_tiles(BinnedDiffusion_transform::ChargeGrid& grid,
+                            int start_ch, int end_ch, int start_tick, int end_tick,
+                            int tile_wires, int tile_ticks);
+            // Convolve the paired impact groups, returning the sum in
+            // (wire, frequency) domain.
+            // If resp_spectra is null, build them per group and use
+            // nlean threads.
+            Array::array_xxc convolve_pairs(Tile& tile, const std::vector<Array::array_xxc>* resp_spectra,
+                                            int nlean = 0);
+            // Fill the charge of the central impact group in (wire, tick).
+            Array::array_xxf central_charge(Tile& tile);
+            // Finish the inverse transform into the tile data.
+            void finish(Tile& tile, Array::array_xxc& acc_data_f_w);
+            // Print the size of the result and the memory high-water
+            // mark, once per transform.
+            void report() const;
 	    
         };
 
@@ -4,6 +4,9 @@
 #include "WireCellIface/IPlaneImpactResponse.h"
 #include "WireCellGen/BinnedDiffusion.h"
 
+#include <map>
+#include <mutex>
+
 namespace WireCell {
     namespace Gen {
 
@@ -17,13 +20,30 @@ namespace WireCell {
         {
             IPlaneImpactResponse::pointer m_pir;
             BinnedDiffusion& m_bd;
+            bool m_precomputed;
+
+            // Response spectra at short FFT lengths, by response and
+            // length, the extent of nonzero response and the phase
+            // factors exp(-2*pi*i*k/n) by length n.
+            mutable std::map<std::pair<const IImpactResponse*, int>, Waveform::compseq_t> m_short_spectra;
+            mutable std::map<const IImpactResponse*, int> m_support;
+            mutable std::map<int, Waveform::compseq_t> m_phases;
+            mutable std::mutex m_mutex;
+
+            const Waveform::compseq_t& response_spectrum(const IImpactResponse::pointer& ir, int nfft) const;
+            int response_support(const IImpactResponse::pointer& ir) const;
+            const Waveform::compseq_t& phases(int nfft) const;
 
         public:
 
             ImpactZipper(IPlaneImpactResponse::pointer pir, BinnedDiffusion& bd);
             virtual ~ImpactZipper();
 
-            /// Return the wire's waveform.  If the response functions
+            /// Return the wire's waveform.  The impacts are convolved
+            /// with an FFT just long enough to hold the window of
+            /// ticks they hold charge in plus the extent of the
+            /// responses, each impact spectrum phase shifted to its
+            /// place in the window.  If the response functions
             /// are just field response (ie, instantaneous current)
             /// then the waveforms are expressed as current integrated
             /// over each sample bin and thus in units of charge.  If
@@ -35,6 +55,16 @@ namespace WireCell {
             // fixme: this should be a forward iterator so that it may cal bd.erase() safely to conserve memory
             Waveform::realseq_t waveform(int wire) const;
 
+            /// Calculate the spectra of all impacts up front with up
+            /// to nthreads threads, see
+            /// BinnedDiffusion::calculate_all().  After this,
+            /// waveform() keeps the impacts, uses more memory and
+            /// may be called for any wires in any order and from
+            /// several threads.  Without it, wires must be taken in
+            /// increasing order as each call drops the impacts
+            /// below its wire.
+            void precompute(int nthreads = 1);
+
         };
 
     }  // Gen
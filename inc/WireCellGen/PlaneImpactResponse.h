@@ -5,12 +5,32 @@
 #include "WireCellIface/IConfigurable.h"
 
 #include "WireCellUtil/Waveform.h"
+#include "WireCellUtil/Response.h"
 #include "WireCellUtil/Units.h"
 
+#include <mutex>
+
 namespace WireCell {
 
     namespace Gen {
 
+    /** The long-range response, the same for all impact responses
+     * of a plane and shared by them.  Planes with identical long
+     * responses also share it.
+     */
+    struct LongResponse {
+        Waveform::realseq_t waveform;
+        int pad;
+        Waveform::compseq_t spectrum;
+        std::once_flag spectrum_once;
+
+        LongResponse(const Waveform::realseq_t& wf, int pad) : waveform(wf), pad(pad) {}
+
+        /// Return the shared long response equal to the given one,
+        /// making it if none exists.
+        static std::shared_ptr<LongResponse> shared(const Waveform::realseq_t& wf, int pad);
+    };
+
     /** The information about detector response at a particular impact
      * position (discrete position along the pitch direction of a
      * plane on which a response function is defined).  Note,
@@ -21,25 +41,32 @@ namespace WireCell {
 	Waveform::compseq_t m_spectrum;
 	Waveform::realseq_t m_waveform;
 	int m_waveform_pad;
+        size_t m_nbins;
+
+        std::shared_ptr<LongResponse> m_long;
 
-	Waveform::compseq_t m_long_spectrum;
-	Waveform::realseq_t m_long_waveform;
-	int m_long_waveform_pad;
+	// spectra are calculated on first use, possibly from
+	// several threads at once.
+	std::once_flag m_spectrum_once;
 
     public:
-	ImpactResponse(int impact, const Waveform::realseq_t& wf, int waveform_pad, const Waveform::realseq_t& long_wf, int long_waveform_pad)
-	  : m_impact(impact), m_waveform(wf), m_waveform_pad(waveform_pad)
-	  , m_long_waveform(long_wf), m_long_waveform_pad(long_waveform_pad)
+	ImpactResponse(int impact, const Waveform::realseq_t& wf, int waveform_pad, size_t nbins,
+                       std::shared_ptr<LongResponse> long_response)
+	  : m_impact(impact), m_waveform(wf), m_waveform_pad(waveform_pad), m_nbins(nbins)
+	  , m_long(long_response)
 	{}
 
-	/// Frequency-domain spectrum of response
+	/// Frequency-domain spectrum of response over the full nbins
+	/// of the plane.
 	const Waveform::compseq_t& spectrum();
+	/// The response is kept only over its padded length, which
+	/// may be less than nbins.  Later samples are zero.
 	const Waveform::realseq_t& waveform() const {return m_waveform;};
 	int waveform_pad() const {return m_waveform_pad;};
 
 	const Waveform::compseq_t& long_aux_spectrum();
-	const Waveform::realseq_t& long_aux_waveform() const {return m_long_waveform;};
-	int long_aux_waveform_pad() const {return m_long_waveform_pad;};
+	const Waveform::realseq_t& long_aux_waveform() const {return m_long->waveform;};
+	int long_aux_waveform_pad() const {return m_long->pad;};
 	
 	
 
@@ -100,6 +127,26 @@ namespace WireCell {
 	const wire_region_indicies_t& bywire_map() const { return m_bywire; }
 	std::pair<int,int> closest_wire_impact(double relpitch) const;
 
+        /// True if configured to provide the field and short
+        /// responses separately for a two stage convolution.  Their
+        /// linear convolution approximates the combined response:
+        /// the short responses are trimmed below 1e-6 of their
+        /// peak and the combined response is circular over the
+        /// overall short padding so whatever of it extends past
+        /// that wraps to the start.
+        bool split_short() const { return m_split_short; }
+        /// Field response, without short responses, of the impact
+        /// response with the given impact number.  Sampled at the
+        /// tick and spanning field_pad() ticks.  Empty if not
+        /// split_short().
+        const Waveform::realseq_t& field_waveform(int impact) const { return m_field_wf.at(impact); }
+        int field_pad() const { return m_field_pad; }
+        /// Product of the short (electronics, RC) responses in time
+        /// domain.  Empty if there are no short responses.  It
+        /// spans short_pad() ticks.
+        const Waveform::realseq_t& short_waveform() const { return m_short_wf; }
+        int short_pad() const { return m_short_pad; }
+
 
     private:
         std::string m_frname;
@@ -107,6 +154,8 @@ namespace WireCell {
 	double m_overall_short_padding;
 	std::vector<std::string> m_long;
 	double m_long_padding;
+        bool m_split_short;
+        std::string m_cache_dir;
 	
 	int m_plane_ident;
         size_t m_nbins;
@@ -117,8 +166,20 @@ namespace WireCell {
 	std::vector<IImpactResponse::pointer> m_ir;
 	double m_half_extent, m_pitch, m_impact;
 
+        std::vector<Waveform::realseq_t> m_field_wf;
+        int m_field_pad;
+        Waveform::realseq_t m_short_wf;
+        int m_short_pad;
+
         void build_responses();
 
+        // The on-disk cache of built responses.  Its key hashes the
+        // field response data and all configuration which enters
+        // the build.
+        std::string cache_key(const Response::Schema::FieldResponse& fr) const;
+        bool load_cache(const std::string& path);
+        void save_cache(const std::string& path) const;
+
     };
 
 }}
@@ -15,7 +15,7 @@ namespace WireCell {
         public:
             Random(const std::string& generator = "default",
                    const std::vector<unsigned int> seeds = {0,0,0,0,0});
-            virtual ~Random() {}
+            virtual ~Random();
             
             // IConfigurable interface
             virtual void configure(const WireCell::Configuration& config);
@@ -43,8 +43,25 @@ namespace WireCell {
             std::string m_generator;
             std::vector<unsigned int> m_seeds;
             IRandom* m_pimpl;
+
+            void make_engine(const std::string& generator);
         };
 
+        /// Return a new generator seeded by values drawn from the
+        /// parent, or nullptr if parent is nullptr.  Tasks run in
+        /// parallel each get one, made in a fixed order, so that
+        /// their random sequences do not depend on thread scheduling.
+        IRandom::pointer random_substream(IRandom::pointer parent);
+
+        /// Distribute ntotal counts over bins with the given
+        /// probabilities, which need not be normalized, as a
+        /// multinomial.  The counts always sum to ntotal.  Each bin
+        /// is drawn as a binomial of what remains, conditioned on
+        /// the bins before it.  Draws with a variance above
+        /// `normal_var` use the normal approximation.
+        void multinomial(IRandom& rng, int ntotal, const std::vector<double>& probs,
+                         std::vector<int>& counts, double normal_var = 25.0);
+
     }
 }
 #endif
@@ -0,0 +1,101 @@
+/**
+   A ResponseSpectraCache keeps the 2D response spectra which an
+   ImpactTransform builds for a plane impact response and an FFT
+   shape, and the spectra of the long-range response.
+
+   The cache is bounded in bytes and drops the least recently used
+   entries to make room.  An entry is built once, outside of the
+   lock, by the first caller and other callers asking for it wait
+   on that build.  Entries are keyed by the address of the plane
+   impact response so the owner must keep the responses alive for as
+   long as the cache, eg by making a new cache when reconfigured.
+
+   Spectra for arbitrary shapes rarely repeat so users of the cache
+   should round their FFT shapes with canonical_length().
+ */
+
+#ifndef WIRECELLGEN_RESPONSESPECTRACACHE
+#define WIRECELLGEN_RESPONSESPECTRACACHE
+
+#include "WireCellIface/IPlaneImpactResponse.h"
+#include "WireCellUtil/Array.h"
+#include "WireCellUtil/Waveform.h"
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace WireCell {
+    namespace Gen {
+
+        class ResponseSpectraCache {
+        public:
+
+            /// Response spectra, one per impact group pair, over a
+            /// (wire, tick) FFT shape.
+            typedef std::shared_ptr<const std::vector<Array::array_xxc> > spectra_pointer;
+
+            /// Spectrum of the long-range response at some length.
+            typedef std::shared_ptr<const Waveform::compseq_t> long_pointer;
+
+            /// Hold at most max_bytes of spectra.
+            ResponseSpectraCache(size_t max_bytes);
+
+            /// Return the nspectra spectra of shape (nwires, nticks)
+            /// for the pir, calling build if they are not cached.
+            /// Safe to call from many threads.
+            spectra_pointer spectra(const IPlaneImpactResponse* pir, int nspectra, int nwires, int nticks,
+                                    std::function<spectra_pointer()> build);
+
+            /// Return the long-range spectrum of length nlength for
+            /// the pir, calling build if it is not cached.
+            long_pointer long_spectrum(const IPlaneImpactResponse* pir, int nlength,
+                                       std::function<long_pointer()> build);
+
+            /// Return the smallest of 2^k, 5*2^(k-2) and 3*2^(k-1)
+            /// which is at least n and at least 8.  These are even
+            /// and fast to transform and round up by less than a
+            /// third.
+            static int canonical_length(int n);
+
+            size_t max_bytes() const { return m_max_bytes; }
+
+            /// Bytes of the spectra held now.
+            size_t bytes() const;
+
+            size_t hits() const { return m_hits; }
+            size_t misses() const { return m_misses; }
+
+            /// Fraction of lookups found in the cache, or 0 if none.
+            double hit_rate() const;
+
+            /// Zero the hit and miss counts.
+            void reset_counts();
+
+        private:
+            typedef std::tuple<const void*, int, int> key_t; // pir, nwires (0 if long), nticks
+            typedef std::shared_ptr<const void> value_t;
+            struct Entry {
+                key_t key;
+                size_t nbytes;
+                size_t serial;
+                std::shared_future<value_t> value;
+            };
+
+            value_t get(const key_t& key, size_t nbytes, std::function<value_t()> build);
+
+            size_t m_max_bytes, m_bytes, m_serial;
+            mutable std::mutex m_mutex;
+            std::list<Entry> m_entries; // most recently used first
+            std::atomic<size_t> m_hits, m_misses;
+        };
+
+    }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef WIRECELLGEN_THREADUTIL
+#define WIRECELLGEN_THREADUTIL
+
+#include "WireCellUtil/Configuration.h"
+
+#include <functional>
+#include <string>
+
+namespace WireCell {
+    namespace Gen {
+
+        /// Return a usable number of threads.  A positive nthreads
+        /// is returned as is, otherwise the hardware concurrency (or
+        /// 1 if that is unknown).
+        int resolve_nthreads(int nthreads);
+
+        /// Read a thread count from the configuration attribute
+        /// named by key.  The value may be an integer or the string
+        /// "auto" to use the hardware concurrency.  A missing or
+        /// null attribute returns def.
+        int get_nthreads(const Configuration& cfg, const std::string& key, int def=1);
+
+        /// Split the task range [0,ntasks) into at most nthreads
+        /// contiguous chunks and call func(ichunk, begin, end) for
+        /// each chunk.  The first chunk runs in the caller's thread
+        /// and the others on a pool of worker threads kept for the
+        /// whole job, so no threads are started per call.  Calls
+        /// may nest: a thread waiting for its chunks runs other
+        /// queued chunks meanwhile and the pool only grows to the
+        /// largest nthreads asked for.  The split depends only on
+        /// ntasks and nthreads so that callers which reduce
+        /// per-chunk results in chunk order are deterministic.
+        /// Returns the number of chunks.  An exception thrown by
+        /// func is rethrown here after all chunks have finished.
+        ///
+        /// Chunks in Gen call the Array and Waveform DFTs
+        /// concurrently.  These make their own Eigen FFT object,
+        /// and so their own plans, per call and are reentrant with
+        /// the default (kissfft) Eigen FFT backend, which
+        /// test_threadutil checks.  A build with a backend whose
+        /// plan creation is not thread safe (eg FFTW without its
+        /// thread safe planner) must keep all thread counts at 1.
+        int parallel_chunks(int nthreads, int ntasks,
+                            std::function<void(int ichunk, int begin, int end)> func);
+
+        /// Call func(itask) for each task in [0,ntasks) on at most
+        /// nthreads threads, as parallel_chunks(), but with each
+        /// thread taking the next task not yet started.  Tasks thus
+        /// start in order, which suits callers which consume
+        /// results in task order as they finish, and uneven tasks
+        /// are balanced.  Which thread runs a task is not
+        /// deterministic.
+        void parallel_tasks(int nthreads, int ntasks, std::function<void(int itask)> func);
+
+    }
+}
+#endif
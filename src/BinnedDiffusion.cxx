@@ -1,7 +1,9 @@
 #include "WireCellGen/BinnedDiffusion.h"
 #include "WireCellGen/GaussianDiffusion.h"
+#include "WireCellGen/ThreadUtil.h"
 #include "WireCellUtil/Units.h"
 
+#include <algorithm>
 #include <iostream>             // debug
 using namespace std;
 
@@ -19,6 +21,8 @@ Gen::BinnedDiffusion::BinnedDiffusion(const Pimpos& pimpos, const Binning& tbins
     , m_window(0,0)
     , m_outside_pitch(0)
     , m_outside_time(0)
+    , m_pitch_extent(nsigma)
+    , m_time_extent(nsigma)
 {
 }
 
@@ -101,8 +105,13 @@ void Gen::BinnedDiffusion::add(std::shared_ptr<GaussianDiffusion> gd, int bin)
              << " charge=" << gd->depo()->charge()/units::eplus << " eles"
              <<", for bin " << bin << " t=[" << mm.first/units::us << "," << mm.second/units::us << "]us\n";
     }
-    m_diffs.insert(gd);
-    //m_diffs.push_back(gd);
+    if (m_diffs.empty() || m_diffs.back() != gd) {
+        m_diffs.push_back(gd);
+        m_pitch_extent.add(gd->pitch_desc());
+        m_time_extent.add(gd->time_desc());
+        m_pitch_centers.add(gd->pitch_desc());
+        m_time_centers.add(gd->time_desc());
+    }
 }
 
 void Gen::BinnedDiffusion::erase(int begin_impact_number, int end_impact_number)
@@ -125,10 +134,13 @@ Gen::ImpactData::pointer Gen::BinnedDiffusion::impact_data(int bin) const
 	return nullptr;
     }
     auto idptr = it->second;
+    if (idptr->calculated()) {
+        return idptr;
+    }
 
     // make sure all diffusions have been sampled 
     for (auto diff : idptr->diffusions()) {
-      diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat);
+      diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat, m_kcache.get());
       //diff->set_sampling(m_tbins, ib, m_nsigma, 0, m_calcstrat);
     }
 
@@ -136,6 +148,46 @@ Gen::ImpactData::pointer Gen::BinnedDiffusion::impact_data(int bin) const
     return idptr;
 }
 
+void Gen::BinnedDiffusion::calculate_all(int nthreads)
+{
+    const auto ib = m_pimpos.impact_binning();
+
+    std::vector<ImpactData::mutable_pointer> impacts;
+    std::vector<GaussianDiffusion*> diffs;
+    for (const auto& it : m_impacts) {
+        if (!ib.inbounds(it.first)) {
+            continue;
+        }
+        impacts.push_back(it.second);
+        for (const auto& diff : it.second->diffusions()) {
+            diffs.push_back(diff.get());
+        }
+    }
+
+    if (m_fluctuate) {
+        for (auto diff : diffs) {
+            diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat, m_kcache.get());
+        }
+    }
+    else {
+        // A diffusion spans several impacts, sample it once.
+        std::sort(diffs.begin(), diffs.end());
+        diffs.erase(std::unique(diffs.begin(), diffs.end()), diffs.end());
+        parallel_chunks(nthreads, diffs.size(), [&](int, int beg, int end) {
+                for (int ind = beg; ind < end; ++ind) {
+                    diffs[ind]->set_sampling(m_tbins, ib, m_nsigma, nullptr, m_calcstrat, m_kcache.get());
+                }
+            });
+    }
+
+    const int nticks = m_tbins.nbins();
+    parallel_chunks(nthreads, impacts.size(), [&](int, int beg, int end) {
+            for (int ind = beg; ind < end; ++ind) {
+                impacts[ind]->calculate(nticks);
+            }
+        });
+}
+
 
 static
 std::pair<double,double> gausdesc_range(const std::vector<Gen::GausDesc> gds, double nsigma)
@@ -160,6 +212,12 @@ std::pair<double,double> gausdesc_range(const std::vector<Gen::GausDesc> gds, do
 
 std::pair<double,double> Gen::BinnedDiffusion::pitch_range(double nsigma) const
 {
+    if (nsigma == m_nsigma) {
+        return m_pitch_extent.range();
+    }
+    if (nsigma == 0.0) {
+        return m_pitch_centers.range();
+    }
     std::vector<Gen::GausDesc> gds;
     for (auto diff : m_diffs) {
         gds.push_back(diff->pitch_desc());
@@ -177,6 +235,12 @@ std::pair<int,int> Gen::BinnedDiffusion::impact_bin_range(double nsigma) const
 
 std::pair<double,double> Gen::BinnedDiffusion::time_range(double nsigma) const
 {
+    if (nsigma == m_nsigma) {
+        return m_time_extent.range();
+    }
+    if (nsigma == 0.0) {
+        return m_time_centers.range();
+    }
     std::vector<Gen::GausDesc> gds;
     for (auto diff : m_diffs) {
         gds.push_back(diff->time_desc());
@@ -1,9 +1,15 @@
 #include "WireCellGen/BinnedDiffusion_transform.h"
 #include "WireCellGen/GaussianDiffusion.h"
+#include "WireCellGen/Random.h"
+#include "WireCellGen/ThreadUtil.h"
+#include "WireCellIface/SimpleDepo.h"
 #include "WireCellUtil/Units.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>             // debug
-#include <unordered_map>
+#include <map>
+#include <mutex>
 using namespace std;
 
 using namespace WireCell;
@@ -31,6 +37,8 @@ Gen::BinnedDiffusion_transform::BinnedDiffusion_transform(const Pimpos& pimpos,
     , m_window(0,0)
     , m_outside_pitch(0)
     , m_outside_time(0)
+    , m_pitch_extent(nsigma)
+    , m_time_extent(nsigma)
 {
 }
 
@@ -41,17 +49,60 @@ bool Gen::BinnedDiffusion_transform::add(IDepo::pointer depo, double sigma_time,
     const double center_pitch = m_pimpos.distance(depo->pos());
 
     Gen::GausDesc time_desc(center_time, sigma_time);
-    {
-        double nmin_sigma = time_desc.distance(m_tbins.min());
-        double nmax_sigma = time_desc.distance(m_tbins.max());
+    Gen::GausDesc pitch_desc(center_pitch, sigma_pitch);
+    return add_diffusion(depo, time_desc, pitch_desc, 0.0, 0.0);
+}
+
+bool Gen::BinnedDiffusion_transform::add_segment(IDepo::pointer depo, const Point& end_pos, double end_time,
+                                                 double sigma_time, double sigma_pitch, int max_bins)
+{
+    const double center_time = depo->time();
+    const double center_pitch = m_pimpos.distance(depo->pos());
+    const double time_length = end_time - center_time;
+    const double pitch_length = m_pimpos.distance(end_pos) - center_pitch;
+
+    int npieces = 1;
+    if (time_length != 0 && pitch_length != 0) {
+        const double nbins = std::max(std::abs(time_length)/m_tbins.binsize(),
+                                      std::abs(pitch_length)/m_pimpos.impact_binning().binsize());
+        npieces = std::max(1, (int)std::ceil(nbins/std::max(max_bins, 1)));
+    }
+    if (npieces == 1) {
+        Gen::GausDesc time_desc(center_time, sigma_time);
+        Gen::GausDesc pitch_desc(center_pitch, sigma_pitch);
+        return add_diffusion(depo, time_desc, pitch_desc, time_length, pitch_length);
+    }
+
+    const Point step = (end_pos - depo->pos())/npieces;
+    bool any = false;
+    for (int ipiece = 0; ipiece < npieces; ++ipiece) {
+        const double tbeg = center_time + ipiece*time_length/npieces;
+        const double pbeg = center_pitch + ipiece*pitch_length/npieces;
+        auto piece = std::make_shared<SimpleDepo>(tbeg, depo->pos() + step*ipiece,
+                                                  depo->charge()/npieces, depo,
+                                                  depo->extent_long(), depo->extent_tran(),
+                                                  depo->id(), depo->pdg(), depo->energy()/npieces);
+        Gen::GausDesc time_desc(tbeg, sigma_time);
+        Gen::GausDesc pitch_desc(pbeg, sigma_pitch);
+        if (add_diffusion(piece, time_desc, pitch_desc, time_length/npieces, pitch_length/npieces)) {
+            any = true;
+        }
+    }
+    return any;
+}
 
-        double eff_nsigma = sigma_time>0?m_nsigma:0;
-        if (nmin_sigma > eff_nsigma || nmax_sigma < -eff_nsigma) {
+bool Gen::BinnedDiffusion_transform::add_diffusion(IDepo::pointer depo,
+                                                   const GausDesc& time_desc, const GausDesc& pitch_desc,
+                                                   double time_length, double pitch_length)
+{
+    {
+        GausDescRange r(time_desc.sigma>0?m_nsigma:0);
+        r.add(time_desc, time_length);
+        if (r.lo > m_tbins.max() || r.hi < m_tbins.min()) {
             // std::cerr << "BinnedDiffusion_transform: depo too far away in time sigma:"
-            //           << " t_depo=" << center_time/units::ms << "ms not in:"
+            //           << " t_depo=" << time_desc.center/units::ms << "ms not in:"
             //           << " t_bounds=[" << m_tbins.min()/units::ms << ","
-            //           << m_tbins.max()/units::ms << "]ms"
-            //           << " in Nsigma: [" << nmin_sigma << "," << nmax_sigma << "]\n";
+            //           << m_tbins.max()/units::ms << "]ms\n";
             ++m_outside_time;
             return false;
         }
@@ -59,37 +110,29 @@ bool Gen::BinnedDiffusion_transform::add(IDepo::pointer depo, double sigma_time,
 
     auto ibins = m_pimpos.impact_binning();
 
-    Gen::GausDesc pitch_desc(center_pitch, sigma_pitch);
     {
-        double nmin_sigma = pitch_desc.distance(ibins.min());
-        double nmax_sigma = pitch_desc.distance(ibins.max());
-
-        double eff_nsigma = sigma_pitch>0?m_nsigma:0;
-        if (nmin_sigma > eff_nsigma || nmax_sigma < -eff_nsigma) {
+        GausDescRange r(pitch_desc.sigma>0?m_nsigma:0);
+        r.add(pitch_desc, pitch_length);
+        if (r.lo > ibins.max() || r.hi < ibins.min()) {
             // std::cerr << "BinnedDiffusion_transform: depo too far away in pitch sigma: "
-            //           << " p_depo=" << center_pitch/units::cm << "cm not in:"
+            //           << " p_depo=" << pitch_desc.center/units::cm << "cm not in:"
             //           << " p_bounds=[" << ibins.min()/units::cm << ","
-            //           << ibins.max()/units::cm << "]cm"
-            //           << " in Nsigma:[" << nmin_sigma << "," << nmax_sigma << "]\n";
+            //           << ibins.max()/units::cm << "]cm\n";
             ++m_outside_pitch;
             return false;
         }
     }
 
-    // make GD and add to all covered impacts
-    // int bin_beg = std::max(ibins.bin(center_pitch - sigma_pitch*m_nsigma), 0);
-    // int bin_end = std::min(ibins.bin(center_pitch + sigma_pitch*m_nsigma)+1, ibins.nbins());
-    // debug
-    //int bin_center = ibins.bin(center_pitch);
-    //cerr << "DEBUG center_pitch: "<<center_pitch/units::cm<<endl; 
-    //cerr << "DEBUG bin_center: "<<bin_center<<endl;
-
-    auto gd = std::make_shared<GaussianDiffusion>(depo, time_desc, pitch_desc);
-    // for (int bin = bin_beg; bin < bin_end; ++bin) {
-    //   //   if (bin == bin_beg)  m_diffs.insert(gd);
-    //   this->add(gd, bin);
-    // }
-    m_diffs.insert(gd);
+    m_diffs.emplace_back(depo, time_desc, pitch_desc, time_length, pitch_length);
+    m_pitch_extent.add(pitch_desc, pitch_length);
+    m_time_extent.add(time_desc, time_length);
+    m_pitch_centers.add(pitch_desc, pitch_length);
+    m_time_centers.add(time_desc, time_length);
+
+    std::array<int,4> ext;
+    if (m_imp_channel && charge_extent(m_diffs.back(), *m_imp_channel, ext)) {
+        occupy(ext);
+    }
     return true;
 }
 
@@ -125,52 +168,111 @@ bool Gen::BinnedDiffusion_transform::add(IDepo::pointer depo, double sigma_time,
 // }
 
 
+namespace {
+    // Per impact bin: its channel and its impact number relative to
+    // that channel's wire.  This depends only on the Pimpos geometry.
+    struct ImpactGeometry {
+        std::vector<int> channel, redimp;
+        int min_redimp, max_redimp;
+    };
+
+    // Return the geometry of the pimpos, made once for each distinct
+    // wire and impact binning and shared by all later callers.
+    std::shared_ptr<const ImpactGeometry> impact_geometry(const Pimpos& pimpos)
+    {
+        const auto rb = pimpos.region_binning();
+        const auto ib = pimpos.impact_binning();
+        const std::vector<double> key{(double)rb.nbins(), rb.min(), rb.max(),
+                                      (double)ib.nbins(), ib.min(), ib.max()};
+
+        static std::mutex mutex;
+        static std::map<std::vector<double>, std::shared_ptr<const ImpactGeometry> > cache;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            return it->second;
+        }
+
+        // Later wires overwrite impacts shared with earlier ones.
+        auto geom = std::make_shared<ImpactGeometry>();
+        const int max_imp = ib.nbins();
+        geom->channel.assign(max_imp, 0);
+        geom->redimp.assign(max_imp, 0);
+        for (int wireind=0; wireind!=rb.nbins(); wireind++){
+            const int wire_imp_no = pimpos.wire_impact(wireind);
+            const auto imps_range = pimpos.wire_impacts(wireind);
+            for (int imp_no = std::max(imps_range.first, 0); imp_no < std::min(imps_range.second, max_imp); imp_no++){
+                geom->channel[imp_no] = wireind;
+                geom->redimp[imp_no] = imp_no - wire_imp_no;
+            }
+        }
+        geom->min_redimp = geom->max_redimp = 0;
+        for (int redimp : geom->redimp) {
+            geom->min_redimp = std::min(geom->min_redimp, redimp);
+            geom->max_redimp = std::max(geom->max_redimp, redimp);
+        }
+        cache[key] = geom;
+        return geom;
+    }
+
+    // Per impact bin: channel and the two impact groups sharing its charge.
+    struct ImpactLookup {
+        std::vector<int> channel, group, next_group;
+    };
+
+    // Resolve the impact groups, ordered as the reduced impacts in
+    // vec_impact.  A reduced impact not in vec_impact gives group 0.
+    ImpactLookup make_lookup(const ImpactGeometry& geom, const std::vector<int>& vec_impact)
+    {
+        const int off = geom.min_redimp;
+        std::vector<int> redimp_group(geom.max_redimp - off + 2, 0);
+        for (size_t ind = 0; ind != vec_impact.size(); ++ind) {
+            const int rel = vec_impact[ind] - off;
+            if (rel >= 0 && rel < (int)redimp_group.size()) {
+                redimp_group[rel] = ind;
+            }
+        }
+
+        ImpactLookup lu;
+        lu.channel = geom.channel;
+        const int max_imp = geom.redimp.size();
+        lu.group.resize(max_imp);
+        lu.next_group.resize(max_imp);
+        for (int imp = 0; imp < max_imp; ++imp) {
+            lu.group[imp] = redimp_group[geom.redimp[imp] - off];
+            lu.next_group[imp] = redimp_group[geom.redimp[imp] + 1 - off];
+        }
+        return lu;
+    }
+}
+
 void Gen::BinnedDiffusion_transform::get_charge_matrix(std::vector<Eigen::SparseMatrix<float>* >& vec_spmatrix, std::vector<int>& vec_impact){
   const auto ib = m_pimpos.impact_binning();
 
-  // map between reduced impact # to array # 
-  std::map<int,int> map_redimp_vec;
-  for (size_t i =0; i!= vec_impact.size(); i++){
-    map_redimp_vec[vec_impact[i]] = int(i);
-  }
+  const auto lu = make_lookup(*impact_geometry(m_pimpos), vec_impact);
 
-  const auto rb = m_pimpos.region_binning();
-  // map between impact # to channel #
-  std::map<int, int> map_imp_ch;
-  // map between impact # to reduced impact # 
-  std::map<int, int> map_imp_redimp;
-
-  //std::cout << ib.nbins() << " " << rb.nbins() << std::endl;
-  for (int wireind=0;wireind!=rb.nbins();wireind++){
-    int wire_imp_no = m_pimpos.wire_impact(wireind);
-    std::pair<int,int> imps_range = m_pimpos.wire_impacts(wireind);
-    for (int imp_no = imps_range.first; imp_no != imps_range.second; imp_no ++){
-      map_imp_ch[imp_no] = wireind;
-      map_imp_redimp[imp_no] = imp_no - wire_imp_no;
-      
-      //  std::cout << imp_no << " " << wireind << " " << wire_imp_no << " " << ib.center(imp_no) << " " << rb.center(wireind) << " " <<  ib.center(imp_no) - rb.center(wireind) << std::endl;
-      // std::cout << imp_no << " " << map_imp_ch[imp_no] << " " << map_imp_redimp[imp_no] << std::endl;
-    }
-  }
-  
   int min_imp = 0;
   int max_imp = ib.nbins();
 
 
-   for (auto diff : m_diffs){
+   for (auto& gd : m_diffs){
+    auto diff = &gd;
     //    std::cout << diff->depo()->time() << std::endl
     //diff->set_sampling(m_tbins, ib, m_nsigma, 0, m_calcstrat);
-    diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat);
+    diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat, m_kcache.get());
     //counter ++;
     
-    const auto patch = diff->patch();
-    const auto qweight = diff->weights();
+    const bool separable = diff->separable();
+    const auto& pvec = diff->pitch_vec();
+    const auto& tvec = diff->time_vec();
+    const auto* patch = separable ? nullptr : &diff->patch();
+    const auto& qweight = diff->weights();
 
     const int poffset_bin = diff->poffset_bin();
     const int toffset_bin = diff->toffset_bin();
 
-    const int np = patch.rows();
-    const int nt = patch.cols();
+    const int np = separable ? pvec.size() : patch->rows();
+    const int nt = separable ? tvec.size() : patch->cols();
     
     for (int pbin = 0; pbin != np; pbin++){
       int abs_pbin = pbin + poffset_bin;
@@ -179,12 +281,12 @@ void Gen::BinnedDiffusion_transform::get_charge_matrix(std::vector<Eigen::Sparse
 
       for (int tbin = 0; tbin!= nt; tbin++){
 	int abs_tbin = tbin + toffset_bin;
-	double charge = patch(pbin, tbin);
+	double charge = separable ? (float)(pvec[pbin]*tvec[tbin]) : (*patch)(pbin, tbin);
 
 	// std::cout << map_redimp_vec[map_imp_redimp[abs_pbin] ] << " " << map_redimp_vec[map_imp_redimp[abs_pbin]+1] << " " << abs_tbin << " " << map_imp_ch[abs_pbin] << std::endl;
 	
-	vec_spmatrix.at(map_redimp_vec[map_imp_redimp[abs_pbin] ])->coeffRef(abs_tbin,map_imp_ch[abs_pbin]) += charge * weight; 
-	vec_spmatrix.at(map_redimp_vec[map_imp_redimp[abs_pbin]+1])->coeffRef(abs_tbin,map_imp_ch[abs_pbin]) += charge*(1-weight);
+	vec_spmatrix.at(lu.group[abs_pbin])->coeffRef(abs_tbin,lu.channel[abs_pbin]) += charge * weight; 
+	vec_spmatrix.at(lu.next_group[abs_pbin])->coeffRef(abs_tbin,lu.channel[abs_pbin]) += charge*(1-weight);
 	
 	// if (map_tuple_pos.find(std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]],map_imp_ch[abs_pbin],abs_tbin))==map_tuple_pos.end()){
 	//   map_tuple_pos[std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]],map_imp_ch[abs_pbin],abs_tbin)] = vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin] ]).size();
@@ -219,166 +321,215 @@ void Gen::BinnedDiffusion_transform::get_charge_matrix(std::vector<Eigen::Sparse
   
 }
 
-// a new function to generate the result for the entire frame ... 
-void Gen::BinnedDiffusion_transform::get_charge_vec(std::vector<std::vector<std::tuple<int,int, double> > >& vec_vec_charge, std::vector<int>& vec_impact){
+bool Gen::BinnedDiffusion_transform::charge_extent(const GaussianDiffusion& diff, const std::vector<int>& imp_channel,
+                                                   std::array<int,4>& extent) const
+{
+  // Same ranges as GaussianDiffusion::set_sampling() gives the patch.
   const auto ib = m_pimpos.impact_binning();
-
-  // map between reduced impact # to array # 
-
-  std::map<int,int> map_redimp_vec;
-  std::vector<std::unordered_map<long int, int> > vec_map_pair_pos;
-  for (size_t i =0; i!= vec_impact.size(); i++){
-    map_redimp_vec[vec_impact[i]] = int(i);
-    std::unordered_map<long int, int> map_pair_pos;
-    vec_map_pair_pos.push_back(map_pair_pos);
+  const int max_imp = ib.nbins();
+  auto tval_range = diff.time_range(m_nsigma);
+  auto tbin_range = m_tbins.sample_bin_range(tval_range.first, tval_range.second);
+  auto pval_range = diff.pitch_range(m_nsigma);
+  auto pbin_range = ib.sample_bin_range(pval_range.first, pval_range.second);
+  const int pbeg = std::max(pbin_range.first, 0);
+  const int pend = std::min(pbin_range.second, max_imp);
+  if (pend <= pbeg || tbin_range.second <= tbin_range.first) {
+    return false;
   }
+  extent = {imp_channel[pbeg], imp_channel[pend-1]+1, tbin_range.first, tbin_range.second};
+  return true;
+}
 
-  const auto rb = m_pimpos.region_binning();
-  // map between impact # to channel #
-  std::map<int, int> map_imp_ch;
-  // map between impact # to reduced impact # 
-  std::map<int, int> map_imp_redimp;
-
-
-  //std::cout << ib.nbins() << " " << rb.nbins() << std::endl;
-  for (int wireind=0;wireind!=rb.nbins();wireind++){
-    int wire_imp_no = m_pimpos.wire_impact(wireind);
-    std::pair<int,int> imps_range = m_pimpos.wire_impacts(wireind);
-    for (int imp_no = imps_range.first; imp_no != imps_range.second; imp_no ++){
-      map_imp_ch[imp_no] = wireind;
-      map_imp_redimp[imp_no] = imp_no - wire_imp_no;
-      
-      //  std::cout << imp_no << " " << wireind << " " << wire_imp_no << " " << ib.center(imp_no) << " " << rb.center(wireind) << " " <<  ib.center(imp_no) - rb.center(wireind) << std::endl;
-      // std::cout << imp_no << " " << map_imp_ch[imp_no] << " " << map_imp_redimp[imp_no] << std::endl;
+void Gen::BinnedDiffusion_transform::get_charge_extents(std::vector<std::array<int,4> >& extents) const
+{
+  const auto geom = impact_geometry(m_pimpos);
+  std::array<int,4> ext;
+  for (const auto& diff : m_diffs){
+    if (charge_extent(diff, geom->channel, ext)) {
+      extents.push_back(ext);
     }
   }
+}
 
-  //  std::unordered_map<stgsd::tuple<int,int,int>, int> map_tuple_pos;
-  
-  
-  
-  //  int min_redimp =  m_pimpos.wire_impacts(2).first - m_pimpos.wire_impact(2);
-  //  int max_redimp =  m_pimpos.wire_impacts(2).second - 1 - m_pimpos.wire_impact(2);
-  int min_imp = 0;
-  int max_imp = ib.nbins();
-
-  // std::cout << min_redimp << " " << max_redimp << " " << max_imp << std::endl;
-
-  int counter = 0;
-
-  // std::set<std::shared_ptr<GaussianDiffusion>, GausDiffTimeCompare> m_diffs1;
-  // for (auto diff : m_diffs){
-  //    diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat);
-  //    m_diffs1.insert(diff);
-  // }
-  
-  
-  for (auto diff : m_diffs){
-    //    std::cout << diff->depo()->time() << std::endl
-    //diff->set_sampling(m_tbins, ib, m_nsigma, 0, m_calcstrat);
-    diff->set_sampling(m_tbins, ib, m_nsigma, m_fluctuate, m_calcstrat);
-    counter ++;
-    
-    const auto patch = diff->patch();
-    const auto qweight = diff->weights();
+void Gen::BinnedDiffusion_transform::set_occupancy_cells(int cell_wires, int cell_ticks)
+{
+  m_occupancy = Occupancy();
+  m_imp_channel = nullptr;
+  if (cell_wires <= 0 || cell_ticks <= 0) {
+    return;
+  }
+  const auto geom = impact_geometry(m_pimpos);
+  m_imp_channel = std::shared_ptr<const std::vector<int> >(geom, &geom->channel);
+  m_occupancy.cell_wires = cell_wires;
+  m_occupancy.cell_ticks = cell_ticks;
+  m_occupancy.ncw = (m_pimpos.region_binning().nbins() + cell_wires - 1)/cell_wires;
+  m_occupancy.nct = (m_tbins.nbins() + cell_ticks - 1)/cell_ticks;
+  m_occupancy.counts.assign(m_occupancy.ncw*m_occupancy.nct, 0);
+  std::array<int,4> ext;
+  for (const auto& diff : m_diffs) {
+    if (charge_extent(diff, *m_imp_channel, ext)) {
+      occupy(ext);
+    }
+  }
+}
 
-    const int poffset_bin = diff->poffset_bin();
-    const int toffset_bin = diff->toffset_bin();
+void Gen::BinnedDiffusion_transform::occupy(const std::array<int,4>& ext)
+{
+  auto& occ = m_occupancy;
+  const int cw1 = std::min((ext[1]-1)/occ.cell_wires, occ.ncw-1);
+  const int ct1 = std::min((ext[3]-1)/occ.cell_ticks, occ.nct-1);
+  for (int cw = std::max(ext[0]/occ.cell_wires, 0); cw <= cw1; ++cw) {
+    for (int ct = std::max(ext[2]/occ.cell_ticks, 0); ct <= ct1; ++ct) {
+      ++occ.counts[cw*occ.nct + ct];
+    }
+  }
+}
 
-    const int np = patch.rows();
-    const int nt = patch.cols();
 
-    // std::cout << np << " " << nt << std::endl;
-    
-    for (int pbin = 0; pbin != np; pbin++){
-      int abs_pbin = pbin + poffset_bin;
-      if (abs_pbin < min_imp || abs_pbin >= max_imp) continue;
-      double weight = qweight[pbin];
-      auto const channel = map_imp_ch[abs_pbin];
-      auto const redimp = map_imp_redimp[abs_pbin];
-      auto const array_num_redimp = map_redimp_vec[redimp];
-      auto const next_array_num_redimp = map_redimp_vec[redimp+1];
+namespace {
+    // Add the rows of a sampled patch whose channel is in [chbeg,
+    // chend) into the grid's windows.
+    void add_patch(Gen::BinnedDiffusion_transform::ChargeGrid& grid, const Gen::GaussianDiffusion& diff,
+                   const ImpactLookup& lu, int chbeg, int chend)
+    {
+        // A separable patch is used as its outer product as calling
+        // patch() would fill it, which is not thread safe.
+        const bool separable = diff.separable();
+        const auto& pvec = diff.pitch_vec();
+        const auto& tvec = diff.time_vec();
+        const auto* patch = separable ? nullptr : &diff.patch();
+        const auto& qweight = diff.weights();
+
+        const int poffset_bin = diff.poffset_bin();
+        const int toffset_bin = diff.toffset_bin();
+
+        const int np = separable ? pvec.size() : patch->rows();
+        const int nt = separable ? tvec.size() : patch->cols();
+        const int min_imp = 0;
+        const int max_imp = lu.channel.size();
+        const int ncells = grid.cell_window.size();
+
+        for (int pbin = 0; pbin != np; pbin++){
+            int abs_pbin = pbin + poffset_bin;
+            if (abs_pbin < min_imp || abs_pbin >= max_imp) continue;
+            auto const channel = lu.channel[abs_pbin];
+            if (channel < chbeg || channel >= chend) continue;
+            const float weight = qweight[pbin];
+            auto const array_num_redimp = lu.group[abs_pbin];
+            auto const next_array_num_redimp = lu.next_group[abs_pbin];
+
+            const int cw = (channel - grid.start_ch)/grid.cell_wires;
+            if (channel < grid.start_ch || cw >= grid.ncw) continue;
+
+            // Split the row of the patch over the windows it crosses.
+            int tbin = 0;
+            while (tbin < nt) {
+                const int abs_tbin = tbin + toffset_bin;
+                if (abs_tbin < grid.start_tick) {
+                    tbin += grid.start_tick - abs_tbin;
+                    continue;
+                }
+                const int ct = (abs_tbin - grid.start_tick)/grid.cell_ticks;
+                if (ct >= grid.nct) break;
+                const int tend = std::min(nt, grid.start_tick + (ct+1)*grid.cell_ticks - toffset_bin);
+                const int icell = cw*grid.nct + ct;
+                const int iwin = icell < ncells ? grid.cell_window[icell] : -1;
+                if (iwin >= 0) {
+                    auto& win = grid.windows[iwin];
+                    auto& group = win.groups.at(array_num_redimp);
+                    auto& next_group = win.groups.at(next_array_num_redimp);
+                    const int row = channel - win.start_ch;
+                    const int col0 = tbin + toffset_bin - win.start_tick;
+                    const int col1 = std::min(tend + toffset_bin - win.start_tick, (int)group.cols());
+                    if (row >= 0 && row < group.rows() && separable) {
+                        const double pval = pvec[pbin];
+                        for (int col = std::max(col0, 0); col < col1; ++col) {
+                            const float charge = pval*tvec[col - col0 + tbin];
+                            group(row, col) += charge*weight;
+                            next_group(row, col) += charge*(1-weight);
+                        }
+                    }
+                    else if (row >= 0 && row < group.rows()) {
+                        for (int col = std::max(col0, 0); col < col1; ++col) {
+                            const float charge = (*patch)(pbin, col - col0 + tbin);
+                            group(row, col) += charge*weight;
+                            next_group(row, col) += charge*(1-weight);
+                        }
+                    }
+                }
+                tbin = tend;
+            }
+        }
+    }
+}
 
-      auto& map_pair_pos = vec_map_pair_pos.at(array_num_redimp);
-      auto& next_map_pair_pos = vec_map_pair_pos.at(next_array_num_redimp);
+void Gen::BinnedDiffusion_transform::get_charge_grid(ChargeGrid& grid, const std::vector<int>& vec_impact, int nthreads){
+  const auto ib = m_pimpos.impact_binning();
 
-      auto& vec_charge = vec_vec_charge.at(array_num_redimp);
-      auto& next_vec_charge = vec_vec_charge.at(next_array_num_redimp);
+  // Flat lookup up front so the threads only read it.
+  const auto lu = make_lookup(*impact_geometry(m_pimpos), vec_impact);
+
+  // The diffusions are taken in a fixed order and split in blocks
+  // of fixed size.  Each block is sampled with its own random
+  // substream, drawn in block order, and the patches are added in
+  // diffusion order with each thread owning a range of channels.
+  // Thus the result does not depend on the number of threads.
+  // Sorting indices, not diffusions, leaves m_diffs in place.
+  std::vector<GaussianDiffusion*> diffs(m_diffs.size());
+  for (size_t ind = 0; ind < m_diffs.size(); ++ind) {
+    diffs[ind] = &m_diffs[ind];
+  }
+  std::sort(diffs.begin(), diffs.end(), [](const GaussianDiffusion* a, const GaussianDiffusion* b) {
+      if (a->time_desc().center != b->time_desc().center) {
+        return a->time_desc().center < b->time_desc().center;
+      }
+      if (a->pitch_desc().center != b->pitch_desc().center) {
+        return a->pitch_desc().center < b->pitch_desc().center;
+      }
+      if (a->time_desc().sigma != b->time_desc().sigma) {
+        return a->time_desc().sigma < b->time_desc().sigma;
+      }
+      if (a->pitch_desc().sigma != b->pitch_desc().sigma) {
+        return a->pitch_desc().sigma < b->pitch_desc().sigma;
+      }
+      return a->depo()->charge() < b->depo()->charge();
+    });
+  const int ndiffs = diffs.size();
+  const int block_size = 256;
+  const int nblocks = (ndiffs + block_size - 1)/block_size;
+  std::vector<IRandom::pointer> rngs(nblocks);
+  for (int iblock = 0; iblock < nblocks; ++iblock) {
+    rngs[iblock] = Gen::random_substream(m_fluctuate);
+  }
 
-      for (int tbin = 0; tbin!= nt; tbin++){
-	int abs_tbin = tbin + toffset_bin;
-	double charge = patch(pbin, tbin);
+  nthreads = Gen::resolve_nthreads(nthreads);
+  const int nchannels = grid.ncw*grid.cell_wires;
+  const int batch_blocks = 4*nthreads; // blocks sampled before adding
+  for (int bbeg = 0; bbeg < nblocks; bbeg += batch_blocks) {
+    const int bend = std::min(bbeg + batch_blocks, nblocks);
+    const int dbeg = bbeg*block_size;
+    const int dend = std::min(bend*block_size, ndiffs);
+
+    Gen::parallel_chunks(nthreads, bend-bbeg, [&](int, int beg, int end) {
+        for (int iblock = bbeg+beg; iblock < bbeg+end; ++iblock) {
+          const int ibeg = iblock*block_size;
+          const int iend = std::min(ibeg + block_size, ndiffs);
+          for (int idiff = ibeg; idiff < iend; ++idiff) {
+            diffs[idiff]->set_sampling(m_tbins, ib, m_nsigma, rngs[iblock], m_calcstrat, m_kcache.get());
+          }
+        }
+      });
 
-	// if (map_imp_ch[abs_pbin]==1459){
-	//   std::cout << pbin+poffset_bin << " " << pbin << " " << tbin << " " << charge << " " << std::endl;
-	// }
-	//	std::cout << pbin << " " << tbin << " " << patch(pbin,tbin) << std::endl;
-	// figure out how to convert the abs_pbin to fine position
-	// figure out how to use the weight given the above ???
-	// the other side
-	//	if (map_imp_redimp[abs_pbin]==max_redimp){
-	//  vec_vec_charge.at(map_redimp_vec[min_redimp]).push_back(std::make_tuple(map_imp_ch[abs_pbin]+1,abs_tbin,charge*(1-weight)));
-	//}else{
-	//}
-
-       long int index1 = channel*100000 + abs_tbin;
-       auto it = map_pair_pos.find(index1);
-       if (it == map_pair_pos.end()){
-         map_pair_pos[index1] = vec_charge.size();
-         vec_charge.emplace_back(channel, abs_tbin, charge*weight);
-	}else{
-         std::get<2>(vec_charge.at(it->second)) += charge * weight;
-	}
-
-       auto it1 = next_map_pair_pos.find(index1);
-       if (it1 == next_map_pair_pos.end()){
-         next_map_pair_pos[index1] = next_vec_charge.size();
-         next_vec_charge.emplace_back(channel, abs_tbin, charge*(1-weight));
-	}else{
-         std::get<2>(next_vec_charge.at(it1->second)) += charge*(1-weight);
-	}
-	
-	// if (map_tuple_pos.find(std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]],map_imp_ch[abs_pbin],abs_tbin))==map_tuple_pos.end()){
-	//   map_tuple_pos[std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]],map_imp_ch[abs_pbin],abs_tbin)] = vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin] ]).size();
-	//   vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin] ]).push_back(std::make_tuple(map_imp_ch[abs_pbin],abs_tbin,charge*weight));
-	// }else{
-	//   std::get<2>(vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin] ]).at(map_tuple_pos[std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]],map_imp_ch[abs_pbin],abs_tbin)])) += charge * weight;
-	// }
-	
-	// if (map_tuple_pos.find(std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]+1],map_imp_ch[abs_pbin],abs_tbin))==map_tuple_pos.end()){
-	//   map_tuple_pos[std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]+1],map_imp_ch[abs_pbin],abs_tbin)] = vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin]+1]).size();
-	//   vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin]+1]).push_back(std::make_tuple(map_imp_ch[abs_pbin],abs_tbin,charge*(1-weight)));
-	// }else{
-	//   std::get<2>(vec_vec_charge.at(map_redimp_vec[map_imp_redimp[abs_pbin]+1]).at(map_tuple_pos[std::make_tuple(map_redimp_vec[map_imp_redimp[abs_pbin]+1],map_imp_ch[abs_pbin],abs_tbin)]) ) += charge*(1-weight);
-	// }
-	
-	
-      }
-    }
+    Gen::parallel_chunks(nthreads, nchannels, [&](int, int beg, int end) {
+        for (int idiff = dbeg; idiff < dend; ++idiff) {
+          add_patch(grid, *diffs[idiff], lu, grid.start_ch + beg, grid.start_ch + end);
+        }
+      });
 
-    if (counter % 5000==0){
-      // std::vector<std::tuple<int,int,int> > del_keys;
-      // for (auto it  = map_tuple_pos.begin(); it!=map_tuple_pos.end(); it++){
-      // 	if (get<2>(it->first) < toffset_bin - 60){
-      // 	  del_keys.push_back(it->first);
-      // 	}
-      // }
-      // for (auto it = del_keys.begin(); it!=del_keys.end(); it++){
-      // 	map_tuple_pos.erase(*it);
-      // }
-      // map_tuple_pos.clear();
-      for (auto it = vec_map_pair_pos.begin(); it != vec_map_pair_pos.end(); it++){
-	it->clear();
-      }
+    for (int idiff = dbeg; idiff < dend; ++idiff) {
+      diffs[idiff]->clear_sampling();
     }
-
-    
-    diff->clear_sampling();
-    // need to figure out wire #, time #, charge, and weight ...
   }
-
-  //
-  
 }
 
 
@@ -429,9 +580,20 @@ std::pair<double,double> gausdesc_range(const std::vector<Gen::GausDesc> gds, do
 
 std::pair<double,double> Gen::BinnedDiffusion_transform::pitch_range(double nsigma) const
 {
+    if (nsigma == m_nsigma) {
+        return m_pitch_extent.range();
+    }
+    if (nsigma == 0.0) {
+        return m_pitch_centers.range();
+    }
     std::vector<Gen::GausDesc> gds;
-    for (auto diff : m_diffs) {
-        gds.push_back(diff->pitch_desc());
+    gds.reserve(m_diffs.size());
+    for (const auto& diff : m_diffs) {
+        const auto& gd = diff.pitch_desc();
+        gds.push_back(gd);
+        if (diff.pitch_length() != 0) { // far end of a segment
+            gds.emplace_back(gd.center + diff.pitch_length(), gd.sigma);
+        }
     }
     return gausdesc_range(gds, nsigma);
 }
@@ -446,9 +608,20 @@ std::pair<int,int> Gen::BinnedDiffusion_transform::impact_bin_range(double nsigm
 
 std::pair<double,double> Gen::BinnedDiffusion_transform::time_range(double nsigma) const
 {
+    if (nsigma == m_nsigma) {
+        return m_time_extent.range();
+    }
+    if (nsigma == 0.0) {
+        return m_time_centers.range();
+    }
     std::vector<Gen::GausDesc> gds;
-    for (auto diff : m_diffs) {
-        gds.push_back(diff->time_desc());
+    gds.reserve(m_diffs.size());
+    for (const auto& diff : m_diffs) {
+        const auto& gd = diff.time_desc();
+        gds.push_back(gd);
+        if (diff.time_length() != 0) { // far end of a segment
+            gds.emplace_back(gd.center + diff.time_length(), gd.sigma);
+        }
     }
     return gausdesc_range(gds, nsigma);
 }
@@ -0,0 +1,166 @@
+#include "WireCellGen/DepoCoalescer.h"
+#include "WireCellUtil/NamedFactory.h"
+#include "WireCellUtil/Exceptions.h"
+
+#include "WireCellIface/SimpleDepo.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <iostream>
+
+WIRECELL_FACTORY(DepoCoalescer, WireCell::Gen::DepoCoalescer,
+                 WireCell::IDrifter, WireCell::IConfigurable)
+
+using namespace std;
+using namespace WireCell;
+
+
+WireCell::Configuration Gen::DepoCoalescer::default_configuration() const
+{
+    Configuration cfg;
+    /// Size of the merge cells in time.
+    cfg["time_tolerance"] = m_time_tol;
+    /// Size of the merge cells in each of X, Y and Z.
+    cfg["space_tolerance"] = m_space_tol;
+    /// Relative size of the merge cells in each diffusion extent.
+    cfg["sigma_tolerance"] = m_sigma_tol;
+    /// Speed used to turn a spread in time into a longitudinal one.
+    cfg["drift_speed"] = m_drift_speed;
+    /// Note, a merged depo keeps as prior() only the constituent
+    /// with the most charge.  The others are not referenced so
+    /// truth matching sees only that one.
+    return cfg;
+}
+
+Gen::DepoCoalescer::DepoCoalescer()
+    : m_time_tol(0.1*units::us)
+    , m_space_tol(0.3*units::mm)
+    , m_sigma_tol(0.05)
+    , m_drift_speed(1.6*units::mm/units::us)
+    , m_nin(0)
+    , m_nout(0)
+{
+}
+Gen::DepoCoalescer::~DepoCoalescer()
+{
+}
+
+void Gen::DepoCoalescer::configure(const WireCell::Configuration& cfg)
+{
+    m_time_tol = get(cfg, "time_tolerance", m_time_tol);
+    m_space_tol = get(cfg, "space_tolerance", m_space_tol);
+    m_sigma_tol = get(cfg, "sigma_tolerance", m_sigma_tol);
+    m_drift_speed = get(cfg, "drift_speed", m_drift_speed);
+    if (m_time_tol <= 0 || m_space_tol <= 0 || m_sigma_tol <= 0) {
+        THROW(ValueError() << errmsg{"Gen::DepoCoalescer: tolerances must be positive"});
+    }
+}
+
+void Gen::DepoCoalescer::Cell::add(const IDepo::pointer& depo)
+{
+    const double w = std::abs(depo->charge());
+    const Point& pos = depo->pos();
+    wsum += w;
+    qsum += depo->charge();
+    esum += depo->energy();
+    t += w*depo->time();
+    x += w*pos.x();
+    y += w*pos.y();
+    z += w*pos.z();
+    t2 += w*depo->time()*depo->time();
+    y2 += w*pos.y()*pos.y();
+    z2 += w*pos.z()*pos.z();
+    long2 += w*depo->extent_long()*depo->extent_long();
+    tran2 += w*depo->extent_tran()*depo->extent_tran();
+    if (!count) {
+        first = depo;
+    }
+    if (!biggest || w > std::abs(biggest->charge())) {
+        biggest = depo;
+    }
+    ++count;
+}
+
+Gen::DepoCoalescer::key_t Gen::DepoCoalescer::key(const IDepo::pointer& depo) const
+{
+    const double logtol = std::log1p(m_sigma_tol);
+    auto sigma_bin = [&](double sigma) -> long {
+        if (sigma <= 0) {
+            return LONG_MIN;    // point sources only merge together
+        }
+        return std::floor(std::log(sigma)/logtol);
+    };
+    const Point& pos = depo->pos();
+    return key_t(std::floor(depo->time()/m_time_tol),
+                 std::floor(pos.x()/m_space_tol),
+                 std::floor(pos.y()/m_space_tol),
+                 std::floor(pos.z()/m_space_tol),
+                 sigma_bin(depo->extent_long()),
+                 sigma_bin(depo->extent_tran()));
+}
+
+IDepo::pointer Gen::DepoCoalescer::merge(const Cell& cell) const
+{
+    if (cell.count == 1) {
+        return cell.first;
+    }
+
+    // Weights are |charge|.  A cell of zero charge is dropped.
+    const double wsum = cell.wsum;
+    if (wsum <= 0) {
+        return nullptr;
+    }
+    const double t = cell.t/wsum;
+    const Point pos(cell.x/wsum, cell.y/wsum, cell.z/wsum);
+    const double var_t = std::max(cell.t2/wsum - t*t, 0.0);
+    const double var_y = std::max(cell.y2/wsum - pos.y()*pos.y(), 0.0);
+    const double var_z = std::max(cell.z2/wsum - pos.z()*pos.z(), 0.0);
+    const double var_v = m_drift_speed*m_drift_speed*var_t;
+    const double dL = std::sqrt(cell.long2/wsum + var_v);
+    const double dT = std::sqrt(cell.tran2/wsum + std::max(var_y, var_z));
+
+    const auto& big = cell.biggest;
+    return std::make_shared<SimpleDepo>(t, pos, cell.qsum, big, dL, dT,
+                                        big->id(), big->pdg(), cell.esum);
+}
+
+void Gen::DepoCoalescer::flush(output_queue& outq, long tbin)
+{
+    IDepo::vector ready;
+    auto it = m_cells.begin();
+    while (it != m_cells.end() && std::get<0>(it->first) < tbin) {
+        auto depo = merge(it->second);
+        if (depo) {
+            ready.push_back(depo);
+        }
+        it = m_cells.erase(it);
+    }
+    std::stable_sort(ready.begin(), ready.end(), [](const IDepo::pointer& a, const IDepo::pointer& b) {
+            return a->time() < b->time();
+        });
+    m_nout += ready.size();
+    outq.insert(outq.end(), ready.begin(), ready.end());
+}
+
+bool Gen::DepoCoalescer::operator()(const input_pointer& depo, output_queue& outq)
+{
+    if (!depo) {
+        flush(outq, LONG_MAX);
+        if (m_nin) {
+            cerr << "Gen::DepoCoalescer: at EOS, merged " << m_nin << " depos into " << m_nout
+                 << ", compression " << double(m_nin)/std::max(m_nout, 1) << "\n";
+        }
+        m_nin = m_nout = 0;
+        outq.push_back(nullptr);
+        return true;
+    }
+
+    ++m_nin;
+    const auto k = key(depo);
+    m_cells[k].add(depo);
+
+    // Time ordered input can add no more to earlier time bins.
+    flush(outq, std::get<0>(k));
+    return true;
+}
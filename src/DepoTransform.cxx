@@ -21,6 +21,9 @@
    2) It can be optimized if the array has a channel basis instead of
    a wire one so the "zipper" interface is not fitting.
 
+   (1 and 2 are now addressed by ImpactTransform::add_to() which fills
+   a dense channel block from which the frame is made directly.)
+
    3) It may be further optimized by performing its transforms on two
    planes from each face (for two-faced APAs) simultaneously.  This
    requires a different intrerface, possibly by (ab)using
@@ -40,14 +43,22 @@
 
 #include "WireCellGen/DepoTransform.h"
 #include "WireCellGen/ImpactTransform.h"
+#include "WireCellGen/PlaneImpactResponse.h"
 #include "WireCellUtil/NamedFactory.h"
 #include "WireCellIface/IAnodePlane.h"
 #include "WireCellIface/SimpleTrace.h"
 #include "WireCellIface/SimpleFrame.h"
 #include "WireCellGen/BinnedDiffusion_transform.h"
+#include "WireCellGen/ThreadUtil.h"
+#include "WireCellGen/Random.h"
 #include "WireCellUtil/Units.h"
 #include "WireCellUtil/Point.h"
 
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <unordered_map>
+
 WIRECELL_FACTORY(DepoTransform, WireCell::Gen::DepoTransform,
                  WireCell::IDepoFramer, WireCell::IConfigurable)
 
@@ -61,6 +72,15 @@ Gen::DepoTransform::DepoTransform()
     , m_drift_speed(1.0*units::mm/units::us)
     , m_nsigma(3.0)
     , m_frame_count(0)
+    , m_transform_threads(1)
+    , m_plane_threads(1)
+    , m_pack_planes(false)
+    , m_tile_wires(0)
+    , m_tile_ticks(0)
+    , m_memory_budget(0)
+    , m_streaming(false)
+    , m_stream_tail(0)
+    , m_stream_time(0.0)
 {
 }
 
@@ -87,6 +107,29 @@ void Gen::DepoTransform::configure(const WireCell::Configuration& cfg)
     m_drift_speed = get<double>(cfg, "drift_speed", m_drift_speed);
     m_frame_count = get<int>(cfg, "first_frame_number", m_frame_count);
 
+    m_transform_threads = Gen::get_nthreads(cfg, "transform_threads", m_transform_threads);
+    m_plane_threads = Gen::get_nthreads(cfg, "plane_threads", m_plane_threads);
+    m_pack_planes = get<bool>(cfg, "pack_planes", m_pack_planes);
+    m_tile_wires = get<int>(cfg, "tile_wires", m_tile_wires);
+    m_tile_ticks = get<int>(cfg, "tile_ticks", m_tile_ticks);
+    m_memory_budget = get<double>(cfg, "memory_budget", m_memory_budget);
+
+    m_kernel_cache = nullptr;
+    const double kprec = get<double>(cfg, "kernel_cache_precision", 0.0);
+    if (kprec > 0) {
+        const int ksize = get<int>(cfg, "kernel_cache_size", 10000);
+        m_kernel_cache = std::make_shared<Gen::GausKernelCache>(kprec, std::max(ksize, 1));
+    }
+
+    m_resp_cache = nullptr;
+    const double cache_mb = get<double>(cfg, "response_cache_mb", 0.0);
+    if (cache_mb > 0) {
+        m_resp_cache = std::make_shared<Gen::ResponseSpectraCache>(size_t(cache_mb*1024*1024));
+    }
+    if (m_memory_budget > 0 && cache_mb >= m_memory_budget) {
+        THROW(ValueError() << errmsg{"Gen::DepoTransform: memory_budget must be larger than response_cache_mb"});
+    }
+
     auto jpirs = cfg["pirs"];
     if (jpirs.isNull() or jpirs.empty()) {
         THROW(ValueError() << errmsg{"Gen::Ductor: must configure with some plane impact response components"});
@@ -98,6 +141,26 @@ void Gen::DepoTransform::configure(const WireCell::Configuration& cfg)
         m_pirs.push_back(pir);
     }
 
+    // Response tails reach at most the short and long paddings
+    // past the charge.  Split short responses are applied after the
+    // field response and may reach past the short padding.
+    m_streaming = get<bool>(cfg, "streaming", m_streaming);
+    m_stream_tail = 0;
+    for (auto pir : m_pirs) {
+        auto ir = pir->closest(0);
+        int tail = ir->waveform_pad();
+        auto gpir = std::dynamic_pointer_cast<const Gen::PlaneImpactResponse>(pir);
+        if (gpir && gpir->split_short()) {
+            tail = std::max(tail, gpir->field_pad() + gpir->short_pad());
+        }
+        if (ir->long_aux_waveform().size() > 0) {
+            tail += ir->long_aux_waveform_pad();
+        }
+        m_stream_tail = std::max(m_stream_tail, tail);
+    }
+    m_stream_time = m_start_time;
+    m_carry.resize(0, 0);
+
 }
 WireCell::Configuration Gen::DepoTransform::default_configuration() const
 {
@@ -127,6 +190,72 @@ WireCell::Configuration Gen::DepoTransform::default_configuration() const
     /// Allow for a custom starting frame number
     put(cfg, "first_frame_number", m_frame_count);
 
+    /// Number of threads used inside each plane's transform to
+    /// convolve the impact groups.  An integer or "auto" to use all
+    /// hardware threads.  Results depend only on this number.
+    put(cfg, "transform_threads", m_transform_threads);
+
+    /// Number of threads over which the planes of all faces are
+    /// simulated as independent tasks.  An integer or "auto".
+    /// Traces are merged in face and plane order and, when
+    /// fluctuating, each task draws from its own random stream so
+    /// frames do not depend on this number.
+    put(cfg, "plane_threads", m_plane_threads);
+
+    /// If true, tasks whose transforms have the same FFT shape (eg
+    /// the same plane on two faces) are done in pairs which share
+    /// the 2D FFT of their central impact groups.
+    put(cfg, "pack_planes", m_pack_planes);
+
+    /// If both are positive, the charge of each plane is clustered
+    /// on cells of this many wires and ticks and each cluster is
+    /// convolved over its own tile padded by the response extent.
+    /// This helps sparse events spread over the readout.  Tiled
+    /// planes are not packed.
+    put(cfg, "tile_wires", m_tile_wires);
+    put(cfg, "tile_ticks", m_tile_ticks);
+
+    /// Work memory budget in MB for all transforms.  The response
+    /// cache is taken out of it and the rest is split evenly
+    /// between the transforms which may run at once, as set by
+    /// plane_threads (two per thread if packing).  When packing,
+    /// the charge which all deferred transforms hold is taken out
+    /// first and each is given its own charge and a share of the
+    /// rest.  Over its share,
+    /// a transform holds the response spectra of one impact group
+    /// at a time and uses fewer threads.  Zero means no budget.
+    /// The high-water mark is reported for each plane.
+    put(cfg, "memory_budget", m_memory_budget);
+
+    /// If positive, the frequency-domain field responses of this
+    /// component's planes are kept for reuse by later events, in at
+    /// most this many MB.  The FFT shapes are then rounded up to a
+    /// few sizes per octave so that they repeat, which makes some
+    /// FFTs larger.  A response for one shape costs about 6 complex
+    /// arrays the size of the transform.  The hit rate is reported
+    /// for each frame.  Zero disables the cache.
+    put(cfg, "response_cache_mb", 0.0);
+
+    /// If positive, the binned Gaussians of depos are taken from a
+    /// cache shared by all planes and events.  Sigma and the offset
+    /// of the center in its bin are rounded to this fraction of the
+    /// bin size.  The hit rate is reported for each frame.
+    put(cfg, "kernel_cache_precision", 0.0);
+    /// Maximum number of kernels kept in that cache.
+    put(cfg, "kernel_cache_size", 10000);
+
+    /// If true, the input is a stream of depo sets each holding the
+    /// depos of a time slab, in order.  The n-th set gives the frame
+    /// starting at start_time + n*readout_time.  Each slab is
+    /// transformed over its frame extended by its diffusion and the
+    /// response length and the part past the frame is carried and
+    /// added to the next one, so the frames sum to what one long
+    /// transform would give while memory is held to about one slab.
+    /// Charge landing before the current frame was already sent and
+    /// is lost, so slabs are best cut a few diffusion widths later
+    /// than the frames.  At EOS the stream restarts at start_time.
+    put(cfg, "streaming", m_streaming);
+
     /// Name of component providing the anode plane.
     put(cfg, "anode", "");
     /// Name of component providing the anode pseudo random number generator.
@@ -142,14 +271,29 @@ WireCell::Configuration Gen::DepoTransform::default_configuration() const
 bool Gen::DepoTransform::operator()(const input_pointer& in, output_pointer& out)
 {
     if (!in) {
+        if (m_streaming && m_carry.size() && (m_carry != 0.0).any()) {
+            cerr << "Gen::DepoTransform: at EOS, dropping " << m_carry.cols()
+                 << " ticks of response past the last frame\n";
+        }
+        m_stream_time = m_start_time;
+        m_carry.resize(0, 0);
         out = nullptr;
         return true;
     }
 
     auto depos = in->depos();
+    const double frame_start = m_streaming ? m_stream_time : m_start_time;
+
+    // Each plane of each sensitive face is an independent task.
+    struct PlaneTask {
+        IWirePlane::pointer plane;
+        int iplane;
+        int iface;
+        IRandom::pointer rng;
+    };
+    std::vector<PlaneTask> tasks;
+    std::vector<IDepo::vector> faces_depos;
 
-    Binning tbins(m_readout_time/m_tick, m_start_time, m_start_time+m_readout_time);
-    ITrace::vector traces;
     for (auto face : m_anode->faces()) {
 
         // Select the depos which are in this face's sensitive volume
@@ -188,48 +332,244 @@ bool Gen::DepoTransform::operator()(const input_pointer& in, output_pointer& out
 
         }
 
+        const int iface = faces_depos.size();
+        faces_depos.push_back(face_depos);
+
         int iplane = -1;
         for (auto plane : face->planes()) {
             ++iplane;
+            // Substreams are drawn here, in task order, so the
+            // fluctuations do not depend on the number of threads.
+            tasks.push_back(PlaneTask{plane, iplane, iface, Gen::random_substream(m_rng)});
+        }
+    }
 
-            const Pimpos* pimpos = plane->pimpos();
-
-            Binning tbins(m_readout_time/m_tick, m_start_time,
-                          m_start_time+m_readout_time);
+    // Output is summed into one dense (channel, tick) block.  Rows
+    // are assigned to channels in face, plane and wire order and
+    // wires sharing a channel are summed into its row.
+    std::vector<int> channels;
+    std::unordered_map<int, int> channel_rows;
+    const int ntasks = tasks.size();
+    std::vector< std::vector<int> > wire_rows(ntasks);
+    for (int itask=0; itask<ntasks; ++itask) {
+        for (auto wire : tasks[itask].plane->wires()) {
+            const int chid = wire->channel();
+            auto it = channel_rows.find(chid);
+            if (it == channel_rows.end()) {
+                it = channel_rows.emplace(chid, (int)channels.size()).first;
+                channels.push_back(chid);
+            }
+            wire_rows[itask].push_back(it->second);
+        }
+    }
 
-            Gen::BinnedDiffusion_transform bindiff(*pimpos, tbins, m_nsigma, m_rng);
-            for (auto depo : face_depos) {
-                depo = modify_depo(plane->planeid(), depo);
-                bindiff.add(depo, depo->extent_long() / m_drift_speed, depo->extent_tran());
+    const int nsamples = m_readout_time/m_tick;
+    int nwindow = nsamples;
+    if (m_streaming) {
+        // Extend the window to hold the response to all the charge
+        // of this slab.  Ticks past the frame are carried.
+        const double frame_end = frame_start + m_readout_time;
+        double tmax = frame_end;
+        int nlate = 0;
+        for (const auto& fdepos : faces_depos) {
+            for (auto depo : fdepos) {
+                const double spread = m_nsigma*depo->extent_long()/m_drift_speed;
+                tmax = std::max(tmax, depo->time() + spread);
+                if (depo->time() - spread < frame_start) {
+                    ++nlate;
+                }
             }
+        }
+        nwindow += std::ceil((tmax - frame_end)/m_tick) + 2 + m_stream_tail;
+        nwindow = std::max(nwindow, (int)m_carry.cols());
+        if (nlate) {
+            cerr << "Gen::DepoTransform: " << nlate << " depos spread before the start of frame "
+                 << m_frame_count << " at " << frame_start/units::ms << "ms, their earlier charge is lost\n";
+        }
+    }
+    Binning tbins(nwindow, frame_start, frame_start + nwindow*m_tick);
+
+    // The memory budget less the response cache is shared by the
+    // transforms which may run at once.
+    size_t task_budget = 0;
+    double budget = 0;
+    const int nrunning = std::max(1, std::min(Gen::resolve_nthreads(m_plane_threads) * (m_pack_planes ? 2 : 1),
+                                              ntasks));
+    if (m_memory_budget > 0) {
+        budget = m_memory_budget*1024*1024;
+        if (m_resp_cache) {
+            budget -= m_resp_cache->max_bytes();
+        }
+        task_budget = size_t(budget / nrunning);
+    }
 
-            auto& wires = plane->wires();
+    Array::array_xxf block = Array::array_xxf::Zero(channels.size(), nwindow);
+    if (m_carry.size()) {
+        if (m_carry.rows() != block.rows()) {
+            THROW(ValueError() << errmsg{"Gen::DepoTransform: channels changed while streaming"});
+        }
+        block.leftCols(m_carry.cols()) += m_carry;
+    }
 
-            auto pir = m_pirs.at(iplane);
-            Gen::ImpactTransform transform(pir, bindiff);
+    // Each transform is added to the block, and freed, once it and
+    // all earlier tasks are done so the sum is in task order,
+    // independent of threads.  Threads take tasks in order so few
+    // transforms wait.  Any long-range response is applied before
+    // so only the row additions hold the lock.
+    struct PlaneResult {
+        std::unique_ptr<Gen::BinnedDiffusion_transform> bindiff;
+        std::unique_ptr<Gen::ImpactTransform> transform;
+        bool done = false;
+    };
+    std::vector<PlaneResult> results(ntasks);
+    std::mutex block_mutex;
+    int nadded = 0;
+    auto task_done = [&](int itask) {
+        std::lock_guard<std::mutex> lock(block_mutex);
+        results[itask].done = true;
+        while (nadded < ntasks && results[nadded].done) {
+            auto& res = results[nadded];
+            res.transform->add_to(block, wire_rows[nadded]);
+            res.transform.reset();
+            res.bindiff.reset();
+            ++nadded;
+        }
+    };
 
-            const int nwires = pimpos->region_binning().nbins();
-            for (int iwire=0; iwire<nwires; ++iwire) {
-                auto wave = transform.waveform(iwire);
-                
-                auto mm = Waveform::edge(wave);
-                if (mm.first == (int)wave.size()) { // all zero
-                    continue;
-                }
-                
-                int chid = wires[iwire]->channel();
-                int tbin = mm.first;
-
-                //std::cout << mm.first << " "<< mm.second << std::endl;
-		
-                ITrace::ChargeSequence charge(wave.begin()+mm.first, wave.begin()+mm.second);
-                auto trace = make_shared<SimpleTrace>(chid, tbin, charge);
-                traces.push_back(trace);
+    Gen::parallel_tasks(m_plane_threads, ntasks, [&](int itask) {
+        const auto& task = tasks[itask];
+        auto plane = task.plane;
+
+        const Pimpos* pimpos = plane->pimpos();
+
+        auto& res = results[itask];
+        res.bindiff.reset(new Gen::BinnedDiffusion_transform(*pimpos, tbins, m_nsigma, task.rng));
+        res.bindiff->reserve(faces_depos[task.iface].size());
+        res.bindiff->set_kernel_cache(m_kernel_cache);
+        if (m_tile_wires > 0 && m_tile_ticks > 0) {
+            res.bindiff->set_occupancy_cells(m_tile_wires, m_tile_ticks);
+        }
+        for (auto depo : faces_depos[task.iface]) {
+            depo = modify_depo(plane->planeid(), depo);
+            res.bindiff->add(depo, depo->extent_long() / m_drift_speed, depo->extent_tran());
+        }
+
+        auto pir = m_pirs.at(task.iplane);
+        res.transform.reset(new Gen::ImpactTransform(pir, *res.bindiff, m_transform_threads,
+                                                     m_pack_planes, m_tile_wires, m_tile_ticks,
+                                                     task_budget, m_resp_cache));
+        if (!m_pack_planes) {
+            res.transform->apply_long();
+            task_done(itask);
+        }
+    });
+
+    if (m_pack_planes) {
+        // The deferred transforms all hold their charge until done
+        // so it is taken from the budget first and what is left is
+        // shared by those which may run at once.
+        if (budget > 0) {
+            double held = 0;
+            for (const auto& res : results) {
+                held += res.transform->memory();
+            }
+            if (held >= budget) {
+                cerr << "Gen::DepoTransform: the charge of the deferred plane transforms, "
+                     << held/(1024*1024) << " MB, is over the memory budget\n";
+            }
+            const double share = std::max(0.0, budget - held) / nrunning;
+            for (const auto& res : results) {
+                // at least a byte since no budget is 0
+                res.transform->set_memory_budget(std::max(size_t(1), size_t(res.transform->memory() + share)));
+            }
+        }
+
+        // Pair each task with the next unpaired one of the same FFT
+        // shape, in task order.  Unmatched tasks are done alone.
+        // Until then the deferred transforms hold only their charge.
+        std::vector< std::pair<int,int> > jobs;
+        std::vector<bool> used(ntasks, false);
+        for (int itask=0; itask<ntasks; ++itask) {
+            if (used[itask]) { continue; }
+            used[itask] = true;
+            const auto shape = results[itask].transform->fft_shape();
+            int jtask = itask+1;
+            while (jtask < ntasks && (used[jtask] || results[jtask].transform->fft_shape() != shape)) {
+                ++jtask;
+            }
+            if (jtask < ntasks) {
+                used[jtask] = true;
+                jobs.push_back(std::make_pair(itask, jtask));
+            }
+            else {
+                jobs.push_back(std::make_pair(itask, -1));
+            }
+        }
+        const int njobs = jobs.size();
+        Gen::parallel_tasks(m_plane_threads, njobs, [&](int ijob) {
+            const auto& job = jobs[ijob];
+            if (job.second < 0) {
+                results[job.first].transform->transform();
+                results[job.first].transform->apply_long();
+                task_done(job.first);
             }
+            else {
+                Gen::ImpactTransform::transform(*results[job.first].transform,
+                                                *results[job.second].transform);
+                results[job.first].transform->apply_long();
+                results[job.second].transform->apply_long();
+                task_done(job.first);
+                task_done(job.second);
+            }
+        });
+        cerr << "Gen::DepoTransform: packed " << ntasks << " plane tasks into "
+             << njobs << " transforms\n";
+    }
+
+    if (m_kernel_cache) {
+        cerr << "Gen::DepoTransform: kernel cache hit rate " << m_kernel_cache->hit_rate()
+             << " of " << m_kernel_cache->hits() + m_kernel_cache->misses() << " lookups\n";
+        m_kernel_cache->reset_counts();
+    }
+    if (m_resp_cache) {
+        cerr << "Gen::DepoTransform: response cache hit rate " << m_resp_cache->hit_rate()
+             << " of " << m_resp_cache->hits() + m_resp_cache->misses() << " lookups, holding "
+             << m_resp_cache->bytes()/(1024*1024) << " MB\n";
+        m_resp_cache->reset_counts();
+    }
+
+    // one trace per channel spanning its nonzero samples
+    ITrace::vector traces;
+    const int nchannels = channels.size();
+    for (int irow=0; irow<nchannels; ++irow) {
+        int tbin = 0;
+        while (tbin < nsamples && block(irow, tbin) == 0.0) {
+            ++tbin;
+        }
+        if (tbin == nsamples) { // all zero
+            continue;
+        }
+        int tend = nsamples;
+        while (block(irow, tend-1) == 0.0) {
+            --tend;
+        }
+        ITrace::ChargeSequence charge(tend-tbin);
+        for (int it=tbin; it<tend; ++it) {
+            charge[it-tbin] = block(irow, it);
+        }
+        traces.push_back(make_shared<SimpleTrace>(channels[irow], tbin, charge));
+    }
+
+    if (m_streaming) {
+        int ncarry = nwindow - nsamples;
+        while (ncarry > 0 && (block.col(nsamples + ncarry - 1) == 0.0).all()) {
+            --ncarry;
         }
+        m_carry = block.block(0, nsamples, block.rows(), ncarry);
+        m_stream_time += m_readout_time;
     }
 
-    auto frame = make_shared<SimpleFrame>(m_frame_count, m_start_time, traces, m_tick);
+    auto frame = make_shared<SimpleFrame>(m_frame_count, frame_start, traces, m_tick);
     ++m_frame_count;
     out = frame;
     return true;
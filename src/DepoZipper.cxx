@@ -6,6 +6,7 @@
 #include "WireCellIface/SimpleFrame.h"
 #include "WireCellGen/BinnedDiffusion.h"
 #include "WireCellGen/ImpactZipper.h"
+#include "WireCellGen/ThreadUtil.h"
 #include "WireCellUtil/Units.h"
 #include "WireCellUtil/Point.h"
 
@@ -22,6 +23,7 @@ Gen::DepoZipper::DepoZipper()
     , m_drift_speed(1.0*units::mm/units::us)
     , m_nsigma(3.0)
     , m_frame_count(0)
+    , m_wire_threads(1)
 {
 }
 
@@ -47,6 +49,7 @@ void Gen::DepoZipper::configure(const WireCell::Configuration& cfg)
     m_start_time = get<double>(cfg, "start_time", m_start_time);
     m_drift_speed = get<double>(cfg, "drift_speed", m_drift_speed);
     m_frame_count = get<int>(cfg, "first_frame_number", m_frame_count);
+    m_wire_threads = Gen::get_nthreads(cfg, "wire_threads", m_wire_threads);
 
     auto jpirs = cfg["pirs"];
     if (jpirs.isNull() or jpirs.empty()) {
@@ -88,6 +91,12 @@ WireCell::Configuration Gen::DepoZipper::default_configuration() const
     /// Allow for a custom starting frame number
     put(cfg, "first_frame_number", m_frame_count);
 
+    /// Number of threads over which the wires of a plane are
+    /// simulated.  An integer or "auto".  If not 1 the spectra of
+    /// all impacts of a plane are calculated up front, which takes
+    /// more memory.  Frames do not depend on this number.
+    put(cfg, "wire_threads", m_wire_threads);
+
     /// Name of component providing the anode plane.
     put(cfg, "anode", "");
     /// Name of component providing the anode pseudo random number generator.
@@ -169,23 +178,33 @@ bool Gen::DepoZipper::operator()(const input_pointer& in, output_pointer& out)
             auto pir = m_pirs.at(iplane);
             Gen::ImpactZipper zipper(pir, bindiff);
 
+            // Wires are split in contiguous chunks whose traces are
+            // merged in wire order.
             const int nwires = pimpos->region_binning().nbins();
-            for (int iwire=0; iwire<nwires; ++iwire) {
-                auto wave = zipper.waveform(iwire);
-                
-                auto mm = Waveform::edge(wave);
-                if (mm.first == (int)wave.size()) { // all zero
-                    continue;
+            const int wire_threads = Gen::resolve_nthreads(m_wire_threads);
+            if (wire_threads > 1) {
+                zipper.precompute(wire_threads);
+            }
+            std::vector<ITrace::vector> chunk_traces(wire_threads);
+            const int nchunks = Gen::parallel_chunks(wire_threads, nwires, [&](int wchunk, int wbeg, int wend) {
+                for (int iwire=wbeg; iwire<wend; ++iwire) {
+                    auto wave = zipper.waveform(iwire);
+
+                    auto mm = Waveform::edge(wave);
+                    if (mm.first == (int)wave.size()) { // all zero
+                        continue;
+                    }
+
+                    int chid = wires[iwire]->channel();
+                    int tbin = mm.first;
+
+                    ITrace::ChargeSequence charge(wave.begin()+mm.first, wave.begin()+mm.second);
+                    auto trace = make_shared<SimpleTrace>(chid, tbin, charge);
+                    chunk_traces[wchunk].push_back(trace);
                 }
-                
-                int chid = wires[iwire]->channel();
-                int tbin = mm.first;
-
-                //std::cout << mm.first << " "<< mm.second << std::endl;
-		
-                ITrace::ChargeSequence charge(wave.begin()+mm.first, wave.begin()+mm.second);
-                auto trace = make_shared<SimpleTrace>(chid, tbin, charge);
-                traces.push_back(trace);
+            });
+            for (int wchunk=0; wchunk<nchunks; ++wchunk) {
+                traces.insert(traces.end(), chunk_traces[wchunk].begin(), chunk_traces[wchunk].end());
             }
         }
     }
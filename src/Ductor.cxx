@@ -1,6 +1,8 @@
 #include "WireCellGen/Ductor.h"
 #include "WireCellGen/BinnedDiffusion.h"
 #include "WireCellGen/ImpactZipper.h"
+#include "WireCellGen/Random.h"
+#include "WireCellGen/ThreadUtil.h"
 #include "WireCellUtil/Units.h"
 #include "WireCellUtil/Point.h"
 #include "WireCellUtil/NamedFactory.h"
@@ -27,6 +29,8 @@ Gen::Ductor::Ductor()
     , m_fluctuate(true)
     , m_mode("continuous")
     , m_frame_count(0)
+    , m_plane_threads(1)
+    , m_wire_threads(1)
 {
 }
 
@@ -67,6 +71,21 @@ WireCell::Configuration Gen::Ductor::default_configuration() const
     /// Allow for a custom starting frame number
     put(cfg, "first_frame_number", m_frame_count);
 
+    /// Number of threads over which the planes of all faces are
+    /// simulated as independent tasks.  An integer or "auto".
+    /// Traces are merged in face and plane order and, when
+    /// fluctuating, each plane draws from its own random stream so
+    /// frames do not depend on this number.
+    put(cfg, "plane_threads", m_plane_threads);
+
+    /// Number of threads over which the wires of a plane are
+    /// simulated.  An integer or "auto".  If not 1 the spectra of
+    /// all impacts of a plane are calculated up front, which takes
+    /// more memory.  Frames do not depend on this number.  Plane
+    /// and wire tasks share one pool of threads so at most the
+    /// larger of the two counts run at once.
+    put(cfg, "wire_threads", m_wire_threads);
+
     /// Name of component providing the anode plane.
     put(cfg, "anode", m_anode_tn);
     put(cfg, "rng", m_rng_tn);
@@ -113,6 +132,8 @@ void Gen::Ductor::configure(const WireCell::Configuration& cfg)
     m_start_time = get<double>(cfg, "start_time", m_start_time);
     m_drift_speed = get<double>(cfg, "drift_speed", m_drift_speed);
     m_frame_count = get<int>(cfg, "first_frame_number", m_frame_count);
+    m_plane_threads = Gen::get_nthreads(cfg, "plane_threads", m_plane_threads);
+    m_wire_threads = Gen::get_nthreads(cfg, "wire_threads", m_wire_threads);
 
     auto jpirs = cfg["pirs"];
     if (jpirs.isNull() or jpirs.empty()) {
@@ -134,55 +155,68 @@ void Gen::Ductor::configure(const WireCell::Configuration& cfg)
          << "\n";
 }
 
-ITrace::vector Gen::Ductor::process_face(IAnodeFace::pointer face,
-                                         const IDepo::vector& face_depos)
+ITrace::vector Gen::Ductor::process_plane(IWirePlane::pointer plane, int iplane,
+                                          const IDepo::vector& face_depos, IRandom::pointer rng)
 {
-    ITrace::vector traces;
-
-    int iplane = -1;
-    for (auto plane : face->planes()) {
-        ++iplane;
+    const Pimpos* pimpos = plane->pimpos();
 
-        const Pimpos* pimpos = plane->pimpos();
+    Binning tbins(m_readout_time/m_tick, m_start_time,
+                  m_start_time+m_readout_time);
 
-        Binning tbins(m_readout_time/m_tick, m_start_time,
-                      m_start_time+m_readout_time);
-
-        Gen::BinnedDiffusion bindiff(*pimpos, tbins, m_nsigma, m_rng);
-        for (auto depo : face_depos) {
-            bindiff.add(depo, depo->extent_long() / m_drift_speed, depo->extent_tran());
-        }
+    Gen::BinnedDiffusion bindiff(*pimpos, tbins, m_nsigma, rng);
+    for (auto depo : face_depos) {
+        bindiff.add(depo, depo->extent_long() / m_drift_speed, depo->extent_tran());
+    }
 
-        auto& wires = plane->wires();
+    auto& wires = plane->wires();
 
-        auto pir = m_pirs.at(iplane);
-        Gen::ImpactZipper zipper(pir, bindiff);
+    auto pir = m_pirs.at(iplane);
+    Gen::ImpactZipper zipper(pir, bindiff);
 
-        const int nwires = pimpos->region_binning().nbins();
-        for (int iwire=0; iwire<nwires; ++iwire) {
+    // Wires are split in contiguous chunks whose traces are merged
+    // in wire order.
+    const int nwires = pimpos->region_binning().nbins();
+    const int wire_threads = Gen::resolve_nthreads(m_wire_threads);
+    if (wire_threads > 1) {
+        zipper.precompute(wire_threads);
+    }
+    std::vector<ITrace::vector> chunk_traces(wire_threads);
+    const int nchunks = Gen::parallel_chunks(wire_threads, nwires, [&](int wchunk, int wbeg, int wend) {
+        for (int iwire=wbeg; iwire<wend; ++iwire) {
             auto wave = zipper.waveform(iwire);
-                
+
             auto mm = Waveform::edge(wave);
             if (mm.first == (int)wave.size()) { // all zero
                 continue;
             }
-                
+
             int chid = wires[iwire]->channel();
             int tbin = mm.first;
 
-            //std::cout << mm.first << " "<< mm.second << std::endl;
-		
             ITrace::ChargeSequence charge(wave.begin()+mm.first, wave.begin()+mm.second);
             auto trace = make_shared<SimpleTrace>(chid, tbin, charge);
-            traces.push_back(trace);
+            chunk_traces[wchunk].push_back(trace);
         }
+    });
+
+    ITrace::vector traces;
+    for (int wchunk=0; wchunk<nchunks; ++wchunk) {
+        traces.insert(traces.end(), chunk_traces[wchunk].begin(), chunk_traces[wchunk].end());
     }
     return traces;
 }
 
 void Gen::Ductor::process(output_queue& frames)
 {
-    ITrace::vector traces;
+    // Each plane of each sensitive face is an independent task.
+    struct PlaneTask {
+        IWirePlane::pointer plane;
+        int iplane;
+        int iface;
+        IRandom::pointer rng;
+    };
+    std::vector<PlaneTask> tasks;
+    std::vector<IDepo::vector> faces_depos;
 
     for (auto face : m_anode->faces()) {
 
@@ -222,8 +256,35 @@ void Gen::Ductor::process(output_queue& frames)
 
         }
 
-        auto newtraces = process_face(face, face_depos);
-        traces.insert(traces.end(), newtraces.begin(), newtraces.end());
+        const int iface = faces_depos.size();
+        faces_depos.push_back(face_depos);
+
+        // Substreams are drawn here, in face and plane order, and
+        // handed to each task so the fluctuations do not depend on
+        // the number of threads.
+        auto face_rng = Gen::random_substream(m_rng);
+        int iplane = -1;
+        for (auto plane : face->planes()) {
+            ++iplane;
+            tasks.push_back(PlaneTask{plane, iplane, iface, Gen::random_substream(face_rng)});
+        }
+    }
+
+    const int ntasks = tasks.size();
+    std::vector<ITrace::vector> task_traces(ntasks);
+    Gen::parallel_chunks(m_plane_threads, ntasks, [&](int, int tbeg, int tend) {
+        for (int itask = tbeg; itask < tend; ++itask) {
+            const auto& task = tasks[itask];
+            task_traces[itask] = process_plane(task.plane, task.iplane,
+                                               faces_depos[task.iface], task.rng);
+        }
+    });
+
+    // merge in face and plane order so the frame is the same as a
+    // serial run
+    ITrace::vector traces;
+    for (auto& one : task_traces) {
+        traces.insert(traces.end(), one.begin(), one.end());
     }
 
     auto frame = make_shared<SimpleFrame>(m_frame_count, m_start_time, traces, m_tick);
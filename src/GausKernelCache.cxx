@@ -0,0 +1,71 @@
+#include "WireCellGen/GausKernelCache.h"
+#include "WireCellGen/GaussKernels.h"
+
+#include <cmath>
+
+using namespace WireCell;
+
+Gen::GausKernelCache::GausKernelCache(double precision, size_t capacity)
+    : m_precision(precision)
+    , m_capacity(capacity)
+    , m_hits(0)
+    , m_misses(0)
+{
+}
+
+Gen::GausKernelCache::kernel_pointer
+Gen::GausKernelCache::get(const GausDesc& desc, double start, double step, int nbins, bool want_weights)
+{
+    if (nbins <= 0 || step <= 0) {
+        return nullptr;
+    }
+    const double quantum = m_precision*step;
+    const long qsigma = std::lround(desc.sigma/quantum);
+    if (qsigma <= 0) {
+        return nullptr;
+    }
+    const long qoffset = std::lround((desc.center - start)/quantum);
+    const key_t key(nbins, qsigma, qoffset, want_weights);
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_kernels.find(key);
+        if (it != m_kernels.end()) {
+            ++m_hits;
+            return it->second;
+        }
+    }
+    ++m_misses;
+
+    // Integrate the quantized Gaussian with bins starting at zero.
+    auto kernel = std::make_shared<Kernel>();
+    kernel->bins.resize(nbins);
+    double* weights = nullptr;
+    if (want_weights) {
+        kernel->weights.resize(nbins);
+        weights = kernel->weights.data();
+    }
+    gauss_binint(qoffset*quantum, qsigma*quantum, 0.0, step, nbins, kernel->bins.data(), weights);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_kernels.size() >= m_capacity) {
+        m_kernels.clear();
+    }
+    m_kernels[key] = kernel;
+    return kernel;
+}
+
+double Gen::GausKernelCache::hit_rate() const
+{
+    const double nhits = m_hits, nmisses = m_misses;
+    if (nhits + nmisses == 0) {
+        return 0.0;
+    }
+    return nhits/(nhits + nmisses);
+}
+
+void Gen::GausKernelCache::reset_counts()
+{
+    m_hits = 0;
+    m_misses = 0;
+}
@@ -0,0 +1,267 @@
+#include "WireCellGen/GaussKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace WireCell;
+
+// Build the batch loops for several instruction sets, see header.
+// Contraction into FMA is turned off, in the loops, the kernels they
+// inline and the scalar references, as only some of the instruction
+// sets have FMA and it changes the rounding.  The kernels must share
+// the options of their callers to be inlined.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define WIRECELLGEN_KERNEL_OPTS optimize("tree-vectorize", "fp-contract=off")
+#define WIRECELLGEN_KERNEL __attribute__((always_inline, WIRECELLGEN_KERNEL_OPTS))
+#define WIRECELLGEN_SCALAR __attribute__((WIRECELLGEN_KERNEL_OPTS))
+#define WIRECELLGEN_SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default"), WIRECELLGEN_KERNEL_OPTS))
+#else
+#define WIRECELLGEN_KERNEL
+#define WIRECELLGEN_SCALAR
+#define WIRECELLGEN_SIMD_CLONES
+#endif
+
+namespace {
+
+    // Argument must be in [-700,700].
+    WIRECELLGEN_KERNEL
+    inline double exp_kernel(double x)
+    {
+        // x = k*ln2 + r with |r| <= ln2/2.  Adding and removing
+        // 1.5*2^52 rounds to an integer without a library call.
+        const double round = 6755399441055744.0;
+        const double k = (x*1.44269504088896340736 + round) - round;
+        const double r = (x - k*6.93147180369123816490e-01) - k*1.90821492927058770002e-10;
+
+        // Taylor series, truncation below 1e-17
+        double p = 1.0/6227020800.0;
+        p = p*r + 1.0/479001600.0;
+        p = p*r + 1.0/39916800.0;
+        p = p*r + 1.0/3628800.0;
+        p = p*r + 1.0/362880.0;
+        p = p*r + 1.0/40320.0;
+        p = p*r + 1.0/5040.0;
+        p = p*r + 1.0/720.0;
+        p = p*r + 1.0/120.0;
+        p = p*r + 1.0/24.0;
+        p = p*r + 1.0/6.0;
+        p = p*r + 0.5;
+        p = p*r + 1.0;
+        p = p*r + 1.0;
+
+        // 2^k by placing k+1023 in the exponent bits.  Adding 2^52
+        // puts the integer in the low mantissa bits.
+        const double biased = k + (1023.0 + 4503599627370496.0);
+        uint64_t bits;
+        std::memcpy(&bits, &biased, sizeof(bits));
+        bits <<= 52;
+        double scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return p*scale;
+    }
+
+    // Chebyshev series on t in [0.25,1] of erfc(x)*exp(x*x)/t with
+    // t = 1/(1+x/2), ie x in [0,6].
+    const int ncheb = 20;
+    const double cheb[ncheb] = {
+        6.46076521927580472e-01,
+        3.13883922649599301e-01,
+        3.99383635133737369e-02,
+        5.74575675501048998e-04,
+        -4.69862512698712730e-04,
+        -1.14753613559864808e-05,
+        8.26886057570253121e-06,
+        -1.75538319560630818e-07,
+        -1.58108324574413050e-07,
+        1.76179206029525324e-08,
+        1.88613409890514585e-09,
+        -6.56862975123573299e-10,
+        3.73080205617881714e-11,
+        1.23298343757127792e-11,
+        -2.93797486339286739e-12,
+        1.27137189664949811e-13,
+        6.50812737035266814e-14,
+        -1.57207580286922160e-14,
+        6.24500451351650554e-16,
+        9.10382880192628481e-16,
+    };
+
+    // Return erfc(z) for z in [0,6].
+    WIRECELLGEN_KERNEL
+    inline double erfc_kernel(double z)
+    {
+        const double t = 1.0/(1.0 + 0.5*z);
+
+        // Clenshaw on u in [-1,1]
+        const double u = (2.0*t - 1.25)/0.75;
+        double b1 = 0, b2 = 0;
+#pragma GCC unroll 20
+        for (int j = ncheb-1; j >= 1; --j) {
+            const double b0 = 2.0*u*b1 - b2 + cheb[j];
+            b2 = b1;
+            b1 = b0;
+        }
+        const double f = u*b1 - b2 + cheb[0];
+        return t*f*exp_kernel(-z*z); // >= -36
+    }
+
+}
+
+WIRECELLGEN_SIMD_CLONES
+void Gen::exp_batch(const double* x, double* y, int n)
+{
+    // Clamping in its own loop keeps the compiler from splitting the
+    // kernel loop on the clamped cases, which stops vectorization.
+    for (int ind=0; ind<n; ++ind) {
+        y[ind] = x[ind] < -700.0 ? -700.0 : (x[ind] > 700.0 ? 700.0 : x[ind]);
+    }
+    for (int ind=0; ind<n; ++ind) {
+        y[ind] = exp_kernel(y[ind]);
+    }
+}
+
+WIRECELLGEN_SIMD_CLONES
+void Gen::erf_batch(const double* x, double* y, int n)
+{
+    // erfc(6) ~ 2e-17 so larger |x| give +/-1
+    for (int ind=0; ind<n; ++ind) {
+        const double z = std::fabs(x[ind]);
+        y[ind] = z > 6.0 ? 6.0 : z;
+    }
+    for (int ind=0; ind<n; ++ind) {
+        y[ind] = std::copysign(1.0 - erfc_kernel(y[ind]), x[ind]);
+    }
+}
+
+WIRECELLGEN_SCALAR
+double Gen::exp_scalar(double x)
+{
+    return exp_kernel(x < -700.0 ? -700.0 : (x > 700.0 ? 700.0 : x));
+}
+
+WIRECELLGEN_SCALAR
+double Gen::erf_scalar(double x)
+{
+    const double z = std::fabs(x);
+    return std::copysign(1.0 - erfc_kernel(z > 6.0 ? 6.0 : z), x);
+}
+
+void Gen::gauss_binint(double center, double sigma, double start, double step, int nbins,
+                       double* bins, double* weights)
+{
+    const double sqrt2 = std::sqrt(2.0);
+    std::vector<double> rel(nbins+1), erfs(nbins+1);
+    for (int ind=0; ind <= nbins; ++ind) {
+        rel[ind] = (start + step * ind - center)/(sqrt2*sigma);
+    }
+    erf_batch(rel.data(), erfs.data(), nbins+1);
+    for (int ibin=0; ibin < nbins; ++ibin) {
+        bins[ibin] = 0.5*(erfs[ibin+1] - erfs[ibin]);
+    }
+    if (!weights) {
+        return;
+    }
+
+    // Gaussian at the edges: exp(-0.5*((x-c)/s)^2) = exp(-rel^2)
+    std::vector<double> gaus(nbins+1);
+    for (int ind=0; ind <= nbins; ++ind) {
+        rel[ind] = -rel[ind]*rel[ind];
+    }
+    exp_batch(rel.data(), gaus.data(), nbins+1);
+    const double norm = sigma/std::sqrt(2.0*M_PI);
+    for (int ibin=0; ibin < nbins; ++ibin) {
+        const double x1 = start + step*ibin;
+        const double x2 = x1 + step;
+        weights[ibin] = -norm/(x1-x2)*(gaus[ibin+1]-gaus[ibin])/bins[ibin] + (center-x2)/(x1-x2);
+    }
+}
+
+void Gen::gauss_box_binint(double lo, double hi, double sigma, double start, double step, int nbins,
+                           double* bins, double* weights)
+{
+    if (lo > hi) {
+        std::swap(lo, hi);
+    }
+    const double length = hi - lo;
+    if (sigma <= 0) {
+        // overlap of each bin with the segment, charge at its middle
+        for (int ibin=0; ibin < nbins; ++ibin) {
+            const double x1 = start + step*ibin;
+            const double x2 = x1 + step;
+            const double olo = std::max(x1, lo), ohi = std::min(x2, hi);
+            double frac = 0.0;
+            if (length > 0) {
+                frac = ohi > olo ? (ohi - olo)/length : 0.0;
+            }
+            else {
+                frac = (lo >= x1 && lo < x2) ? 1.0 : 0.0;
+            }
+            bins[ibin] = frac;
+            if (weights) {
+                weights[ibin] = frac > 0 ? (x2 - 0.5*(olo+ohi))/step : 0.5;
+            }
+        }
+        return;
+    }
+    if (length <= 1e-6*sigma) {
+        gauss_binint(0.5*(lo+hi), sigma, start, step, nbins, bins, weights);
+        return;
+    }
+
+    // With z = (x-c)/sigma, Phi the normal CDF and phi its density,
+    // the Gaussian averaged over centers c in [lo,hi] integrates with
+    //   int Phi dz = Psi = z*Phi + phi
+    //   int z*Phi dz = Q = ((z^2-1)*Phi + z*phi)/2
+    // At each edge za is relative to lo and zb to hi.
+    const int nedges = nbins+1;
+    std::vector<double> arg(4*nedges), val(4*nedges);
+    const double invs = 1.0/sigma, sqrt2 = std::sqrt(2.0);
+    for (int ind=0; ind < nedges; ++ind) {
+        const double x = start + step*ind;
+        arg[ind] = (x - lo)*invs/sqrt2;
+        arg[nedges+ind] = (x - hi)*invs/sqrt2;
+    }
+    erf_batch(arg.data(), val.data(), 2*nedges);
+    for (int ind=0; ind < 2*nedges; ++ind) {
+        arg[2*nedges+ind] = -arg[ind]*arg[ind];
+    }
+    exp_batch(arg.data()+2*nedges, val.data()+2*nedges, 2*nedges);
+
+    const double invsqrt2pi = 1.0/std::sqrt(2.0*M_PI);
+    std::vector<double> dpsi(nedges), dphi(nedges), kmom(nedges);
+    for (int ind=0; ind < nedges; ++ind) {
+        const double x = start + step*ind;
+        const double za = arg[ind]*sqrt2, zb = arg[nedges+ind]*sqrt2;
+        const double Pa = 0.5*(1.0 + val[ind]), Pb = 0.5*(1.0 + val[nedges+ind]);
+        const double pa = invsqrt2pi*val[2*nedges+ind], pb = invsqrt2pi*val[3*nedges+ind];
+        const double psia = za*Pa + pa, psib = zb*Pb + pb;
+        const double qa = 0.5*((za*za-1)*Pa + za*pa), qb = 0.5*((zb*zb-1)*Pb + zb*pb);
+        dpsi[ind] = psia - psib;
+        dphi[ind] = Pa - Pb;
+        // integral over c in [lo,hi] of c*Phi((x-c)/sigma)
+        kmom[ind] = sigma*x*(psia - psib) - sigma*sigma*(qa - qb);
+    }
+    const double norm = sigma/length;
+    for (int ibin=0; ibin < nbins; ++ibin) {
+        bins[ibin] = norm*(dpsi[ibin+1] - dpsi[ibin]);
+    }
+    if (!weights) {
+        return;
+    }
+
+    // Weight toward the lower edge from the mean position in the bin.
+    for (int ibin=0; ibin < nbins; ++ibin) {
+        const double mass = sigma*(dpsi[ibin+1] - dpsi[ibin]);
+        if (mass <= 1e-12*length) {
+            weights[ibin] = 0.5;
+            continue;
+        }
+        const double moment = kmom[ibin+1] - kmom[ibin] + sigma*sigma*(dphi[ibin] - dphi[ibin+1]);
+        const double x2 = start + step*(ibin+1);
+        const double wt = (x2 - moment/mass)/step;
+        weights[ibin] = wt < 0 ? 0.0 : (wt > 1 ? 1.0 : wt);
+    }
+}
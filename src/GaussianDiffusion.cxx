@@ -1,4 +1,7 @@
 #include "WireCellGen/GaussianDiffusion.h"
+#include "WireCellGen/GausKernelCache.h"
+#include "WireCellGen/GaussKernels.h"
+#include "WireCellGen/Random.h"
 
 #include <iostream>		// debugging
 
@@ -19,10 +22,12 @@ std::vector<double> Gen::GausDesc::sample(double start, double step, int nsample
     }
     else{
         ret.resize(nsamples, 0.0);
+        std::vector<double> arg(nsamples);
         for (int ind=0; ind<nsamples; ++ind) {
             const double rel = (start + ind*step - center)/sigma;
-            ret[ind] = exp(-0.5*rel*rel);
+            arg[ind] = -0.5*rel*rel;
         }
+        exp_batch(arg.data(), ret.data(), nsamples);
     }
 
     return ret;
@@ -41,19 +46,7 @@ std::vector<double> Gen::GausDesc::binint(double start, double step, int nbins)
     }
     else{
         bins.resize(nbins, 0.0);
-        std::vector<double> erfs(nbins+1, 0.0);
-        const double sqrt2 = sqrt(2.0);
-        for (int ind=0; ind <= nbins; ++ind) {
-            double x = (start + step * ind - center)/(sqrt2*sigma);
-            erfs[ind] = 0.5*std::erf(x);
-        }
-
-        double tot = 0.0;
-        for (int ibin=0; ibin < nbins; ++ibin) {
-            const double val = erfs[ibin+1] - erfs[ibin];
-            tot += val;
-            bins[ibin] = val;
-        }
+        gauss_binint(center, sigma, start, step, nbins, bins.data());
     }
     return bins;
 }
@@ -70,21 +63,17 @@ std::vector<double> Gen::GausDesc::weight(double start, double step, int nbins,
     }
     else{
         wt.resize(nbins, 0.0);
-        const double pi = 4.0*atan(1);
-        double x2 = start;
-        double x1 = 0;
-        double gaus2 = exp(-0.5*(start-center)/sigma*(start-center)/sigma);
-        double gaus1 = 0;
+        auto gaus = sample(start, step, nbins+1); // at bin edges
+        const double norm = sigma/sqrt(2.0*M_PI);
         for (int ind=0; ind<nbins; ind++)
         {
-            x1 = x2;
-            x2 = x1 + step;
-            double rel = (x2-center)/sigma;
-            gaus1 = gaus2;
-            gaus2 = exp(-0.5*rel*rel);
+            const double x1 = start + step*ind;
+            const double x2 = x1 + step;
+            const double gaus1 = gaus[ind];
+            const double gaus2 = gaus[ind+1];
 
             // weighting
-            wt[ind] = -1.0*sigma/(x1-x2)*(gaus2-gaus1)/sqrt(2.0*pi)/pvec[ind] + (center-x2)/(x1-x2);
+            wt[ind] = -norm/(x1-x2)*(gaus2-gaus1)/pvec[ind] + (center-x2)/(x1-x2);
             /* std::cerr<<"Gaus: "<<"1 and 2 "<<gaus1<<", "<<gaus2<<std::endl; */
             /* std::cerr<<"center, x1, x2: "<<center<<", "<<x1<<", "<<x2<<std::endl; */
             /* std::cerr<<"Total charge: "<<pvec[ind]<<std::endl; */
@@ -116,18 +105,53 @@ Gen::GaussianDiffusion::GaussianDiffusion(const IDepo::pointer& depo,
     : m_deposition(depo)
     , m_time_desc(time_desc)
     , m_pitch_desc(pitch_desc)
+    , m_time_length(0)
+    , m_pitch_length(0)
+    , m_toffset_bin(-1)
+    , m_poffset_bin(-1)
+{
+}
+
+Gen::GaussianDiffusion::GaussianDiffusion(const IDepo::pointer& depo,
+					  const GausDesc& time_desc,
+					  const GausDesc& pitch_desc,
+                                          double time_length, double pitch_length)
+    : m_deposition(depo)
+    , m_time_desc(time_desc)
+    , m_pitch_desc(pitch_desc)
+    , m_time_length(time_length)
+    , m_pitch_length(pitch_length)
     , m_toffset_bin(-1)
     , m_poffset_bin(-1)
 {
 }
 
+std::pair<double,double> Gen::GaussianDiffusion::time_range(double nsigma) const
+{
+    GausDescRange r(nsigma);
+    r.add(m_time_desc, m_time_length);
+    return r.range();
+}
+
+std::pair<double,double> Gen::GaussianDiffusion::pitch_range(double nsigma) const
+{
+    GausDescRange r(nsigma);
+    r.add(m_pitch_desc, m_pitch_length);
+    return r.range();
+}
+
 void Gen::GaussianDiffusion::set_sampling(const Binning& tbin, // overall time tick binning
                                           const Binning& pbin, // overall impact position binning
                                           double nsigma,
                                           IRandom::pointer fluctuate,
-                                          unsigned int weightstrat)
+                                          unsigned int weightstrat,
+                                          GausKernelCache* kcache)
 {
-    if (m_patch.size() > 0) {
+    if (m_patch.size() > 0 || separable()) {
+        return;
+    }
+    if (segment()) {
+        sample_segment(tbin, pbin, nsigma, fluctuate, weightstrat);
         return;
     }
 
@@ -137,7 +161,14 @@ void Gen::GaussianDiffusion::set_sampling(const Binning& tbin, // overall time t
     const size_t ntss = tbin_range.second - tbin_range.first;
     m_toffset_bin = tbin_range.first;
     //auto tvec =  m_time_desc.sample(tbin.center(m_toffset_bin), tbin.binsize(), ntss);
-    auto tvec =  m_time_desc.binint(tbin.edge(m_toffset_bin), tbin.binsize(), ntss);
+    std::vector<double> tvec;
+    auto tkern = kcache ? kcache->get(m_time_desc, tbin.edge(m_toffset_bin), tbin.binsize(), ntss) : nullptr;
+    if (tkern) {
+        tvec = tkern->bins;
+    }
+    else {
+        tvec = m_time_desc.binint(tbin.edge(m_toffset_bin), tbin.binsize(), ntss);
+    }
 
     if (!ntss) {
         cerr << "Gen::GaussianDiffusion: no time bins for [" << tval_range.first/units::us << "," << tval_range.second/units::us << "] us\n";
@@ -150,8 +181,26 @@ void Gen::GaussianDiffusion::set_sampling(const Binning& tbin, // overall time t
     const size_t npss = pbin_range.second - pbin_range.first;
     m_poffset_bin = pbin_range.first;
     //auto pvec = m_pitch_desc.sample(pbin.center(m_poffset_bin), pbin.binsize(), npss);
-    auto pvec = m_pitch_desc.binint(pbin.edge(m_poffset_bin), pbin.binsize(), npss);
-    
+    std::vector<double> pvec;
+    auto pkern = kcache ? kcache->get(m_pitch_desc, pbin.edge(m_poffset_bin), pbin.binsize(), npss,
+                                      weightstrat == 2) : nullptr;
+    if (pkern) {
+        pvec = pkern->bins;
+        if (weightstrat == 2) {
+            m_qweights = pkern->weights;
+        }
+    }
+    else if (weightstrat == 2 && m_pitch_desc.sigma) {
+        // integrals and weights share the edge evaluations
+        pvec.resize(npss);
+        m_qweights.resize(npss);
+        gauss_binint(m_pitch_desc.center, m_pitch_desc.sigma, pbin.edge(m_poffset_bin), pbin.binsize(),
+                     npss, pvec.data(), m_qweights.data());
+    }
+    else {
+        pvec = m_pitch_desc.binint(pbin.edge(m_poffset_bin), pbin.binsize(), npss);
+    }
+
 
     if (!npss) {
         cerr << "No impact bins [" << pval_range.first/units::mm << "," << pval_range.second/units::mm << "] mm\n";
@@ -162,7 +211,7 @@ void Gen::GaussianDiffusion::set_sampling(const Binning& tbin, // overall time t
 
     // make charge weights for later interpolation.
     /// fixme: for hanyu.
-    if(weightstrat == 2){
+    if(weightstrat == 2 && !m_pitch_desc.sigma && !pkern){
         auto wvec = m_pitch_desc.weight(pbin.edge(m_poffset_bin), pbin.binsize(), npss, pvec);
         m_qweights = wvec;
     }
@@ -170,73 +219,182 @@ void Gen::GaussianDiffusion::set_sampling(const Binning& tbin, // overall time t
         m_qweights.resize(npss, 0.5);
     }
 
-    // start making the time vs impact patch of charge.
-    patch_t ret = patch_t::Zero(npss, ntss);
-    double raw_sum=0.0;
-
-    // Convolve the two independent Gaussians
-    for (size_t ip = 0; ip < npss; ++ip) {
-	for (size_t it = 0; it < ntss; ++it) {
-	    const double val = pvec[ip]*tvec[it];
-	    raw_sum += val;
-	    ret(ip,it) = (float)val;
-	}
+    // Without fluctuation the patch is the outer product of the two
+    // Gaussians so keep just them, normalized to the total charge.
+    if (!fluctuate) {
+        double psum = 0, tsum = 0;
+        for (auto p : pvec) { psum += p; }
+        for (auto t : tvec) { tsum += t; }
+        const double scale = m_deposition->charge() / (psum*tsum);
+        for (auto& p : pvec) { p *= scale; }
+        m_pvec = std::move(pvec);
+        m_tvec = std::move(tvec);
+        return;
     }
 
-    // normalize to total charge
-    ret *= m_deposition->charge() / raw_sum;
+    std::vector<double> probs(npss*ntss);
+    for (size_t it = 0; it < ntss; ++it) {
+        for (size_t ip = 0; ip < npss; ++ip) {
+            probs[it*npss + ip] = pvec[ip]*tvec[it];
+        }
+    }
+    fluctuate_patch(*fluctuate, probs, npss, ntss);
+}
 
-    const double charge_sign = m_deposition->charge() < 0 ? -1 : 1;
+void Gen::GaussianDiffusion::sample_segment(const Binning& tbin, const Binning& pbin, double nsigma,
+                                            IRandom::pointer fluctuate, unsigned int weightstrat)
+{
+    auto tval_range = time_range(nsigma);
+    auto tbin_range = tbin.sample_bin_range(tval_range.first, tval_range.second);
+    const int ntss = tbin_range.second - tbin_range.first;
+    m_toffset_bin = tbin_range.first;
 
-    double fluc_sum = 0;
-    if (fluctuate) {
-        double unfluc_sum = 0;
-
-	for (size_t ip = 0; ip < npss; ++ip) {
-	    for (size_t it = 0; it < ntss; ++it) {
-		const float oldval = ret(ip,it);
-                unfluc_sum += oldval;
-                // should be a multinomial distribution, n_i follows binomial distribution
-                // but n_i, n_j has covariance -n_tot * p_i * p_j
-                // normalize later to approximate this multinomial distribution (how precise?)
-                // how precise? better than poisson and 10000 total charge corresponds to a <1% level error.
-                float number = fluctuate->binomial((int)(std::abs(m_deposition->charge())), oldval/m_deposition->charge());
-                //the charge should be netagive -- ionization electrons
-		fluc_sum += charge_sign*number;
-		ret(ip,it) = charge_sign*number;
-	    }
-	}
-        if (fluc_sum == 0) {
-           // cerr << "No net charge after fluctuation. Total unfluctuated = "
-           //      << unfluc_sum
-           //      << " Qdepo = " << m_deposition->charge()
-           //      << endl;
-           return;
+    auto pval_range = pitch_range(nsigma);
+    auto pbin_range = pbin.sample_bin_range(pval_range.first, pval_range.second);
+    const int npss = pbin_range.second - pbin_range.first;
+    m_poffset_bin = pbin_range.first;
+
+    if (ntss <= 0 || npss <= 0) {
+        cerr << "Gen::GaussianDiffusion: no bins for segment over ["
+             << tval_range.first/units::us << "," << tval_range.second/units::us << "] us, ["
+             << pval_range.first/units::mm << "," << pval_range.second/units::mm << "] mm\n";
+        return;
+    }
+
+    // The line charge is not separable so cut the segment into
+    // pieces which cross at most a quarter sigma (or bin) in the
+    // dimension where it moves the least.  Each piece is the product
+    // of the smeared uniform charge along its time and pitch spans,
+    // integrated over the bins in closed form.
+    const double tscale = std::max(m_time_desc.sigma, tbin.binsize());
+    const double pscale = std::max(m_pitch_desc.sigma, pbin.binsize());
+    const double minor = std::min(std::abs(m_time_length)/tscale, std::abs(m_pitch_length)/pscale);
+    const int npieces = std::max(1, (int)std::ceil(minor/0.25));
+    const bool want_weights = weightstrat == 2;
+
+    std::vector<double> probs(npss*ntss, 0.0), wsum(npss, 0.0), psum(npss, 0.0);
+    std::vector<double> tvec, pvec, wvec;
+    for (int ipiece = 0; ipiece < npieces; ++ipiece) {
+        const double f0 = double(ipiece)/npieces, f1 = double(ipiece+1)/npieces;
+        const double t0 = m_time_desc.center + f0*m_time_length;
+        const double t1 = m_time_desc.center + f1*m_time_length;
+        const double p0 = m_pitch_desc.center + f0*m_pitch_length;
+        const double p1 = m_pitch_desc.center + f1*m_pitch_length;
+
+        // bins of the piece, inside those of the whole segment
+        auto tr = tbin.sample_bin_range(std::min(t0,t1) - nsigma*m_time_desc.sigma,
+                                        std::max(t0,t1) + nsigma*m_time_desc.sigma);
+        auto pr = pbin.sample_bin_range(std::min(p0,p1) - nsigma*m_pitch_desc.sigma,
+                                        std::max(p0,p1) + nsigma*m_pitch_desc.sigma);
+        const int it0 = std::max(tr.first, m_toffset_bin) - m_toffset_bin;
+        const int it1 = std::min(tr.second, m_toffset_bin + ntss) - m_toffset_bin;
+        const int ip0 = std::max(pr.first, m_poffset_bin) - m_poffset_bin;
+        const int ip1 = std::min(pr.second, m_poffset_bin + npss) - m_poffset_bin;
+        if (it1 <= it0 || ip1 <= ip0) {
+            continue;
+        }
+
+        tvec.resize(it1-it0);
+        gauss_box_binint(t0, t1, m_time_desc.sigma, tbin.edge(m_toffset_bin+it0), tbin.binsize(),
+                         it1-it0, tvec.data());
+        pvec.resize(ip1-ip0);
+        wvec.resize(want_weights ? ip1-ip0 : 0);
+        gauss_box_binint(p0, p1, m_pitch_desc.sigma, pbin.edge(m_poffset_bin+ip0), pbin.binsize(),
+                         ip1-ip0, pvec.data(), want_weights ? wvec.data() : nullptr);
+
+        if (npieces == 1 && !fluctuate) {
+            break;              // separable, below
+        }
+        for (int it = it0; it < it1; ++it) {
+            const double tval = tvec[it-it0];
+            double* col = probs.data() + it*npss;
+            for (int ip = ip0; ip < ip1; ++ip) {
+                col[ip] += pvec[ip-ip0]*tval;
+            }
         }
-        else {
-            ret *= m_deposition->charge() / fluc_sum;
+        for (int ip = ip0; ip < ip1; ++ip) {
+            psum[ip] += pvec[ip-ip0];
+            if (want_weights) {
+                wsum[ip] += pvec[ip-ip0]*wvec[ip-ip0];
+            }
         }
     }
 
+    // The charge weights of a row are averaged over the pieces.
+    m_qweights.assign(npss, 0.5);
 
-    {                           // debugging
-        //double retsum=0.0;
-        //for (size_t ip = 0; ip < npss; ++ip) {
-        //    for (size_t it = 0; it < ntss; ++it) {
-        //        retsum += ret(ip,it);
-        //    }
-        //}
-        // cerr << "GaussianDiffusion: Q in electrons: depo=" << m_deposition->charge()/units::eplus
-        //      << " rawsum=" << raw_sum/units::eplus << " flucsum=" << fluc_sum/units::eplus
-        //      << " returned=" << retsum/units::eplus << endl;
+    if (npieces == 1 && !fluctuate) {
+        if ((int)pvec.size() != npss || (int)tvec.size() != ntss) {
+            return;
+        }
+        double ptot = 0, ttot = 0;
+        for (auto p : pvec) { ptot += p; }
+        for (auto t : tvec) { ttot += t; }
+        const double scale = m_deposition->charge() / (ptot*ttot);
+        for (auto& p : pvec) { p *= scale; }
+        if (want_weights) {
+            m_qweights = wvec;
+        }
+        m_pvec = std::move(pvec);
+        m_tvec = std::move(tvec);
+        return;
     }
 
+    if (want_weights) {
+        for (int ip = 0; ip < npss; ++ip) {
+            if (psum[ip] > 0) {
+                m_qweights[ip] = wsum[ip]/psum[ip];
+            }
+        }
+    }
 
+    if (fluctuate) {
+        fluctuate_patch(*fluctuate, probs, npss, ntss);
+        return;
+    }
+
+    double total = 0;
+    for (auto p : probs) { total += p; }
+    if (total <= 0) {
+        return;
+    }
+    const double scale = m_deposition->charge() / total;
+    m_patch.resize(npss, ntss);
+    for (int it = 0; it < ntss; ++it) {
+        for (int ip = 0; ip < npss; ++ip) {
+            m_patch(ip,it) = (float)(scale*probs[it*npss + ip]);
+        }
+    }
+}
+
+void Gen::GaussianDiffusion::fluctuate_patch(IRandom& rng, const std::vector<double>& probs,
+                                             size_t npss, size_t ntss)
+{
+    // Fluctuate the charge in the patch as a multinomial of the depo
+    // electrons over the bins so the total is kept without rescaling.
+    const double charge_sign = m_deposition->charge() < 0 ? -1 : 1;
+    const int nelectrons = (int)(std::abs(m_deposition->charge()));
+    if (nelectrons == 0) {
+        return;
+    }
+    std::vector<int> counts;
+    multinomial(rng, nelectrons, probs, counts);
+
+    patch_t ret(npss, ntss);
+    for (size_t it = 0; it < ntss; ++it) {
+        for (size_t ip = 0; ip < npss; ++ip) {
+            ret(ip,it) = charge_sign*counts[it*npss + ip];
+        }
+    }
     m_patch = ret;
 }
 
 void Gen::GaussianDiffusion::clear_sampling(){
   m_patch.resize(0,0); 
+  m_pvec.clear();
+  m_pvec.shrink_to_fit();
+  m_tvec.clear();
+  m_tvec.shrink_to_fit();
   m_qweights.clear();
   m_qweights.shrink_to_fit();
 }
@@ -245,10 +403,19 @@ void Gen::GaussianDiffusion::clear_sampling(){
 // patch(row,col)
 const Gen::GaussianDiffusion::patch_t& Gen::GaussianDiffusion::patch() const
 {
+    if (separable() && m_patch.size() == 0) {
+        const int np = m_pvec.size(), nt = m_tvec.size();
+        m_patch.resize(np, nt);
+        for (int it = 0; it < nt; ++it) {
+            for (int ip = 0; ip < np; ++ip) {
+                m_patch(ip,it) = (float)(m_pvec[ip]*m_tvec[it]);
+            }
+        }
+    }
     return m_patch;
 }
 
-const std::vector<double> Gen::GaussianDiffusion::weights() const
+const std::vector<double>& Gen::GaussianDiffusion::weights() const
 {
     return m_qweights;
 }
@@ -1,5 +1,6 @@
 #include "WireCellGen/ImpactData.h"
 
+#include <algorithm>
 #include <iostream>             // debugging
 
 using namespace WireCell;
@@ -7,6 +8,9 @@ using namespace std;
 
 Gen::ImpactData::ImpactData(int impact)
     : m_impact(impact)
+    , m_tbin(0)
+    , m_nticks(0)
+    , m_calculated(false)
 {
 }
 void Gen::ImpactData::add(GaussianDiffusion::pointer diffusion)
@@ -14,64 +18,126 @@ void Gen::ImpactData::add(GaussianDiffusion::pointer diffusion)
     m_diffusions.push_back(diffusion);
 }
 
-Waveform::realseq_t& Gen::ImpactData::waveform() const
+namespace {
+    // Place the window starting at tbin in nticks zeros.
+    Waveform::realseq_t unwindow(const Waveform::realseq_t& window, int tbin, int nticks)
+    {
+        Waveform::realseq_t wave(nticks, 0.0);
+        std::copy(window.begin(), window.end(), wave.begin() + tbin);
+        return wave;
+    }
+}
+
+Waveform::realseq_t Gen::ImpactData::waveform() const
 {
-    return m_waveform;
+    return unwindow(m_waveform, m_tbin, m_nticks);
 }
 
-Waveform::compseq_t& Gen::ImpactData::spectrum() const
+Waveform::compseq_t Gen::ImpactData::spectrum() const
 {
-    return m_spectrum;
+    return Waveform::dft(waveform());
 }
 
-Waveform::realseq_t& Gen::ImpactData::weightform() const
+Waveform::realseq_t Gen::ImpactData::weightform() const
 {
-    return m_weights;
+    return unwindow(m_weights, m_tbin, m_nticks);
 }
 
-Waveform::compseq_t& Gen::ImpactData::weight_spectrum() const
+Waveform::compseq_t Gen::ImpactData::weight_spectrum() const
 {
-    return m_weight_spectrum;
+    return Waveform::dft(weightform());
+}
+
+const Gen::ImpactData::window_spectra_t& Gen::ImpactData::window_spectra(int nfft) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_spectra.find(nfft);
+    if (it != m_spectra.end()) {
+        return it->second;
+    }
+    Waveform::realseq_t wave(nfft, 0.0), weights(nfft, 0.0);
+    std::copy(m_waveform.begin(), m_waveform.end(), wave.begin());
+    std::copy(m_weights.begin(), m_weights.end(), weights.begin());
+    auto& spectra = m_spectra[nfft];
+    spectra.first = Waveform::dft(wave);
+    spectra.second = Waveform::dft(weights);
+    return spectra;
 }
 
 void Gen::ImpactData::calculate(int nticks) const
 {
-    if (m_waveform.size() > 0) {
+    if (m_calculated) {
+        return;
+    }
+    m_calculated = true;
+    m_nticks = nticks;
+
+    // Find the window of ticks reached by the diffusions covering
+    // this impact.
+    int tbeg = nticks, tend = 0;
+    for (const auto& diff : m_diffusions) {
+        const int pbin = m_impact - diff->poffset_bin();
+        const bool separable = diff->separable();
+        const int np = separable ? diff->pitch_vec().size() : diff->patch().rows();
+        if (pbin<0 || pbin >= np) {
+            continue;
+        }
+        const int nt = separable ? diff->time_vec().size() : diff->patch().cols();
+        const int toffset_bin = diff->toffset_bin();
+        tbeg = std::min(tbeg, std::max(toffset_bin, 0));
+        tend = std::max(tend, std::min(toffset_bin + nt, nticks));
+    }
+    if (tend <= tbeg) {
+        m_tbin = 0;
         return;
     }
-    m_waveform.resize(nticks, 0.0);
-    m_weights.resize(nticks, 0.0);
+    m_tbin = tbeg;
+    m_waveform.resize(tend-tbeg, 0.0);
+    m_weights.resize(tend-tbeg, 0.0);
 
-    for (auto diff : m_diffusions) {
+    for (const auto& diff : m_diffusions) {
 
-	const auto patch = diff->patch();
-	const auto qweight = diff->weights();
+	const auto& qweight = diff->weights();
 
         const int poffset_bin = diff->poffset_bin();
         const int pbin = m_impact - poffset_bin;
+        const int toffset_bin = diff->toffset_bin();
+        // window columns
+        const int tbin0 = std::max(0, -toffset_bin);
+        const int shift = toffset_bin - m_tbin;
+
+        if (diff->separable()) {
+            const auto& pvec = diff->pitch_vec();
+            const auto& tvec = diff->time_vec();
+            if (pbin<0 || pbin >= (int)pvec.size()) {
+                continue;
+            }
+            const double pval = pvec[pbin];
+            const int nt = std::min((int)tvec.size(), nticks - toffset_bin);
+            for (int tbin=tbin0; tbin<nt; ++tbin) {
+                const double charge = (float)(pval*tvec[tbin]);
+                m_waveform[tbin+shift] += charge;
+                m_weights[tbin+shift] += qweight[pbin]*charge;
+            }
+            continue;
+        }
+
+	const auto& patch = diff->patch();
         const int np = patch.rows();
         if (pbin<0 || pbin >= np) {
             continue;
         }
 
-        const int toffset_bin = diff->toffset_bin();
-        const int nt = patch.cols();
+        const int nt = std::min((int)patch.cols(), nticks - toffset_bin);
 
-	//	std::cout << pbin << " " << poffset_bin << " " << m_impact << std::endl;
-	
-        for (int tbin=0; tbin<nt; ++tbin) {
-            const int absbin = tbin+toffset_bin;
-            m_waveform[absbin] += patch(pbin, tbin);
+        for (int tbin=tbin0; tbin<nt; ++tbin) {
+            const int winbin = tbin+shift;
+            m_waveform[winbin] += patch(pbin, tbin);
 
-	    //  std::cout << pbin << " " << tbin << " " << patch(pbin,tbin) << std::endl;
-	    
             // for interpolation
-            m_weights[absbin] += qweight[pbin]*patch(pbin, tbin);
+            m_weights[winbin] += qweight[pbin]*patch(pbin, tbin);
         }
     }
-
-    m_spectrum = Waveform::dft(m_waveform);
-    m_weight_spectrum = Waveform::dft(m_weights);
 }
 
 
@@ -93,10 +159,9 @@ std::pair<double, double> Gen::ImpactData::span(double nsigma) const
     for (auto diff : m_diffusions) {
         ++ncount;
         
-        auto td = diff->time_desc();
-
-        const double ltmin = td.center - td.sigma*nsigma;
-        const double ltmax = td.center + td.sigma*nsigma;
+        const auto tr = diff->time_range(nsigma);
+        const double ltmin = tr.first;
+        const double ltmax = tr.second;
         if (!ncount) {
             tmin = ltmin;
             tmax = ltmax;
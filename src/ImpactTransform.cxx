@@ -1,14 +1,28 @@
 #include "WireCellGen/ImpactTransform.h"
+#include "WireCellGen/PlaneImpactResponse.h"
 #include "WireCellUtil/Testing.h"
+#include "WireCellGen/ThreadUtil.h"
 #include "WireCellUtil/FFTBestLength.h"
 
 #include <iostream>             // debugging.
 using namespace std;
 
 using namespace WireCell;
-Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedDiffusion_transform& bd)
-  :m_pir(pir), m_bd(bd)
+
+Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedDiffusion_transform& bd,
+                                      int nthreads, bool deferred,
+                                      int tile_wires, int tile_ticks, size_t memory_budget,
+                                      std::shared_ptr<ResponseSpectraCache> cache)
+  :m_pir(pir), m_bd(bd), m_nthreads(nthreads)
+  , m_memory_budget(memory_budget), m_mem_now(0), m_mem_peak(0)
+  , m_cache(cache), m_long_wbeg(0), m_long_done(false)
 {
+  // With split responses only the field response enters the 2D
+  // convolution and the short responses are applied per wire after.
+  auto gpir = std::dynamic_pointer_cast<const Gen::PlaneImpactResponse>(m_pir);
+  if (gpir && gpir->split_short()) {
+    m_split_pir = gpir;
+  }
 
   // for (int i=0;i!=210;i++){
   //   double pos = -31.5 + 0.3*i+1e-9;0
@@ -20,7 +34,6 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
   m_num_group = std::round(m_pir->pitch()/m_pir->impact())+1; // 11
   m_num_pad_wire = std::round((m_pir->nwires()-1)/2.); // 10
 
-  const auto pimpos = m_bd.pimpos();
   //  const int nsamples = m_bd.tbins().nbins();
   //const auto rb = pimpos.region_binning();
   //const int nwires = rb.nbins();
@@ -28,6 +41,7 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
   //
   
   //std::cout << m_num_group << " " << m_num_pad_wire << std::endl;
+
   for (int i=0;i!=m_num_group;i++){
     double rel_cen_imp_pos ;
     if (i!=m_num_group-1){
@@ -40,7 +54,6 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
     
     for (int j=0;j!=m_pir->nwires();j++){
       map_resp[j-m_num_pad_wire] = m_pir->closest(rel_cen_imp_pos - (j-m_num_pad_wire)*m_pir->pitch());
-      Waveform::compseq_t response_spectrum = map_resp[j-m_num_pad_wire]->spectrum();
       
       //	std::cout << i << " " << j << " " << rel_cen_imp_pos - (j-m_num_pad_wire)*m_pir->pitch()<< " " << response_spectrum.size() << std::endl;
     }
@@ -52,9 +65,6 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
     //Eigen::SparseMatrix<float> *mat = new Eigen::SparseMatrix<float>(nsamples,nwires);
     //  mat.reserve(Eigen::VectorXi::Constant(nwires,1000));
     //m_vec_spmatrix.push_back(mat);
-    
-    std::vector<std::tuple<int,int, double> > vec_charge; // ch, time, charge
-    m_vec_vec_charge.push_back(vec_charge);
   }
 
   // m_bd.get_charge_matrix(m_vec_spmatrix, m_vec_impact);
@@ -63,8 +73,6 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
  
   
   // now work on the charge part ...
-  // trying to sampling ...
-  m_bd.get_charge_vec(m_vec_vec_charge, m_vec_impact);
   //std::cout << nwires << " " << nsamples << std::endl;
   
   // for (size_t i=0;i!=m_vec_vec_charge.size();i++){
@@ -85,18 +93,66 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
 
   int start_ch = std::floor(impact_range.first*1.0/(m_num_group-1))-1;
   int end_ch = std::ceil(impact_range.second*1.0/(m_num_group-1))+2;
-  if ( (end_ch-start_ch)%2==1) end_ch += 1;
   int start_tick = time_range.first-1;
   int end_tick = time_range.second+2;
+
+  BinnedDiffusion_transform::ChargeGrid grid;
+  if (tile_wires > 0 && tile_ticks > 0) {
+    make_tiles(grid, start_ch, end_ch, start_tick, end_tick, tile_wires, tile_ticks);
+  }
+  if (m_tiles.empty()) {
+    m_tiles.push_back(make_tile(start_ch, end_ch, start_tick, end_tick));
+    const Tile& tile = m_tiles.back();
+    grid.start_ch = tile.charge_ch;
+    grid.start_tick = tile.charge_tick;
+    grid.cell_wires = std::max(tile.charge_rows, 1);
+    grid.cell_ticks = std::max(tile.charge_cols, 1);
+    grid.ncw = grid.nct = 1;
+    grid.cell_window.assign(1, 0);
+  }
+
+  // trying to sampling ...
+  //
+  // The charge is accumulated directly into one dense array per
+  // impact group over each tile's charge window.
+  for (const auto& tile : m_tiles) {
+    grid.windows.push_back(BinnedDiffusion_transform::ChargeGrid::Window{tile.charge_ch, tile.charge_tick,
+        std::vector<Array::array_xxf>(m_num_group, Array::array_xxf::Zero(tile.charge_rows, tile.charge_cols))});
+  }
+  m_bd.get_charge_grid(grid, m_vec_impact, m_nthreads);
+  for (size_t itile = 0; itile < m_tiles.size(); ++itile) {
+    m_tiles[itile].charge = std::move(grid.windows[itile].groups);
+    for (const auto& q : m_tiles[itile].charge) {
+      mem_add(q.size()*sizeof(float));
+    }
+  }
+
+  if (!deferred) {
+    transform();
+  }
+}
+
+
+Gen::ImpactTransform::Tile Gen::ImpactTransform::make_tile(int start_ch, int end_ch, int start_tick, int end_tick) const
+{
+  if ( (end_ch-start_ch)%2==1) end_ch += 1;
   if ( (end_tick-start_tick)%2==1 ) end_tick += 1;
   
-  
   //  m_decon_data = Array::array_xxf::Zero(nwires+2*m_num_pad_wire,nsamples);    
   // for saving the accumulated wire data in the time frequency domain ...
   // adding no padding now, it make the FFT slower, need some other methods ... 
   
+  Tile tile;
+  tile.charge_ch = start_ch;
+  tile.charge_tick = start_tick;
+  tile.charge_rows = end_ch - start_ch;
+  tile.charge_cols = end_tick - start_tick;
+
   int npad_wire =0;
-  const size_t ntotal_wires = fft_best_length(end_ch - start_ch + 2 * m_num_pad_wire,1);
+  // Cached spectra are only found again for repeated shapes.
+  const int nwant_wires = end_ch - start_ch + 2 * m_num_pad_wire;
+  const size_t ntotal_wires = m_cache ? ResponseSpectraCache::canonical_length(nwant_wires)
+    : fft_best_length(nwant_wires,1);
 
   //   pow(2,std::ceil(log(end_ch - start_ch + 2 * m_num_pad_wire)/log(2)));
   //  if (nwires == 2400){
@@ -107,21 +163,24 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
   //   ntotal_wires = 3600;
     //      npad_wire=72; //3600
   //}
+
   npad_wire= (ntotal_wires -end_ch + start_ch)/2;
-  m_start_ch = start_ch - npad_wire;
-  m_end_ch = end_ch + npad_wire;
+  tile.start_ch = start_ch - npad_wire;
+  tile.end_ch = end_ch + npad_wire;
   //std::cout << start_ch << " " << end_ch << " " << npad_wire << " " << start_tick << " " << end_tick << " " << m_start_ch << " " << m_end_ch << std::endl;
-
   
-  int npad_time = m_pir->closest(0)->waveform_pad();
-  const size_t ntotal_ticks = fft_best_length(end_tick - start_tick + npad_time);
+  int npad_time = m_split_pir ? m_split_pir->field_pad() : m_pir->closest(0)->waveform_pad();
+  const int nwant_ticks = end_tick - start_tick + npad_time;
+  const size_t ntotal_ticks = m_cache ? ResponseSpectraCache::canonical_length(nwant_ticks)
+    : fft_best_length(nwant_ticks);
 
   // pow(2,std::ceil(log(end_tick - start_tick + npad_time)/log(2)));
   // if (ntotal_ticks >9800 && nsamples <9800 && nsamples >9550)
   //  ntotal_ticks = 9800;
+
   npad_time = ntotal_ticks - end_tick + start_tick;
-  m_start_tick = start_tick;
-  m_end_tick = end_tick + npad_time;
+  tile.start_tick = start_tick;
+  tile.end_tick = end_tick + npad_time;
   
   // m_end_tick = 16384;//nsamples;
   // m_start_tick = 0;
@@ -133,308 +192,431 @@ Gen::ImpactTransform::ImpactTransform(IPlaneImpactResponse::pointer pir, BinnedD
   // npad_time = ntotal_ticks - nsamples;
   // m_start_tick = 0;
   // m_end_tick = ntotal_ticks;
-  
-  
-  Array::array_xxc acc_data_f_w = Array::array_xxc::Zero(end_ch-start_ch+2*npad_wire, m_end_tick - m_start_tick); 
-  
-  int num_double = (m_vec_vec_charge.size()-1)/2;
-  //int num_double = (m_vec_spmatrix.size()-1)/2;
-  
-  // speed up version , first five
-  for (int i=0;i!=num_double;i++){
-    //if (i!=0) continue;
-    // std::cout << i << std::endl;
-    Array::array_xxc c_data = Array::array_xxc::Zero(end_ch-start_ch+2*npad_wire,m_end_tick - m_start_tick);
-    
-    // fill normal order
-    for (size_t j=0;j!=m_vec_vec_charge.at(i).size();j++){
-      c_data(std::get<0>(m_vec_vec_charge.at(i).at(j))+npad_wire-start_ch,std::get<1>(m_vec_vec_charge.at(i).at(j))-m_start_tick) +=  std::get<2>(m_vec_vec_charge.at(i).at(j));
+  tile.fft_ticks = tile.end_tick - tile.start_tick;
+  return tile;
+}
+
+
+void Gen::ImpactTransform::make_tiles(BinnedDiffusion_transform::ChargeGrid& grid,
+                                      int start_ch, int end_ch, int start_tick, int end_tick,
+                                      int tile_wires, int tile_ticks)
+{
+  // Mark the coarse (wire, tick) cells which will receive charge.
+  // Cells are aligned to multiples of their size so that the
+  // occupancy kept while adding depos can be used directly.
+  auto floor_div = [](int num, int den) { return num >= 0 ? num/den : -((-num + den - 1)/den); };
+  const int cw_off = floor_div(start_ch, tile_wires);
+  const int ct_off = floor_div(start_tick, tile_ticks);
+  const int cell_ch = cw_off*tile_wires;
+  const int cell_tick = ct_off*tile_ticks;
+  const int ncw = (end_ch - cell_ch + tile_wires - 1)/tile_wires;
+  const int nct = (end_tick - cell_tick + tile_ticks - 1)/tile_ticks;
+  if (ncw <= 0 || nct <= 0) {
+    return;
+  }
+  std::vector<int> label(ncw*nct, -1); // -1 empty, -2 occupied
+  const auto& occ = m_bd.occupancy();
+  if (occ.cell_wires == tile_wires && occ.cell_ticks == tile_ticks) {
+    for (int cw = std::max(-cw_off, 0); cw < std::min(ncw, occ.ncw - cw_off); ++cw) {
+      for (int ct = std::max(-ct_off, 0); ct < std::min(nct, occ.nct - ct_off); ++ct) {
+        if (occ.counts[(cw + cw_off)*occ.nct + ct + ct_off] > 0) {
+          label[cw*nct + ct] = -2;
+        }
+      }
     }
-    //    std::cout << i << " " << m_vec_vec_charge.at(i).size() << std::endl;
-    m_vec_vec_charge.at(i).clear();
-    m_vec_vec_charge.at(i).shrink_to_fit();
-
-    // useing matrix form ...
-    // for (int k=0; k<m_vec_spmatrix.at(i)->outerSize(); ++k)
-    //   for (Eigen::SparseMatrix<float>::InnerIterator it(*m_vec_spmatrix.at(i),k); it; ++it){
-    // 	c_data(it.col()+npad_wire-start_ch,it.row()-m_start_tick) = it.value();
-    //   }
-    // delete m_vec_spmatrix.at(i);
-    // //m_vec_spmatrix.at(i).setZero();
-    // //m_vec_spmatrix.at(i).resize(0,0);
-    
-    // fill reverse order
-    int ii=num_double*2-i;
-    for (size_t j=0;j!=m_vec_vec_charge.at(ii).size();j++){
-      c_data(end_ch+npad_wire-1-std::get<0>(m_vec_vec_charge.at(ii).at(j)),std::get<1>(m_vec_vec_charge.at(ii).at(j))-m_start_tick) +=  std::complex<float>(0,std::get<2>(m_vec_vec_charge.at(ii).at(j)));
+  }
+  else {
+    std::vector<std::array<int,4> > extents;
+    m_bd.get_charge_extents(extents);
+    for (const auto& ext : extents) {
+      const int cw0 = std::max((ext[0] - cell_ch)/tile_wires, 0);
+      const int cw1 = std::min((ext[1] - 1 - cell_ch)/tile_wires, ncw-1);
+      const int ct0 = std::max((ext[2] - cell_tick)/tile_ticks, 0);
+      const int ct1 = std::min((ext[3] - 1 - cell_tick)/tile_ticks, nct-1);
+      for (int cw = cw0; cw <= cw1; ++cw) {
+        for (int ct = ct0; ct <= ct1; ++ct) {
+          label[cw*nct + ct] = -2;
+        }
+      }
     }
-    //    std::cout << ii << " " << m_vec_vec_charge.at(ii).size() << std::endl;
-    m_vec_vec_charge.at(ii).clear();
-    m_vec_vec_charge.at(ii).shrink_to_fit();
-    // for (int k=0; k<m_vec_spmatrix.at(ii)->outerSize(); ++k)
-    //   for (Eigen::SparseMatrix<float>::InnerIterator it(*m_vec_spmatrix.at(ii),k); it; ++it){
-    // 	c_data(it.col()+npad_wire-start_ch,it.row()-m_start_tick) = it.value();
-    //   }
-    // delete m_vec_spmatrix.at(ii);
-    // //    m_vec_spmatrix.at(ii).setZero();
-    // //m_vec_spmatrix.at(ii).resize(0,0);
-    
-    
+  }
+
+  // Group touching cells into clusters, each becoming a tile
+  // covering the bounding box of its cells.
+  struct Box { int cw0, cw1, ct0, ct1; };
+  std::vector<Box> boxes;
+  std::vector<int> todo;
+  for (int icell = 0; icell < ncw*nct; ++icell) {
+    if (label[icell] != -2) {
+      continue;
+    }
+    const int ibox = boxes.size();
+    Box box{icell/nct, icell/nct, icell%nct, icell%nct};
+    label[icell] = ibox;
+    todo.push_back(icell);
+    while (!todo.empty()) {
+      const int cell = todo.back();
+      todo.pop_back();
+      const int cw = cell/nct, ct = cell%nct;
+      box.cw0 = std::min(box.cw0, cw); box.cw1 = std::max(box.cw1, cw);
+      box.ct0 = std::min(box.ct0, ct); box.ct1 = std::max(box.ct1, ct);
+      for (int dw = -1; dw <= 1; ++dw) {
+        for (int dt = -1; dt <= 1; ++dt) {
+          const int nw = cw+dw, nt = ct+dt;
+          if (nw < 0 || nw >= ncw || nt < 0 || nt >= nct) {
+            continue;
+          }
+          const int ncell = nw*nct + nt;
+          if (label[ncell] == -2) {
+            label[ncell] = ibox;
+            todo.push_back(ncell);
+          }
+        }
+      }
+    }
+    boxes.push_back(box);
+  }
+  if (boxes.size() < 2) {
+    return;
+  }
+
+  // Boxes of different clusters may overlap but each cell sends its
+  // charge only to the tile of its own cluster.
+  std::vector<Tile> tiles;
+  long tiled_area = 0;
+  for (const auto& box : boxes) {
+    tiles.push_back(make_tile(std::max(cell_ch + box.cw0*tile_wires, start_ch),
+                              std::min(cell_ch + (box.cw1+1)*tile_wires, end_ch),
+                              std::max(cell_tick + box.ct0*tile_ticks, start_tick),
+                              std::min(cell_tick + (box.ct1+1)*tile_ticks, end_tick)));
+    tiled_area += long(tiles.back().end_ch - tiles.back().start_ch) * tiles.back().fft_ticks;
+  }
+
+  // Only worth it if the tiles are smaller than the whole.
+  Tile whole = make_tile(start_ch, end_ch, start_tick, end_tick);
+  if (tiled_area >= long(whole.end_ch - whole.start_ch) * whole.fft_ticks) {
+    return;
+  }
+
+  grid.start_ch = cell_ch;
+  grid.start_tick = cell_tick;
+  grid.cell_wires = tile_wires;
+  grid.cell_ticks = tile_ticks;
+  grid.ncw = ncw;
+  grid.nct = nct;
+  grid.cell_window = std::move(label);
+  m_tiles = std::move(tiles);
+}
+
+
+std::pair<int,int> Gen::ImpactTransform::fft_shape() const
+{
+  if (m_tiles.size() != 1) {
+    return std::make_pair(0,0);
+  }
+  const Tile& tile = m_tiles.front();
+  return std::make_pair(tile.end_ch - tile.start_ch, tile.fft_ticks);
+}
+
+
+void Gen::ImpactTransform::transform()
+{
+  // Tiles overlap only in their padding and their waveforms are
+  // summed on output.
+  for (auto& tile : m_tiles) {
+    const int nrows = tile.end_ch-tile.start_ch;
+    const long abytes = long(nrows) * tile.fft_ticks * sizeof(std::complex<float>);
+
+    // Over the memory budget the response spectra are built as each
+    // group needs them instead of held for all groups.
+    const int nlean = lean_chunks(tile);
+    response_spectra_t resp_spectra;
+    if (!nlean) {
+      resp_spectra = response_spectra(nrows, tile.fft_ticks);
+      mem_add(abytes*resp_spectra->size());
+    }
+    Array::array_xxc acc_data_f_w = convolve_pairs(tile, resp_spectra.get(), nlean);
+
+  // std::cout << "ABC : " << std::endl;
+  
+    // central region ...
+    const int i = (m_num_group-1)/2;
     // Do FFT on time
-    c_data = Array::dft_cc(c_data,0);
+    Array::array_xxc data_f_w = Array::dft_rc(central_charge(tile),0);
+    mem_add(2*abytes);
     // Do FFT on wire
-    c_data = Array::dft_cc(c_data,1);
-    
-    // std::cout << i << std::endl;
-    {
-      Array::array_xxc resp_f_w = Array::array_xxc::Zero(end_ch-start_ch+2*npad_wire,m_end_tick - m_start_tick);
-      {
-	Waveform::compseq_t rs1 = m_vec_map_resp.at(i)[0]->spectrum();
-	// do a inverse FFT
-	Waveform::realseq_t rs1_t = Waveform::idft(rs1);
-	// pick the first xxx ticks
-	Waveform::realseq_t rs1_reduced(m_end_tick-m_start_tick,0);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  if (icol >= int(rs1_t.size())) break;
-	  rs1_reduced.at(icol) = rs1_t[icol];
-	}
-	// do a FFT
-	rs1 = Waveform::dft(rs1_reduced);
-	
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  resp_f_w(0,icol) = rs1[icol];
-	}
-      }
-      
-      
-      for (int irow = 0; irow!=m_num_pad_wire;irow++){
-	Waveform::compseq_t rs1 = m_vec_map_resp.at(i)[irow+1]->spectrum();
-	Waveform::realseq_t rs1_t = Waveform::idft(rs1);
-	Waveform::realseq_t rs1_reduced(m_end_tick-m_start_tick,0);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  if (icol >= int(rs1_t.size())) break;
-	  rs1_reduced.at(icol) = rs1_t[icol];
-	}
-	rs1 = Waveform::dft(rs1_reduced);
-	Waveform::compseq_t rs2 = m_vec_map_resp.at(i)[-irow-1]->spectrum();
-	Waveform::realseq_t rs2_t = Waveform::idft(rs2);
-	Waveform::realseq_t rs2_reduced(m_end_tick-m_start_tick,0);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  if (icol >= int(rs2_t.size())) break;
-	  rs2_reduced.at(icol) = rs2_t[icol];
-	}
-	rs2 = Waveform::dft(rs2_reduced);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  resp_f_w(irow+1,icol) = rs1[icol];
-	  resp_f_w(end_ch-start_ch-1-irow+2*npad_wire,icol) = rs2[icol];
-	}
-      }
-      //std::cout << i << std::endl;
-      
-      // Do FFT on wire for response // slight larger
-      resp_f_w = Array::dft_cc(resp_f_w,1); // Now becomes the f and f in both time and wire domain ...
-      // multiply them together
-      c_data = c_data * resp_f_w;
+    data_f_w = Array::dft_cc(data_f_w,1);
+    // multiply them together
+    if (resp_spectra) {
+      data_f_w = data_f_w * resp_spectra->at(i);
+    }
+    else {
+      Array::array_xxc resp_f_w;
+      response_spectrum(resp_f_w, i, nrows, tile.fft_ticks);
+      mem_add(abytes);
+      data_f_w *= resp_f_w;
+      mem_add(-abytes);
     }
-    
-    
     // Do inverse FFT on wire
-    c_data = Array::idft_cc(c_data,1);
-    
+    data_f_w = Array::idft_cc(data_f_w,1);
     // Add to wire result in frequency
-    acc_data_f_w += c_data;
-    
+    acc_data_f_w += data_f_w;
+    data_f_w.resize(0,0);
+    mem_add(-2*abytes);
+    if (resp_spectra) {
+      mem_add(-abytes*resp_spectra->size());
+      resp_spectra.reset();
+    }
+
+    finish(tile, acc_data_f_w);
+    mem_add(-abytes);
+  }
+  report();
+}
+
+
+void Gen::ImpactTransform::report() const
+{
+  long nchannels = 0, nticks = 0, ncells = 0;
+  for (const auto& tile : m_tiles) {
+    nchannels = std::max(nchannels, (long)tile.data.rows());
+    nticks = std::max(nticks, (long)tile.data.cols());
+    ncells += tile.data.size();
+  }
+  if (m_tiles.size() == 1) {
+    cerr << "Gen::ImpactTransform: # of channels: " << nchannels << " # of ticks: " << nticks << "\n";
+  }
+  else {
+    cerr << "Gen::ImpactTransform: convolved " << m_tiles.size() << " tiles of "
+         << ncells << " (channel, tick) cells\n";
   }
+  if (m_memory_budget) {
+    cerr << "Gen::ImpactTransform: work memory high-water mark: "
+         << m_mem_peak/(1024*1024) << " MB of " << m_memory_budget/(1024*1024) << " MB budget\n";
+  }
+}
+
+
+void Gen::ImpactTransform::transform(ImpactTransform& one, ImpactTransform& two)
+{
+  if (one.m_tiles.size() != 1 || one.fft_shape() != two.fft_shape()
+      || one.lean_chunks(one.m_tiles.front()) || two.lean_chunks(two.m_tiles.front())
+      || !pair_fits(one, two)) {
+    one.transform();
+    two.transform();
+    return;
+  }
+  Tile& tone = one.m_tiles.front();
+  Tile& ttwo = two.m_tiles.front();
+  const int nrows = tone.end_ch - tone.start_ch;
+  const int ncols = tone.fft_ticks;
+  const int i = (one.m_num_group-1)/2;
+  const int j = (two.m_num_group-1)/2;
+  const long abytes = long(nrows) * ncols * sizeof(std::complex<float>);
+
+  // Arrays used by both are tallied against the first.
+  auto resp_one = one.response_spectra(nrows, ncols);
+  one.mem_add(abytes*resp_one->size());
+  auto resp_two = two.response_spectra(nrows, ncols);
+  two.mem_add(abytes*resp_two->size());
+  Array::array_xxc acc_one = one.convolve_pairs(tone, resp_one.get());
+  Array::array_xxc acc_two = two.convolve_pairs(ttwo, resp_two.get());
+
+  // The two real central groups share one complex FFT as real and
+  // imaginary parts.  Their spectra are then separated using the
+  // conjugate symmetry of the transform of a real array.
+  Array::array_xxc packed(nrows, ncols);
+  packed.real() = one.central_charge(tone);
+  packed.imag() = two.central_charge(ttwo);
+  one.mem_add(2*abytes);
+  // Do FFT on time
+  packed = Array::dft_cc(packed,0);
+  // Do FFT on wire
+  packed = Array::dft_cc(packed,1);
+  one.mem_add(-abytes);
+
+  Array::array_xxc data_one(nrows, ncols), data_two(nrows, ncols);
+  one.mem_add(2*abytes);
+  const std::complex<float> half(0.5,0), minus_half_i(0,-0.5);
+  for (int icol=0; icol<ncols; ++icol) {
+    const int jcol = (ncols-icol)%ncols;
+    for (int irow=0; irow<nrows; ++irow) {
+      const int jrow = (nrows-irow)%nrows;
+      const auto z = packed(irow,icol);
+      const auto zc = std::conj(packed(jrow,jcol));
+      data_one(irow,icol) = half*(z+zc);
+      data_two(irow,icol) = minus_half_i*(z-zc);
+    }
+  }
+  // packed is freed and its place taken by the inverse FFT temporary
+  packed.resize(0,0);
+
+  // multiply them together, inverse FFT on wire and add
+  data_one = data_one * resp_one->at(i);
+  acc_one += Array::idft_cc(data_one,1);
+  data_two = data_two * resp_two->at(j);
+  acc_two += Array::idft_cc(data_two,1);
+  data_one.resize(0,0);
+  data_two.resize(0,0);
+  one.mem_add(-3*abytes);
+  one.mem_add(-abytes*resp_one->size());
+  two.mem_add(-abytes*resp_two->size());
+  resp_one.reset();
+  resp_two.reset();
+
+  one.finish(tone, acc_one);
+  two.finish(ttwo, acc_two);
+  one.mem_add(-abytes);
+  two.mem_add(-abytes);
+  one.report();
+  two.report();
+}
+
+
+Array::array_xxc Gen::ImpactTransform::convolve_pairs(Tile& tile, const std::vector<Array::array_xxc>* resp_spectra,
+                                                      int nlean)
+{
+  const int nrows = tile.end_ch-tile.start_ch;
+  const int ncols = tile.fft_ticks;
+  const long abytes = long(nrows) * ncols * sizeof(std::complex<float>);
+  Array::array_xxc acc_data_f_w = Array::array_xxc::Zero(nrows, ncols);
+  mem_add(abytes);
   
-  // std::cout << "ABC : " << std::endl;
+  int num_double = (tile.charge.size()-1)/2;
+  //int num_double = (m_vec_spmatrix.size()-1)/2;
   
-  // central region ...
-  {
-    int i = num_double;
-    // fill response array in frequency domain
+  // speed up version , first five
+  //
+  // Each pair of impact groups is independent up to the final sum.
+  // Threads take contiguous ranges of pairs and accumulate into their
+  // own array which are then summed in range order so the result
+  // depends only on the number of threads.  Each thread reuses one
+  // work array for all its groups.
+  const int nthreads = nlean > 0 ? nlean : m_nthreads;
+  std::vector<Array::array_xxc> acc_chunks(std::min(Gen::resolve_nthreads(nthreads), std::max(num_double,1)));
+  const int nchunks = Gen::parallel_chunks(nthreads, num_double, [&](int ichunk, int ibeg, int iend) {
+    Array::array_xxc& acc = acc_chunks[ichunk];
+    acc = Array::array_xxc::Zero(nrows, ncols);
+    Array::array_xxc c_data(nrows, ncols);
+    Array::array_xxc resp_f_w;
+    mem_add(2*abytes);
+
+    for (int i=ibeg;i!=iend;i++){
+      c_data.setZero();
+      const int col0 = tile.charge_tick - tile.start_tick;
+    
+      // fill normal order
+      auto& charge = tile.charge.at(i);
+      c_data.real().block(tile.charge_ch - tile.start_ch, col0, charge.rows(), charge.cols()) = charge;
+      mem_add(-long(charge.size()*sizeof(float)));
+      charge.resize(0,0);
+
+      // fill reverse order, wire ch goes to row end_ch-1-ch
+      int ii=num_double*2-i;
+      auto& rev_charge = tile.charge.at(ii);
+      c_data.imag().block(tile.end_ch - tile.charge_ch - rev_charge.rows(), col0, rev_charge.rows(), rev_charge.cols())
+        = rev_charge.colwise().reverse();
+      mem_add(-long(rev_charge.size()*sizeof(float)));
+      rev_charge.resize(0,0);
     
-    Array::array_xxc data_f_w;
-    {
-      Array::array_xxf data_t_w = Array::array_xxf::Zero(end_ch-start_ch+2*npad_wire,m_end_tick-m_start_tick);
-      // fill charge array in time-wire domain // slightly larger
-      for (size_t j=0;j!=m_vec_vec_charge.at(i).size();j++){
-      	data_t_w(std::get<0>(m_vec_vec_charge.at(i).at(j))+npad_wire-start_ch,std::get<1>(m_vec_vec_charge.at(i).at(j))-m_start_tick) +=  std::get<2>(m_vec_vec_charge.at(i).at(j));
-      	// std::cout << std::get<1>(m_vec_vec_charge.at(i).at(j)) << std::endl;
-      }
-      //      std::cout << i << " " << m_vec_vec_charge.at(i).size() << std::endl;
-      m_vec_vec_charge.at(i).clear();
-      m_vec_vec_charge.at(i).shrink_to_fit();
-      // for (int k=0; k<m_vec_spmatrix.at(i)->outerSize(); ++k)
-      // 	for (Eigen::SparseMatrix<float>::InnerIterator it(*m_vec_spmatrix.at(i),k); it; ++it){
-      // 	  data_t_w(it.col()+npad_wire-start_ch,it.row()-m_start_tick) = it.value();
-      // 	}
-      // delete m_vec_spmatrix.at(i);
-      // //      m_vec_spmatrix.at(i).setZero();
-      // // m_vec_spmatrix.at(i).resize(0,0);
-      
-      
-      
       // Do FFT on time
-      data_f_w = Array::dft_rc(data_t_w,0);
+      mem_add(abytes);
+      c_data = Array::dft_cc(c_data,0);
       // Do FFT on wire
-      data_f_w = Array::dft_cc(data_f_w,1);
-    }
+      c_data = Array::dft_cc(c_data,1);
     
-    {
-      Array::array_xxc resp_f_w = Array::array_xxc::Zero(end_ch-start_ch+2*npad_wire,m_end_tick-m_start_tick);
-      
-      {
-	Waveform::compseq_t rs1 = m_vec_map_resp.at(i)[0]->spectrum();
-	// Array::array_xxc temp_resp_f_w = Array::array_xxc::Zero(2*m_num_pad_wire+1,nsamples);
-	// for (int icol = 0; icol != nsamples; icol++){
-	//   temp_resp_f_w(0,icol) = rs1[icol];
-	// }
-	// Array::array_xxf temp_resp_t_w = Array::idft_cr(temp_resp_f_w,0).block(0,0,2*m_num_pad_wire+1,m_end_tick-m_start_tick);
-	// temp_resp_f_w = Array::dft_rc(temp_resp_t_w,0);
-	
-	// do a inverse FFT
-	Waveform::realseq_t rs1_t = Waveform::idft(rs1);
-	// pick the first xxx ticks
-	Waveform::realseq_t rs1_reduced(m_end_tick-m_start_tick,0);
-	// std::cout << rs1.size() << " " << nsamples << " " << m_end_tick << " " <<  m_start_tick << std::endl;
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  if (icol >= int(rs1_t.size())) break;
-	  rs1_reduced.at(icol) = rs1_t[icol];
-	  //  std::cout << icol << " " << rs1_t[icol] << std::endl;
-	}
-	// do a FFT
-	rs1 = Waveform::dft(rs1_reduced);
-	
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  //   std::cout << icol << " " << rs1[icol] << " " << temp_resp_f_w(0,icol) << std::endl;
-	  resp_f_w(0,icol) = rs1[icol];
-	}
+      // multiply them together
+      if (resp_spectra) {
+        c_data *= resp_spectra->at(i);
       }
-      for (int irow = 0; irow!=m_num_pad_wire;irow++){
-	Waveform::compseq_t rs1 = m_vec_map_resp.at(i)[irow+1]->spectrum();
-	Waveform::realseq_t rs1_t = Waveform::idft(rs1);
-	Waveform::realseq_t rs1_reduced(m_end_tick-m_start_tick,0);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  if (icol >= int(rs1_t.size())) break;
-	  rs1_reduced.at(icol) = rs1_t[icol];
-	}
-	rs1 = Waveform::dft(rs1_reduced);
-	Waveform::compseq_t rs2 = m_vec_map_resp.at(i)[-irow-1]->spectrum();
-	Waveform::realseq_t rs2_t = Waveform::idft(rs2);
-	Waveform::realseq_t rs2_reduced(m_end_tick-m_start_tick,0);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  if (icol >= int(rs2_t.size())) break;
-	  rs2_reduced.at(icol) = rs2_t[icol];
-	}
-	rs2 = Waveform::dft(rs2_reduced);
-	for (int icol = 0; icol != m_end_tick-m_start_tick; icol++){
-	  resp_f_w(irow+1,icol) = rs1[icol];
-	  resp_f_w(end_ch-start_ch-1-irow+2*npad_wire,icol) = rs2[icol];
-	}
-	// for (int icol = 0; icol != nsamples; icol++){
-	//   resp_f_w(irow+1,icol) = rs1[icol];
-	//   resp_f_w(end_ch-start_ch-1-irow+2*npad_wire,icol) = rs2[icol];
-	// }
+      else {
+        if (!resp_f_w.size()) {
+          mem_add(abytes);
+        }
+        response_spectrum(resp_f_w, i, nrows, ncols);
+        c_data *= resp_f_w;
       }
-      // Do FFT on wire for response // slight larger
-      resp_f_w = Array::dft_cc(resp_f_w,1); // Now becomes the f and f in both time and wire domain ...
-      // multiply them together
-      data_f_w = data_f_w * resp_f_w;
-    }
     
-    // Do inverse FFT on wire
-    data_f_w = Array::idft_cc(data_f_w,1);
+      // Do inverse FFT on wire
+      c_data = Array::idft_cc(c_data,1);
+      mem_add(-abytes);
     
-    // Add to wire result in frequency
-    acc_data_f_w += data_f_w;
+      // Add to wire result in frequency
+      acc += c_data;
+    }
+    if (resp_f_w.size()) {
+      mem_add(-abytes);
+    }
+    mem_add(-abytes);         // c_data
+  });
+  for (int ichunk=0; ichunk<nchunks; ++ichunk) {
+    acc_data_f_w += acc_chunks[ichunk];
+    acc_chunks[ichunk].resize(0,0);
+    mem_add(-abytes);
   }
-  
+  return acc_data_f_w;
+}
+
+
+Array::array_xxf Gen::ImpactTransform::central_charge(Tile& tile)
+{
+  const int i = (m_num_group-1)/2;
+  Array::array_xxf data_t_w = Array::array_xxf::Zero(tile.end_ch-tile.start_ch,tile.fft_ticks);
+  // fill charge array in time-wire domain // slightly larger
+  auto& charge = tile.charge.at(i);
+  data_t_w.block(tile.charge_ch - tile.start_ch, tile.charge_tick - tile.start_tick, charge.rows(), charge.cols()) = charge;
+  mem_add(-long(charge.size()*sizeof(float)));
+  charge.resize(0,0);
+  return data_t_w;
+}
+
+
+void Gen::ImpactTransform::finish(Tile& tile, Array::array_xxc& acc_data_f_w)
+{
+  // Do inverse FFT on time.  The normal order groups are in the
+  // real part and the reverse order groups in the imaginary part.
   //m_decon_data = Array::array_xxc::Zero(nwires,nsamples);
   //    if (npad_wire!=0){
   acc_data_f_w = Array::idft_cc(acc_data_f_w,0);//.block(npad_wire,0,nwires,nsamples);
   Array::array_xxf real_m_decon_data = acc_data_f_w.real();
   Array::array_xxf img_m_decon_data = acc_data_f_w.imag().colwise().reverse();
-  m_decon_data = real_m_decon_data + img_m_decon_data;
-  
+  tile.data = real_m_decon_data + img_m_decon_data;
+
   // std::cout << real_m_decon_data(40,5182) << " " << img_m_decon_data(40,5182) << std::endl;
   //    std::cout << real_m_decon_data(40,5182-m_start_tick) << " " << img_m_decon_data(40,5182-m_start_tick) << std::endl;
-  
+
   //}else{
   // Array::array_xxc temp_m_decon_data = Array::idft_cc(acc_data_f_w,0);
   //   Array::array_xxf real_m_decon_data = temp_m_decon_data.real();
   //   Array::array_xxf img_m_decon_data = temp_m_decon_data.imag().rowwise().reverse();
   //   m_decon_data = real_m_decon_data + img_m_decon_data;
   // }
-  
-  // // prepare FFT, loop 11 of them ... (older version)
-  // for (size_t i=0;i!=m_vec_vec_charge.size();i++){
-  //   // fill response array in frequency domain
-  //   if (i!=10) continue;
-  
-  //   Array::array_xxc data_f_w;
-  //   {
-  // 	Array::array_xxf data_t_w = Array::array_xxf::Zero(nwires+2*npad_wire,nsamples);
-    // 	// fill charge array in time-wire domain // slightly larger
-    // 	for (size_t j=0;j!=m_vec_vec_charge.at(i).size();j++){
-    // 	  data_t_w(std::get<0>(m_vec_vec_charge.at(i).at(j))+npad_wire,std::get<1>(m_vec_vec_charge.at(i).at(j))) +=  std::get<2>(m_vec_vec_charge.at(i).at(j));
-    // 	}
-    // 	m_vec_vec_charge.at(i).clear();
-	
-    // 	// Do FFT on time
-    // 	data_f_w = Array::dft_rc(data_t_w,0);
-    // 	// Do FFT on wire
-    // 	data_f_w = Array::dft_cc(data_f_w,1);
-    //   }
-      
-    //   {
-    // 	Array::array_xxc resp_f_w = Array::array_xxc::Zero(nwires+2*npad_wire,nsamples);
-    // 	{
-    // 	  Waveform::compseq_t rs1 = m_vec_map_resp.at(i)[0]->spectrum();
-    // 	  for (int icol = 0; icol != nsamples; icol++){
-    // 	    resp_f_w(0,icol) = rs1[icol];
-    // 	  }
-    // 	}
-    // 	for (int irow = 0; irow!=m_num_pad_wire;irow++){
-    // 	  Waveform::compseq_t rs1 = m_vec_map_resp.at(i)[irow+1]->spectrum();
-    // 	  Waveform::compseq_t rs2 = m_vec_map_resp.at(i)[-irow-1]->spectrum();
-    // 	  for (int icol = 0; icol != nsamples; icol++){
-    // 	    resp_f_w(irow+1,icol) = rs1[icol];
-    // 	    resp_f_w(nwires-1-irow+2*npad_wire,icol) = rs2[icol];
-    // 	  }
-    // 	}
-    // 	// Do FFT on wire for response // slight larger
-    // 	resp_f_w = Array::dft_cc(resp_f_w,1); // Now becomes the f and f in both time and wire domain ...
-    // 	// multiply them together
-    // 	data_f_w = data_f_w * resp_f_w;
-    //   }
-      
-    //   // Do inverse FFT on wire
-    //   data_f_w = Array::idft_cc(data_f_w,1);
-      
-    //   // Add to wire result in frequency
-    //   acc_data_f_w += data_f_w;
-    // }
-    // m_vec_vec_charge.clear();
-    
-    // // do inverse FFT on time for the final results ... 
-    
-    // if (npad_wire!=0){
-    //   Array::array_xxf temp_m_decon_data = Array::idft_cr(acc_data_f_w,0);
-    //   m_decon_data = temp_m_decon_data.block(npad_wire,0,nwires,nsamples);
-    // }else{
-    //   m_decon_data = Array::idft_cr(acc_data_f_w,0);
-    // }
-    
-    
-    //    std::cout << m_decon_data(40,5195-m_start_tick)/units::mV << " " << m_decon_data(40,5195-m_start_tick)/units::mV << std::endl;
-    
-  //  m_vec_spmatrix.clear();
-  //m_vec_spmatrix.shrink_to_fit();
-    
-  // int nrows = resp_f_w.rows();
-  // int ncols = resp_f_w.cols();
-  std::cout << "Gen::ImpactTransform: # of channels: " << m_decon_data.rows() << " # of ticks: " << m_decon_data.cols() << std::endl;
-  
+
+  // Second stage: the short responses are the same for every wire
+  // so they are applied once per wire over a longer time span.
+  // This linear convolution with the trimmed short responses only
+  // approximates the combined response, which wraps circularly
+  // within the overall short padding.
+  if (m_split_pir && m_split_pir->short_waveform().size()) {
+    const auto& short_wf = m_split_pir->short_waveform();
+    const int nticks = fft_best_length(tile.fft_ticks + m_split_pir->short_pad());
+    Waveform::realseq_t short_t(short_wf.begin(), short_wf.end());
+    short_t.resize(nticks, 0);
+    const Waveform::compseq_t short_f = Waveform::dft(short_t);
+
+    const long sbytes = long(tile.data.rows()) * nticks * sizeof(std::complex<float>);
+    Array::array_xxf data_t_w = Array::array_xxf::Zero(tile.data.rows(), nticks);
+    data_t_w.leftCols(tile.fft_ticks) = tile.data;
+    Array::array_xxc data_f_w = Array::dft_rc(data_t_w,0);
+    mem_add(sbytes + sbytes/2);
+    data_t_w.resize(0,0);
+    for (int icol=0; icol<nticks; ++icol) {
+      data_f_w.col(icol) *= short_f[icol];
+    }
+    tile.data = Array::idft_cr(data_f_w,0);
+    tile.end_tick = tile.start_tick + nticks;
+    mem_add(-(sbytes + sbytes/2));
+  }
 }
 
 
@@ -445,44 +627,292 @@ Gen::ImpactTransform::~ImpactTransform()
 }
 
 
+Gen::ImpactTransform::response_spectra_t
+Gen::ImpactTransform::response_spectra(int nwires, int nticks) const
+{
+  const int num_double = (m_num_group-1)/2;
+  auto build = [&]() {
+    auto spectra = std::make_shared<std::vector<Array::array_xxc> >(num_double+1);
+    for (int i=0; i<=num_double; i++){
+      response_spectrum(spectra->at(i), i, nwires, nticks);
+    }
+    return response_spectra_t(spectra);
+  };
+  if (!m_cache) {
+    return build();
+  }
+  return m_cache->spectra(m_pir.get(), num_double+1, nwires, nticks, build);
+}
+
+
+Gen::ImpactTransform::long_spectrum_t
+Gen::ImpactTransform::long_spectrum(int nlength) const
+{
+  std::call_once(m_long_once, [&]() {
+    auto build = [&]() {
+      Waveform::realseq_t long_resp = m_pir->closest(0)->long_aux_waveform();
+      long_resp.resize(nlength,0);
+      return long_spectrum_t(std::make_shared<const Waveform::compseq_t>(Waveform::dft(long_resp)));
+    };
+    m_long_spec = m_cache ? m_cache->long_spectrum(m_pir.get(), nlength, build) : build();
+  });
+  return m_long_spec;
+}
+
+
+void Gen::ImpactTransform::response_spectrum(Array::array_xxc& resp_f_w, int igroup, int nwires, int nticks) const
+{
+  resp_f_w.setZero(nwires, nticks);
+  for (int irow = -m_num_pad_wire; irow <= m_num_pad_wire; irow++){
+    // Keep what of the padded response fits in this shape.  A split
+    // field response is shorter yet.
+    auto ir = m_vec_map_resp.at(igroup).at(irow);
+    Waveform::realseq_t rs_t = m_split_pir ? m_split_pir->field_waveform(ir->impact())
+      : ir->waveform();
+    rs_t.resize(nticks, 0);
+    Waveform::compseq_t rs = Waveform::dft(rs_t);
+
+    // negative wires wrap around to the end of the wire dimension
+    const int row = irow >= 0 ? irow : nwires + irow;
+    for (int icol = 0; icol != nticks; icol++){
+      resp_f_w(row,icol) = rs[icol];
+    }
+  }
+  // Do FFT on wire for response // slight larger
+  resp_f_w = Array::dft_cc(resp_f_w,1); // Now becomes the f and f in both time and wire domain ...
+}
+
+
+void Gen::ImpactTransform::mem_add(long nbytes) const
+{
+  const long now = (m_mem_now += nbytes);
+  long peak = m_mem_peak.load();
+  while (now > peak && !m_mem_peak.compare_exchange_weak(peak, now)) {
+  }
+}
+
+
+int Gen::ImpactTransform::lean_chunks(const Tile& tile) const
+{
+  if (!m_memory_budget) {
+    return 0;
+  }
+  const long abytes = long(tile.end_ch-tile.start_ch) * tile.fft_ticks * sizeof(std::complex<float>);
+  const int num_double = (m_num_group-1)/2;
+  const int nthreads = std::min(Gen::resolve_nthreads(m_nthreads), std::max(num_double,1));
+
+  // Charge arrays, result, and per thread an accumulator, a work
+  // array and the temporary returned by each FFT, plus the cached
+  // response spectra.
+  long charge = 0;
+  for (const auto& q : tile.charge) {
+    charge += q.size() * sizeof(float);
+  }
+  const long normal = charge + abytes*(num_double + 2 + 3*nthreads);
+  if (normal <= (long)m_memory_budget) {
+    return 0;
+  }
+
+  // Lean: no cached spectra, each thread also builds its own.
+  const long avail = (long)m_memory_budget - charge - 2*abytes;
+  return std::max(1, std::min(nthreads, int(avail / (4*abytes))));
+}
+
+
+bool Gen::ImpactTransform::pair_fits(const ImpactTransform& one, const ImpactTransform& two)
+{
+  if (!one.m_memory_budget || !two.m_memory_budget) {
+    return true;
+  }
+  const Tile& tile = one.m_tiles.front();
+  const long abytes = long(tile.end_ch-tile.start_ch) * tile.fft_ticks * sizeof(std::complex<float>);
+
+  // Both charges and response spectra are held throughout and both
+  // results once convolved.  The threads of each convolve_pairs()
+  // need three arrays each, the packed central groups and their
+  // separated spectra need four.
+  long charge = 0, nspectra = 0;
+  int nthreads = 1;
+  for (const ImpactTransform* it : {&one, &two}) {
+    for (const auto& q : it->m_tiles.front().charge) {
+      charge += q.size() * sizeof(float);
+    }
+    const int num_double = (it->m_num_group-1)/2;
+    nspectra += num_double + 1;
+    nthreads = std::max(nthreads, std::min(Gen::resolve_nthreads(it->m_nthreads), std::max(num_double,1)));
+  }
+  const long need = charge + abytes*(nspectra + 2 + std::max(3*nthreads, 4));
+  return need <= long(one.m_memory_budget + two.m_memory_budget);
+}
+
+
+void Gen::ImpactTransform::add_tiles(Array::array_xxf& data, int wbeg, int nsamples) const
+{
+  const int wend = wbeg + data.rows();
+  for (const auto& tile : m_tiles) {
+    const int w0 = std::max(tile.start_ch, wbeg);
+    const int w1 = std::min(tile.end_ch, wend);
+    const int tbeg = std::max(tile.start_tick, 0);
+    const int tend = std::min(tile.end_tick, nsamples);
+    if (w1 <= w0 || tend <= tbeg) {
+      continue;
+    }
+    data.block(w0-wbeg, tbeg, w1-w0, tend-tbeg) +=
+      tile.data.block(w0-tile.start_ch, tbeg-tile.start_tick, w1-w0, tend-tbeg);
+  }
+}
+
+
+std::pair<int,int> Gen::ImpactTransform::wire_range() const
+{
+  const int nwires = m_bd.pimpos().region_binning().nbins();
+  int wbeg = nwires, wend = 0;
+  for (const auto& tile : m_tiles) {
+    wbeg = std::min(wbeg, std::max(tile.start_ch, 0));
+    wend = std::max(wend, std::min(tile.end_ch, nwires));
+  }
+  return std::make_pair(wbeg, std::max(wbeg, wend));
+}
+
+
+void Gen::ImpactTransform::long_batches(int wbeg, int wend,
+                                        std::function<void(int w0, const Array::array_xxf& data)> func) const
+{
+  // The long-range response spreads over the whole readout.  It is
+  // applied to batches of wires at once with its spectrum shared by
+  // all of them.
+  const int nsamples = m_bd.tbins().nbins();
+  const int nlength = fft_best_length(nsamples + m_pir->closest(0)->long_aux_waveform_pad());
+  auto long_spec = long_spectrum(nlength);
+  const int nbatch = 128;     // wires
+  for (int w0 = wbeg; w0 < wend; w0 += nbatch) {
+    const int w1 = std::min(w0 + nbatch, wend);
+    const long bbytes = long(w1-w0) * nlength * (sizeof(float) + sizeof(std::complex<float>));
+    Array::array_xxf data = Array::array_xxf::Zero(w1-w0, nlength);
+    add_tiles(data, w0, nsamples);
+    Array::array_xxc spec = Array::dft_rc(data, 0);
+    mem_add(bbytes);
+    for (int icol=0; icol<nlength; ++icol) {
+      spec.col(icol) *= (*long_spec)[icol];
+    }
+    data = Array::idft_cr(spec, 0);
+    func(w0, data);
+    mem_add(-bbytes);
+  }
+}
+
+
+void Gen::ImpactTransform::apply_long()
+{
+  if (m_long_done || m_pir->closest(0)->long_aux_waveform().empty()) {
+    return;
+  }
+  const int nsamples = m_bd.tbins().nbins();
+  const auto wr = wire_range();
+  m_long_wbeg = wr.first;
+  m_long_data = Array::array_xxf::Zero(wr.second-wr.first, nsamples);
+  long_batches(wr.first, wr.second, [&](int w0, const Array::array_xxf& data) {
+    m_long_data.middleRows(w0-wr.first, data.rows()) = data.leftCols(nsamples);
+  });
+  m_tiles.clear();
+  m_long_done = true;
+}
+
+
+void Gen::ImpactTransform::add_to(Array::array_xxf& block, const std::vector<int>& wire_rows) const
+{
+  const int nsamples = m_bd.tbins().nbins();
+  const int nwires = wire_rows.size();
+
+  if (m_long_done) {
+    for (int irow = 0; irow < m_long_data.rows(); ++irow) {
+      const int iwire = m_long_wbeg + irow;
+      if (iwire >= nwires || wire_rows[iwire] < 0) {
+        continue;
+      }
+      block.row(wire_rows[iwire]).head(nsamples) += m_long_data.row(irow);
+    }
+    return;
+  }
+
+  if (m_pir->closest(0)->long_aux_waveform().size()>0) {
+    const auto wr = wire_range();
+    long_batches(wr.first, std::min(wr.second, nwires), [&](int w0, const Array::array_xxf& data) {
+      for (int iwire = w0; iwire < w0 + data.rows(); ++iwire) {
+        const int row = wire_rows[iwire];
+        if (row < 0) {
+          continue;
+        }
+        block.row(row).head(nsamples) += data.row(iwire-w0).head(nsamples);
+      }
+    });
+    return;
+  }
+
+  for (const auto& tile : m_tiles) {
+    const int wbeg = std::max(tile.start_ch, 0);
+    const int wend = std::min(tile.end_ch, nwires);
+    const int tbeg = std::max(tile.start_tick, 0);
+    const int tend = std::min(tile.end_tick, nsamples);
+    if (wend <= wbeg || tend <= tbeg) {
+      continue;
+    }
+    for (int iwire = wbeg; iwire < wend; ++iwire) {
+      const int row = wire_rows[iwire];
+      if (row < 0) {
+        continue;
+      }
+      block.row(row).segment(tbeg, tend-tbeg) +=
+        tile.data.row(iwire-tile.start_ch).segment(tbeg-tile.start_tick, tend-tbeg);
+    }
+  }
+}
+
+
 Waveform::realseq_t Gen::ImpactTransform::waveform(int iwire) const
 {
   const int nsamples = m_bd.tbins().nbins();
-  if (iwire < m_start_ch || iwire >= m_end_ch){
-    return Waveform::realseq_t(nsamples, 0.0);
-  }else{
-    Waveform::realseq_t wf(nsamples, 0.0);
-    for (int i=0;i!=nsamples;i++){
-      if (i>=m_start_tick && i < m_end_tick){
-	wf.at(i) = m_decon_data(iwire-m_start_ch,i-m_start_tick);
-      }else{
-	//wf.at(i) = 1e-25;
+  Waveform::realseq_t wf(nsamples, 0.0);
+  if (m_long_done) {
+    const int irow = iwire - m_long_wbeg;
+    if (irow >= 0 && irow < m_long_data.rows()) {
+      for (int i=0; i<nsamples; i++){
+        wf[i] = m_long_data(irow, i);
       }
-      //std::cout << m_decon_data(iwire-m_start_ch,i-m_start_tick) << std::endl;
     }
+    return wf;
+  }
+  bool any = false;
+  for (const auto& tile : m_tiles) {
+    if (iwire < tile.start_ch || iwire >= tile.end_ch){
+      continue;
+    }
+    any = true;
+    for (int i=std::max(tile.start_tick,0); i < std::min(tile.end_tick,nsamples); i++){
+      wf.at(i) += tile.data(iwire-tile.start_ch,i-tile.start_tick);
+    }
+  }
+  if (!any) {
+    return wf;
+  }
     
-    if (m_pir->closest(0)->long_aux_waveform().size()>0){
-      // now convolute with the long-range response ...
-      const size_t nlength = fft_best_length(nsamples + m_pir->closest(0)->long_aux_waveform_pad());
+  if (m_pir->closest(0)->long_aux_waveform().size()>0){
+    // now convolute with the long-range response ...
+    const size_t nlength = fft_best_length(nsamples + m_pir->closest(0)->long_aux_waveform_pad());
       
-      //nlength = nsamples;
+    //nlength = nsamples;
       
-      //   std::cout << nlength << " " << nsamples + m_pir->closest(0)->long_aux_waveform_pad() << std::endl;
+    //   std::cout << nlength << " " << nsamples + m_pir->closest(0)->long_aux_waveform_pad() << std::endl;
       
-      wf.resize(nlength,0);
-      Waveform::realseq_t long_resp = m_pir->closest(0)->long_aux_waveform();
-      long_resp.resize(nlength,0);
-      Waveform::compseq_t spec = Waveform::dft(wf);
-      Waveform::compseq_t long_spec = Waveform::dft(long_resp);
-      for (size_t i=0;i!=nlength;i++){
-	spec.at(i) *= long_spec.at(i);
-      }
-      wf = Waveform::idft(spec);
-      wf.resize(nsamples,0);
+    wf.resize(nlength,0);
+    auto long_spec = long_spectrum(nlength);
+    Waveform::compseq_t spec = Waveform::dft(wf);
+    for (size_t i=0;i!=nlength;i++){
+      spec.at(i) *= long_spec->at(i);
     }
-    
-    return wf;
+    wf = Waveform::idft(spec);
+    wf.resize(nsamples,0);
   }
-
+    
+  return wf;
 }
-
@@ -1,16 +1,24 @@
 #include "WireCellGen/ImpactZipper.h"
 #include "WireCellUtil/Testing.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>             // debugging.
 using namespace std;
 
 using namespace WireCell;
 Gen::ImpactZipper::ImpactZipper(IPlaneImpactResponse::pointer pir, BinnedDiffusion& bd)
-    :m_pir(pir), m_bd(bd)
+    :m_pir(pir), m_bd(bd), m_precomputed(false)
 {
     
 }
 
+void Gen::ImpactZipper::precompute(int nthreads)
+{
+    m_bd.calculate_all(nthreads);
+    m_precomputed = true;
+}
+
 
 
 Gen::ImpactZipper::~ImpactZipper()
@@ -18,6 +26,53 @@ Gen::ImpactZipper::~ImpactZipper()
 }
 
 
+const Waveform::compseq_t& Gen::ImpactZipper::phases(int nfft) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& ph = m_phases[nfft];
+    if (ph.empty()) {
+        ph.resize(nfft);
+        for (int ind=0; ind<nfft; ++ind) {
+            ph[ind] = std::polar(1.0, -2.0*M_PI*ind/nfft);
+        }
+    }
+    return ph;
+}
+
+int Gen::ImpactZipper::response_support(const IImpactResponse::pointer& ir) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_support.find(ir.get());
+    if (it != m_support.end()) {
+        return it->second;
+    }
+    const auto& wave = ir->waveform();
+    int n = wave.size();
+    while (n > 0 && wave[n-1] == 0) {
+        --n;
+    }
+    m_support[ir.get()] = n;
+    return n;
+}
+
+const Waveform::compseq_t& Gen::ImpactZipper::response_spectrum(const IImpactResponse::pointer& ir, int nfft) const
+{
+    if (nfft == m_bd.tbins().nbins()) {
+        return ir->spectrum();
+    }
+    const int support = response_support(ir);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto key = std::make_pair((const IImpactResponse*)ir.get(), nfft);
+    auto it = m_short_spectra.find(key);
+    if (it != m_short_spectra.end()) {
+        return it->second;
+    }
+    const auto& wave = ir->waveform();
+    Waveform::realseq_t shortwave(nfft, 0.0);
+    std::copy(wave.begin(), wave.begin() + std::min(support, nfft), shortwave.begin());
+    return m_short_spectra[key] = Waveform::dft(shortwave);
+}
+
 Waveform::realseq_t Gen::ImpactZipper::waveform(int iwire) const
 {
     const double pitch_range = m_pir->pitch_range();
@@ -30,12 +85,16 @@ Waveform::realseq_t Gen::ImpactZipper::waveform(int iwire) const
     const int min_impact = ib.edge_index(wire_pos - 0.5*pitch_range);
     const int max_impact = ib.edge_index(wire_pos + 0.5*pitch_range);
     const int nsamples = m_bd.tbins().nbins();
-    Waveform::compseq_t total_spectrum(nsamples, Waveform::complex_t(0.0,0.0));
 
-
-    int nfound=0;
     const bool share=true;
-    const Waveform::complex_t complex_one_half(0.5,0.0);
+
+    // The impacts holding charge near the wire and their responses.
+    struct Term {
+        ImpactData::pointer id;
+        IImpactResponse::pointer r1, r2;
+    };
+    std::vector<Term> terms;
+    int tbeg = nsamples, tend = 0, support = 0;
 
     // The BinnedDiffusion is indexed by absolute impact and the
     // PlaneImpactResponse relative impact.
@@ -49,19 +108,8 @@ Waveform::realseq_t Gen::ImpactZipper::waveform(int iwire) const
             //std::cerr << "ImpactZipper: no data for absolute impact number: " << imp << std::endl;
             continue;
         }
-        
-        const Waveform::compseq_t& charge_spectrum = id->spectrum();
-        // for interpolation
-        const Waveform::compseq_t& weightcharge_spectrum = id->weight_spectrum();
-   
-        if (charge_spectrum.empty()) {
-            // should not happen
-            std::cerr << "ImpactZipper: no charge for absolute impact number: " << imp << std::endl;
-            continue;
-        }
-        if (weightcharge_spectrum.empty()) {
-            // weight == 0, should not happen
-            std::cerr << "ImpactZipper: no weight charge for absolute impact number: " << imp << std::endl;
+        if (id->window_waveform().empty()) {
+            // diffusions which only graze this impact
             continue;
         }
 
@@ -69,63 +117,106 @@ Waveform::realseq_t Gen::ImpactZipper::waveform(int iwire) const
         const double rel_imp_pos = imp_pos - wire_pos;
         //std::cerr << "IZ: " << " imp=" << imp << " imp_pos=" << imp_pos << " rel_imp_pos=" << rel_imp_pos << std::endl;
 
-        Waveform::compseq_t conv_spectrum(nsamples, Waveform::complex_t(0.0,0.0));
+        Term term{id, nullptr, nullptr};
         if (share) {            // fixme: make a configurable option
             TwoImpactResponses two_ir = m_pir->bounded(rel_imp_pos);
             if (!two_ir.first || !two_ir.second) {
                 //std::cerr << "ImpactZipper: no impact response for absolute impact number: " << imp << std::endl;
                 continue;
             }
-            // fixme: this is average, not interpolation.
-            Waveform::compseq_t rs1 = two_ir.first->spectrum();            
-            Waveform::compseq_t rs2 = two_ir.second->spectrum();            
-            
-            for (int ind=0; ind < nsamples; ++ind) {
-                //conv_spectrum[ind] = complex_one_half*(rs1[ind]+rs2[ind])*charge_spectrum[ind];
-            
-                // linear interpolation: wQ*rs1 + (Q-wQ)*rs2
-                conv_spectrum[ind] = weightcharge_spectrum[ind]*rs1[ind]+(charge_spectrum[ind]-weightcharge_spectrum[ind])*rs2[ind];
-                /* debugging */
-                /* if(iwire == 1000 && ind>1000 && ind<2000) { */
-                /* std::cerr<<"rs1 spectrum: "<<imp<<"|"<<ind<<": "<<std::abs(rs1[ind])<<std::endl; */
-                /* std::cerr<<"rs2 spectrum: "<<imp<<"|"<<ind<<": "<<std::abs(rs2[ind])<<std::endl; */
-                /* std::cerr<<"rs1 charge spectrum "<<ind<<": "<<weightcharge_spectrum[ind]<<std::endl; */
-                /* std::cerr<<"rs2 charge spectrum "<<ind<<": "<<charge_spectrum[ind]-weightcharge_spectrum[ind]<<std::endl; */
-              /* //std::cerr<<"rs1 charge spectrum "<<ind<<": "<<complex_one_half*charge_spectrum[ind]<<std::endl; */
-              /* //std::cerr<<"rs2 charge spectrum "<<ind<<": "<<complex_one_half*charge_spectrum[ind]<<std::endl; */
-                /* } */
-            }
+            // linear interpolation: wQ*rs1 + (Q-wQ)*rs2
+            term.r1 = two_ir.first;
+            term.r2 = two_ir.second;
+            support = std::max(support, response_support(term.r2));
         }
         else {
-            auto ir = m_pir->closest(rel_imp_pos);
-            if (! ir) {
+            term.r1 = m_pir->closest(rel_imp_pos);
+            if (! term.r1) {
                 // std::cerr << "ImpactZipper: no impact response for absolute impact number: " << imp << std::endl;
                 continue;
             }
-            Waveform::compseq_t response_spectrum = ir->spectrum();
-            for (int ind=0; ind < nsamples; ++ind) {
-                conv_spectrum[ind] = response_spectrum[ind]*charge_spectrum[ind];
-            }
         }
+        support = std::max(support, response_support(term.r1));
+        tbeg = std::min(tbeg, id->window_begin());
+        tend = std::max(tend, id->window_begin() + (int)id->window_waveform().size());
+        terms.push_back(term);
+    }
+    //std::cerr << "ImpactZipper: found " << terms.size() << " in abs impact: ["  << min_impact << ","<< max_impact << "]\n";
 
-        ++nfound;
-        // std::cerr << "ImpactZipper: found:"<<nfound<<" for absolute impact number " << imp
-        //           << " csize=" << csize << " rsize=" << rsize << " rebin=" << rebinfactor
-        //           << std::endl;
+    if (terms.empty()) {
+        // Clear memory assuming next call is iwire+1.
+        if (!m_precomputed) {
+            m_bd.erase(0, min_impact); 
+        }
+        return Waveform::realseq_t(nsamples, 0.0);
+    }
 
-        Waveform::increase(total_spectrum, conv_spectrum);
+    // The linear convolution of the charge window with the responses
+    // fits in nfft ticks from tbeg.  Powers of two keep the number of
+    // different lengths, and so of cached spectra, small.  If that
+    // is no shorter than the readout, convolve circularly over the
+    // readout from tick 0 as the full response spectra do.
+    const int needed = tend - tbeg + support - 1;
+    int nfft = 64;
+    while (nfft < needed) {
+        nfft *= 2;
+    }
+    if (nfft >= nsamples) {
+        nfft = nsamples;
+        tbeg = 0;
+    }
+
+    const auto& phase = phases(nfft);
+    Waveform::compseq_t total_spectrum(nfft, Waveform::complex_t(0.0,0.0));
+    for (const auto& term : terms) {
+        const auto& spectra = term.id->window_spectra(nfft);
+        const Waveform::compseq_t& charge_spectrum = spectra.first;
+        // for interpolation
+        const Waveform::compseq_t& weightcharge_spectrum = spectra.second;
+
+        // Element k of a window moved by shift ticks gains phase[k*shift mod nfft].
+        const int shift = term.id->window_begin() - tbeg;
+        const Waveform::compseq_t& rs1 = response_spectrum(term.r1, nfft);
+        if (term.r2) {
+            const Waveform::compseq_t& rs2 = response_spectrum(term.r2, nfft);
+            int iphase = 0;
+            for (int ind=0; ind < nfft; ++ind) {
+                total_spectrum[ind] += phase[iphase]*(weightcharge_spectrum[ind]*rs1[ind]
+                                                      + (charge_spectrum[ind]-weightcharge_spectrum[ind])*rs2[ind]);
+                iphase += shift;
+                if (iphase >= nfft) {
+                    iphase -= nfft;
+                }
+            }
+        }
+        else {
+            int iphase = 0;
+            for (int ind=0; ind < nfft; ++ind) {
+                total_spectrum[ind] += phase[iphase]*rs1[ind]*charge_spectrum[ind];
+                iphase += shift;
+                if (iphase >= nfft) {
+                    iphase -= nfft;
+                }
+            }
+        }
     }
-    //std::cerr << "ImpactZipper: found " << nfound << " in abs impact: ["  << min_impact << ","<< max_impact << "]\n";
 
     // Clear memory assuming next call is iwire+1.
     // fixme: this is a dumb way to go. Better to make an iterator.
-    m_bd.erase(0, min_impact); 
-
-    if (!nfound) {
-        return Waveform::realseq_t(nsamples, 0.0);
+    if (!m_precomputed) {
+        m_bd.erase(0, min_impact); 
     }
-    
+
     auto waveform = Waveform::idft(total_spectrum);
+    if (nfft == nsamples) {
+        return waveform;
+    }
 
-    return waveform;
+    // Place the short waveform, wrapping past the end of the readout
+    // as the circular convolution over the readout would.
+    Waveform::realseq_t full(nsamples, 0.0);
+    for (int ind=0; ind < nfft; ++ind) {
+        full[(tbeg + ind) % nsamples] += waveform[ind];
+    }
+    return full;
 }
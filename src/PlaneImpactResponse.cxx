@@ -5,7 +5,11 @@
 #include "WireCellUtil/NamedFactory.h"
 #include "WireCellUtil/FFTBestLength.h"
 
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>             // debugging
+#include <random>
 
 WIRECELL_FACTORY(PlaneImpactResponse, WireCell::Gen::PlaneImpactResponse,
                  WireCell::IPlaneImpactResponse, WireCell::IConfigurable)
@@ -14,30 +18,97 @@ WIRECELL_FACTORY(PlaneImpactResponse, WireCell::Gen::PlaneImpactResponse,
 using namespace std;
 using namespace WireCell;
 
+namespace {
+    // Bump when the layout of the response cache files changes.
+    const uint64_t cache_version = 2;
+
+    // FNV-1a, stable across platforms and runs unlike std::hash.
+    struct CacheHash {
+        uint64_t h = 1469598103934665603ULL;
+        void bytes(const void* data, size_t n) {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            for (size_t i=0; i<n; ++i) {
+                h = (h ^ p[i]) * 1099511628211ULL;
+            }
+        }
+        template<typename T>
+        void pod(const T& val) { bytes(&val, sizeof(T)); }
+        template<typename T>
+        void vec(const std::vector<T>& v) { pod(v.size()); bytes(v.data(), v.size()*sizeof(T)); }
+        void str(const std::string& s) { pod(s.size()); bytes(s.data(), s.size()); }
+    };
+
+    template<typename T>
+    void write_pod(std::ostream& os, const T& val) {
+        os.write(reinterpret_cast<const char*>(&val), sizeof(T));
+    }
+    template<typename T>
+    void write_vec(std::ostream& os, const std::vector<T>& v) {
+        write_pod(os, (uint64_t)v.size());
+        os.write(reinterpret_cast<const char*>(v.data()), v.size()*sizeof(T));
+    }
+    template<typename T>
+    bool read_pod(std::istream& is, T& val) {
+        return (bool)is.read(reinterpret_cast<char*>(&val), sizeof(T));
+    }
+    template<typename T>
+    bool read_vec(std::istream& is, std::vector<T>& v, uint64_t maxsize) {
+        uint64_t n = 0;
+        if (!read_pod(is, n) || n > maxsize) {
+            return false;
+        }
+        v.resize(n);
+        return (bool)is.read(reinterpret_cast<char*>(v.data()), n*sizeof(T));
+    }
+}
+
+
+std::shared_ptr<Gen::LongResponse> Gen::LongResponse::shared(const Waveform::realseq_t& wf, int pad)
+{
+    static std::mutex mutex;
+    static std::vector< std::weak_ptr<LongResponse> > known;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = known.begin(); it != known.end();) {
+        auto lr = it->lock();
+        if (!lr) {
+            it = known.erase(it);
+            continue;
+        }
+        if (lr->pad == pad && lr->waveform == wf) {
+            return lr;
+        }
+        ++it;
+    }
+    auto lr = std::make_shared<LongResponse>(wf, pad);
+    known.push_back(lr);
+    return lr;
+}
 
 const Waveform::compseq_t& Gen::ImpactResponse::spectrum(){
-  if (m_spectrum.size()!=0){
-    return m_spectrum;
-  }else{
-    m_spectrum = Waveform::dft(m_waveform);
-    return m_spectrum;
-  }
+  std::call_once(m_spectrum_once, [this]() {
+      Waveform::realseq_t wf(m_waveform);
+      wf.resize(m_nbins, 0);
+      m_spectrum = Waveform::dft(wf);
+    });
+  return m_spectrum;
 }
 
 const Waveform::compseq_t& Gen::ImpactResponse::long_aux_spectrum(){
-  if (m_long_spectrum.size()!=0){
-    return m_long_spectrum;
-  }else{
-    m_long_spectrum = Waveform::dft(m_long_waveform);
-    return m_long_spectrum;
-  }
+  std::call_once(m_long->spectrum_once, [this]() {
+      m_long->spectrum = Waveform::dft(m_long->waveform);
+    });
+  return m_long->spectrum;
 }
 
 Gen::PlaneImpactResponse::PlaneImpactResponse(int plane_ident, size_t nbins, double tick)
     : m_frname("FieldResponse")
+    , m_split_short(false)
     , m_plane_ident(plane_ident)
     , m_nbins(nbins)
     , m_tick(tick)
+    , m_field_pad(0)
+    , m_short_pad(0)
 {
 }
 
@@ -55,10 +126,19 @@ WireCell::Configuration Gen::PlaneImpactResponse::default_configuration() const
     cfg["overall_short_padding"] = 100*units::us;
     cfg["long_responses"] = Json::arrayValue;
     cfg["long_padding"] = 1.5*units::ms;
+    // also keep the field response and the short responses apart
+    // so a transform may convolve them in two stages.  This is
+    // close to but not the same as the combined response, see
+    // split_short().
+    cfg["split_short_responses"] = false;
     // number of bins in impact response spectra
     cfg["nticks"] = 10000;
     // sample period of response waveforms
     cfg["tick"] = 0.5*units::us; 
+    // If not empty, a directory in which built responses are saved
+    // and from which later jobs with the same field response data
+    // and configuration load them instead of building.
+    cfg["cache_dir"] = "";
     return cfg;
 }
 
@@ -87,9 +167,11 @@ void Gen::PlaneImpactResponse::configure(const WireCell::Configuration& cfg)
 
     m_overall_short_padding = get(cfg, "overall_short_padding", m_overall_short_padding);
     m_long_padding = get(cfg, "long_padding", m_long_padding);
+    m_split_short = get(cfg, "split_short_responses", m_split_short);
 
     m_nbins = (size_t) get(cfg, "nticks", (int)m_nbins);
     m_tick = get(cfg, "tick", m_tick);
+    m_cache_dir = get(cfg, "cache_dir", m_cache_dir);
 
     // std::cout << m_long.size() << " " << m_long_padding << " " << m_overall_short_padding << std::endl;
     
@@ -100,6 +182,18 @@ void Gen::PlaneImpactResponse::configure(const WireCell::Configuration& cfg)
 void Gen::PlaneImpactResponse::build_responses()
 {
     auto ifr = Factory::find_tn<IFieldResponse>(m_frname);
+    m_ir.clear();
+    m_bywire.clear();
+
+    std::string cache_path;
+    if (!m_cache_dir.empty()) {
+        cache_path = m_cache_dir + "/pir-" + cache_key(ifr->field_response()) + ".bin";
+        if (load_cache(cache_path)) {
+            cerr << "Gen::PlaneImpactResponse: plane " << m_plane_ident
+                 << ": loaded responses from " << cache_path << "\n";
+            return;
+        }
+    }
 
     const size_t n_short_length = fft_best_length(m_overall_short_padding/m_tick);
     //    std::cout << n_short_length << std::endl;
@@ -163,9 +257,29 @@ void Gen::PlaneImpactResponse::build_responses()
         }
 	//std::cout << ind << std::endl;
     }
+    m_short_wf.clear();
+    m_short_pad = 0;
+    if (m_split_short && nshort) {
+        // The short responses end well before the padding so their
+        // extent is trimmed to where they become negligible.
+        m_short_wf = Waveform::idft(short_spec);
+        float peak = 0;
+        for (auto val : m_short_wf) {
+            peak = std::max(peak, std::abs(val));
+        }
+        m_short_pad = m_short_wf.size();
+        while (m_short_pad > 1 && std::abs(m_short_wf[m_short_pad-1]) <= 1e-6*peak) {
+            --m_short_pad;
+        }
+        m_short_wf.resize(m_short_pad);
+    }
+
     WireCell::Waveform::realseq_t long_wf;
     if (nlong >0)
       long_wf = Waveform::idft(long_spec);
+    auto long_resp = Gen::LongResponse::shared(long_wf, m_long_padding/m_tick);
+    // only the padded short response is kept
+    const size_t nshort_keep = std::min(n_short_length, m_nbins);
    
 
     const auto& fr = ifr->field_response();
@@ -201,6 +315,12 @@ void Gen::PlaneImpactResponse::build_responses()
     const double rawresp_tick = fr.period;
     const double rawresp_max = rawresp_min + rawresp_size*rawresp_tick;
     Binning rawresp_bins(rawresp_size, rawresp_min, rawresp_max);
+
+    m_field_wf.clear();
+    m_field_pad = 0;
+    if (m_split_short) {
+        m_field_pad = std::min((size_t)std::ceil(rawresp_max/m_tick)+1, n_short_length);
+    }
     //std::cerr << "PlaneImpactResponse: field responses: " << rawresp_size
     //          << "bins covering ["<<rawresp_min/units::us<<","<<rawresp_max/units::us<<"]/"<<rawresp_tick/units::us << " us\n";
 
@@ -242,6 +362,9 @@ void Gen::PlaneImpactResponse::build_responses()
             // sum up over coarse ticks.
             wave[bin] += induced_charge;
         }
+        if (m_split_short) {
+            m_field_wf.emplace_back(wave.begin(), wave.begin()+m_field_pad);
+        }
         WireCell::Waveform::compseq_t spec = Waveform::dft(wave);
 
         // Convolve with short responses
@@ -251,11 +374,11 @@ void Gen::PlaneImpactResponse::build_responses()
             }
         }
 	Waveform::realseq_t wf = Waveform::idft(spec);
-	wf.resize(m_nbins,0);
+	wf.resize(nshort_keep);
 
 	//	std::cout << m_long_padding/m_tick << std::endl;
 	
-	IImpactResponse::pointer ir = std::make_shared<Gen::ImpactResponse>(ipath, wf, m_overall_short_padding/m_tick, long_wf, m_long_padding/m_tick);
+	IImpactResponse::pointer ir = std::make_shared<Gen::ImpactResponse>(ipath, wf, m_overall_short_padding/m_tick, m_nbins, long_resp);
 	m_ir.push_back(ir);
     }
 
@@ -271,6 +394,167 @@ void Gen::PlaneImpactResponse::build_responses()
         m_bywire.push_back(indices);
     }
 
+    if (!cache_path.empty()) {
+        save_cache(cache_path);
+    }
+}
+
+std::string Gen::PlaneImpactResponse::cache_key(const Response::Schema::FieldResponse& fr) const
+{
+    CacheHash hash;
+    hash.pod(cache_version);
+    hash.pod(m_plane_ident);
+    hash.pod(m_nbins);
+    hash.pod(m_tick);
+    hash.pod(m_overall_short_padding);
+    hash.pod(m_long_padding);
+    hash.pod(m_split_short);
+
+    // Responses are hashed by name and by content since the same
+    // name may be configured differently.
+    for (const auto* names : {&m_short, &m_long}) {
+        hash.pod(names->size());
+        for (const auto& name : *names) {
+            auto iw = Factory::find_tn<IWaveform>(name);
+            hash.str(name);
+            hash.pod(iw->waveform_period());
+            hash.vec(iw->waveform_samples());
+        }
+    }
+
+    hash.pod(fr.tstart);
+    hash.pod(fr.period);
+    const auto& pr = *fr.plane(m_plane_ident);
+    hash.pod(pr.pitch);
+    hash.pod(pr.paths.size());
+    for (const auto& path : pr.paths) {
+        hash.pod(path.pitchpos);
+        hash.pod(path.wirepos);
+        hash.vec(path.current);
+    }
+
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash.h);
+    return buf;
+}
+
+bool Gen::PlaneImpactResponse::load_cache(const std::string& path)
+{
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin) {
+        return false;
+    }
+    // Sizes are checked against what this configuration can give
+    // so a damaged file is rebuilt rather than trusted.
+    const uint64_t maxsize = std::max(m_nbins, (size_t)fft_best_length(m_nbins)) + 1;
+    uint64_t version = 0, nir = 0, nwires = 0, nfield = 0;
+    double half_extent = 0, pitch = 0, impact = 0;
+    int field_pad = 0, short_pad = 0;
+    Waveform::realseq_t short_wf, long_wf;
+    bool ok = read_pod(fin, version) && version == cache_version
+        && read_pod(fin, half_extent) && read_pod(fin, pitch) && read_pod(fin, impact)
+        && read_pod(fin, field_pad) && read_pod(fin, short_pad)
+        && read_vec(fin, short_wf, maxsize) && read_vec(fin, long_wf, maxsize)
+        && read_pod(fin, nfield) && nfield <= maxsize;
+
+    std::vector<Waveform::realseq_t> field_wf(ok ? nfield : 0);
+    for (auto& wf : field_wf) {
+        ok = ok && read_vec(fin, wf, maxsize);
+    }
+
+    ok = ok && read_pod(fin, nir) && nir <= maxsize;
+    std::vector<IImpactResponse::pointer> irs;
+    std::shared_ptr<Gen::LongResponse> long_resp;
+    for (uint64_t ind=0; ok && ind<nir; ++ind) {
+        int impact_num = 0, pad = 0, long_pad = 0;
+        Waveform::realseq_t wf;
+        ok = read_pod(fin, impact_num) && read_pod(fin, pad) && read_pod(fin, long_pad)
+            && read_vec(fin, wf, maxsize);
+        if (ok) {
+            if (!long_resp) {
+                long_resp = Gen::LongResponse::shared(long_wf, long_pad);
+            }
+            irs.push_back(std::make_shared<Gen::ImpactResponse>(impact_num, wf, pad, m_nbins, long_resp));
+        }
+    }
+
+    ok = ok && read_pod(fin, nwires) && nwires <= maxsize;
+    wire_region_indicies_t bywire(ok ? nwires : 0);
+    for (auto& region : bywire) {
+        ok = ok && read_vec(fin, region, nir);
+        for (int irind : region) {
+            ok = ok && irind >= 0 && irind < (int)nir;
+        }
+    }
+    if (!ok) {
+        cerr << "Gen::PlaneImpactResponse: ignoring unreadable cache file " << path << "\n";
+        return false;
+    }
+
+    m_half_extent = half_extent;
+    m_pitch = pitch;
+    m_impact = impact;
+    m_field_pad = field_pad;
+    m_short_pad = short_pad;
+    m_short_wf = short_wf;
+    m_field_wf = field_wf;
+    m_ir = irs;
+    m_bywire = bywire;
+    return true;
+}
+
+void Gen::PlaneImpactResponse::save_cache(const std::string& path) const
+{
+    // Many jobs may start at once so each writes its own file and
+    // renames it into place, which is atomic.
+    std::random_device rd;
+    const std::string tmppath = path + ".tmp" + std::to_string(rd());
+    {
+        std::ofstream fout(tmppath, std::ios::binary);
+        if (!fout) {
+            cerr << "Gen::PlaneImpactResponse: can not write cache file " << tmppath << "\n";
+            return;
+        }
+        Waveform::realseq_t long_wf;
+        if (!m_ir.empty()) {
+            long_wf = m_ir[0]->long_aux_waveform();
+        }
+        write_pod(fout, cache_version);
+        write_pod(fout, m_half_extent);
+        write_pod(fout, m_pitch);
+        write_pod(fout, m_impact);
+        write_pod(fout, m_field_pad);
+        write_pod(fout, m_short_pad);
+        write_vec(fout, m_short_wf);
+        write_vec(fout, long_wf);
+        write_pod(fout, (uint64_t)m_field_wf.size());
+        for (const auto& wf : m_field_wf) {
+            write_vec(fout, wf);
+        }
+        write_pod(fout, (uint64_t)m_ir.size());
+        for (const auto& ir : m_ir) {
+            write_pod(fout, ir->impact());
+            write_pod(fout, ir->waveform_pad());
+            write_pod(fout, ir->long_aux_waveform_pad());
+            write_vec(fout, ir->waveform());
+        }
+        write_pod(fout, (uint64_t)m_bywire.size());
+        for (const auto& region : m_bywire) {
+            write_vec(fout, region);
+        }
+        if (!fout) {
+            cerr << "Gen::PlaneImpactResponse: failed writing cache file " << tmppath << "\n";
+            fout.close();
+            std::remove(tmppath.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmppath.c_str(), path.c_str()) != 0) {
+        std::remove(tmppath.c_str());
+        return;
+    }
+    cerr << "Gen::PlaneImpactResponse: plane " << m_plane_ident
+         << ": saved responses to " << path << "\n";
 }
 
 Gen::PlaneImpactResponse::~PlaneImpactResponse()
@@ -14,6 +14,9 @@
 #include "WireCellUtil/NamedFactory.h"
 
 #include <random>
+#include <climits>
+#include <cmath>
+#include <algorithm>
 
 WIRECELL_FACTORY(Random, WireCell::Gen::Random,
                  WireCell::IRandom, WireCell::IConfigurable)
@@ -26,6 +29,12 @@ Gen::Random::Random(const std::string& generator,
     , m_seeds(seeds.begin(), seeds.end())
     , m_pimpl(nullptr)
 {
+    make_engine(m_generator);
+}
+
+Gen::Random::~Random()
+{
+    delete m_pimpl;
 }
 
 
@@ -77,6 +86,11 @@ void Gen::Random::configure(const WireCell::Configuration& cfg)
         m_seeds = seeds;
     }
     auto gen = get(cfg,"generator",m_generator);
+    make_engine(gen);
+}
+
+void Gen::Random::make_engine(const std::string& gen)
+{
     if (m_pimpl) {
         delete m_pimpl;
     }
@@ -92,6 +106,73 @@ void Gen::Random::configure(const WireCell::Configuration& cfg)
     }
 }
 
+IRandom::pointer Gen::random_substream(IRandom::pointer parent)
+{
+    if (!parent) {
+        return nullptr;
+    }
+    const unsigned int seed1 = parent->range(0, INT_MAX);
+    const unsigned int seed2 = parent->range(0, INT_MAX);
+    return std::make_shared<Gen::Random>("twister", std::vector<unsigned int>{seed1, seed2});
+}
+
+// Sample a binomial of small variance by inverting its CDF with one
+// uniform.  This avoids the setup IRandom::binomial() does per call.
+static int binomial_inversion(IRandom& rng, int n, double prob)
+{
+    if (prob > 0.5) {
+        return n - binomial_inversion(rng, n, 1.0 - prob);
+    }
+    const double s = prob/(1.0-prob);
+    const double a = (n+1)*s;
+    double pmf = std::exp(n*std::log1p(-prob));
+    double u = rng.uniform(0.0, 1.0);
+    int num = 0;
+    while (u > pmf && num < n) {
+        u -= pmf;
+        ++num;
+        pmf *= a/num - s;
+    }
+    return num;
+}
+
+void Gen::multinomial(IRandom& rng, int ntotal, const std::vector<double>& probs,
+                       std::vector<int>& counts, double normal_var)
+{
+    const int nbins = probs.size();
+    counts.assign(nbins, 0);
+
+    // Probability left in the bins at and after each one.
+    std::vector<double> rest(nbins+1, 0.0);
+    for (int ind = nbins-1; ind >= 0; --ind) {
+        rest[ind] = rest[ind+1] + std::max(probs[ind], 0.0);
+    }
+
+    int left = ntotal;
+    for (int ind = 0; ind < nbins && left > 0; ++ind) {
+        if (probs[ind] <= 0) {
+            continue;
+        }
+        const double cond = probs[ind]/rest[ind];
+        if (cond >= 1.0 || rest[ind+1] <= 0) {
+            counts[ind] = left;
+            break;
+        }
+        const double mean = left*cond;
+        const double var = mean*(1.0-cond);
+        int num = 0;
+        if (var > normal_var) {
+            num = std::lround(rng.normal(mean, std::sqrt(var)));
+            num = std::min(std::max(num, 0), left);
+        }
+        else {
+            num = binomial_inversion(rng, left, cond);
+        }
+        counts[ind] = num;
+        left -= num;
+    }
+}
+
 WireCell::Configuration Gen::Random::default_configuration() const
 {
     Configuration cfg;
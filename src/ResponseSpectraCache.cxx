@@ -0,0 +1,121 @@
+#include "WireCellGen/ResponseSpectraCache.h"
+
+#include <complex>
+
+using namespace WireCell;
+
+Gen::ResponseSpectraCache::ResponseSpectraCache(size_t max_bytes)
+    : m_max_bytes(max_bytes)
+    , m_bytes(0)
+    , m_serial(0)
+    , m_hits(0)
+    , m_misses(0)
+{
+}
+
+Gen::ResponseSpectraCache::spectra_pointer
+Gen::ResponseSpectraCache::spectra(const IPlaneImpactResponse* pir, int nspectra, int nwires, int nticks,
+                                   std::function<spectra_pointer()> build)
+{
+    const size_t nbytes = size_t(nspectra) * nwires * nticks * sizeof(std::complex<float>);
+    auto value = get(key_t(pir, nwires, nticks), nbytes, [&]() { return value_t(build()); });
+    return std::static_pointer_cast<const std::vector<Array::array_xxc> >(value);
+}
+
+Gen::ResponseSpectraCache::long_pointer
+Gen::ResponseSpectraCache::long_spectrum(const IPlaneImpactResponse* pir, int nlength,
+                                         std::function<long_pointer()> build)
+{
+    const size_t nbytes = size_t(nlength) * sizeof(std::complex<float>);
+    auto value = get(key_t(pir, 0, nlength), nbytes, [&]() { return value_t(build()); });
+    return std::static_pointer_cast<const Waveform::compseq_t>(value);
+}
+
+Gen::ResponseSpectraCache::value_t
+Gen::ResponseSpectraCache::get(const key_t& key, size_t nbytes, std::function<value_t()> build)
+{
+    std::promise<value_t> promise;
+    std::shared_future<value_t> value;
+    size_t serial = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->key == key) {
+                ++m_hits;
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                value = it->value;
+                break;
+            }
+        }
+        if (!value.valid()) {
+            ++m_misses;
+            if (nbytes > m_max_bytes) { // would never fit
+                return build();
+            }
+            while (m_bytes + nbytes > m_max_bytes) {
+                m_bytes -= m_entries.back().nbytes;
+                m_entries.pop_back();
+            }
+            serial = ++m_serial;
+            value = promise.get_future().share();
+            m_entries.push_front(Entry{key, nbytes, serial, value});
+            m_bytes += nbytes;
+        }
+    }
+    if (!serial) {
+        return value.get();
+    }
+
+    // Build outside of the lock.  Anyone else asking for this entry
+    // meanwhile waits on the future.
+    try {
+        promise.set_value(build());
+    }
+    catch (...) {
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->serial == serial) {
+                m_bytes -= it->nbytes;
+                m_entries.erase(it);
+                break;
+            }
+        }
+    }
+    return value.get();
+}
+
+int Gen::ResponseSpectraCache::canonical_length(int n)
+{
+    int pow2 = 8;
+    while (true) {
+        for (int num : {4, 5, 6}) {
+            const int len = num * (pow2/4);
+            if (len >= n) {
+                return len;
+            }
+        }
+        pow2 *= 2;
+    }
+}
+
+size_t Gen::ResponseSpectraCache::bytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+double Gen::ResponseSpectraCache::hit_rate() const
+{
+    const double nhits = m_hits, nmisses = m_misses;
+    if (nhits + nmisses == 0) {
+        return 0.0;
+    }
+    return nhits/(nhits + nmisses);
+}
+
+void Gen::ResponseSpectraCache::reset_counts()
+{
+    m_hits = 0;
+    m_misses = 0;
+}
@@ -0,0 +1,184 @@
+#include "WireCellGen/ThreadUtil.h"
+#include "WireCellUtil/Exceptions.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace WireCell;
+
+namespace {
+
+    // Worker threads shared by all parallel_chunks() calls in the
+    // job.  It grows to the most workers ever asked for and lives
+    // until exit.  A thread waiting for its chunks runs queued jobs
+    // meanwhile so nested calls from inside a job can not deadlock.
+    class WorkerPool {
+    public:
+        static WorkerPool& instance() {
+            static WorkerPool pool;
+            return pool;
+        }
+
+        ~WorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_cv.notify_all();
+            for (auto& th : m_threads) {
+                th.join();
+            }
+        }
+
+        void reserve(int nworkers) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            while ((int)m_threads.size() < nworkers) {
+                m_threads.emplace_back([this]() { work(); });
+            }
+        }
+
+        void submit(std::function<void()> job) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_jobs.push_back(std::move(job));
+            }
+            m_cv.notify_all();
+        }
+
+        // Wake waiters to check their condition.
+        void notify() {
+            { std::lock_guard<std::mutex> lock(m_mutex); }
+            m_cv.notify_all();
+        }
+
+        // Run queued jobs until done() is true.
+        template<typename Pred>
+        void wait(Pred done) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!done()) {
+                if (m_jobs.empty()) {
+                    m_cv.wait(lock);
+                    continue;
+                }
+                auto job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+        }
+
+    private:
+        void work() {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true) {
+                if (m_stop) {
+                    return;
+                }
+                if (m_jobs.empty()) {
+                    m_cv.wait(lock);
+                    continue;
+                }
+                auto job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque< std::function<void()> > m_jobs;
+        std::vector<std::thread> m_threads;
+        bool m_stop = false;
+    };
+}
+
+int Gen::resolve_nthreads(int nthreads)
+{
+    if (nthreads > 0) {
+        return nthreads;
+    }
+    const int nhw = std::thread::hardware_concurrency();
+    return std::max(nhw, 1);
+}
+
+int Gen::get_nthreads(const Configuration& cfg, const std::string& key, int def)
+{
+    auto jval = cfg[key];
+    if (jval.isNull()) {
+        return def;
+    }
+    if (jval.isString()) {
+        if (jval.asString() == "auto") {
+            return resolve_nthreads(0);
+        }
+        THROW(ValueError() << errmsg{"thread count \"" + key + "\" must be an integer or \"auto\""});
+    }
+    return resolve_nthreads(jval.asInt());
+}
+
+int Gen::parallel_chunks(int nthreads, int ntasks,
+                         std::function<void(int ichunk, int begin, int end)> func)
+{
+    if (ntasks <= 0) {
+        return 0;
+    }
+    const int nchunks = std::min(resolve_nthreads(nthreads), ntasks);
+    if (nchunks == 1) {
+        func(0, 0, ntasks);
+        return 1;
+    }
+
+    std::vector<std::exception_ptr> errors(nchunks);
+    auto run_chunk = [&func, &errors, ntasks, nchunks](int ichunk) {
+        // spread any remainder over the first chunks
+        const int begin = (ichunk*ntasks)/nchunks;
+        const int end = ((ichunk+1)*ntasks)/nchunks;
+        try {
+            func(ichunk, begin, end);
+        }
+        catch (...) {
+            errors[ichunk] = std::current_exception();
+        }
+    };
+
+    // The caller does the first chunk and pool workers the rest.
+    auto& pool = WorkerPool::instance();
+    pool.reserve(nchunks-1);
+    std::atomic<int> remaining(nchunks-1);
+    for (int ichunk=1; ichunk<nchunks; ++ichunk) {
+        pool.submit([&run_chunk, &remaining, ichunk]() {
+            run_chunk(ichunk);
+            --remaining;
+            WorkerPool::instance().notify();
+        });
+    }
+    run_chunk(0);
+    pool.wait([&remaining]() { return remaining == 0; });
+
+    for (auto& err : errors) {
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+    return nchunks;
+}
+
+void Gen::parallel_tasks(int nthreads, int ntasks, std::function<void(int itask)> func)
+{
+    // Each chunk is a thread pulling tasks, its range is not used.
+    std::atomic<int> next(0);
+    parallel_chunks(nthreads, ntasks, [&](int, int, int) {
+        for (int itask = next++; itask < ntasks; itask = next++) {
+            func(itask);
+        }
+    });
+}
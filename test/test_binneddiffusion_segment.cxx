@@ -0,0 +1,88 @@
+/*
+  Check that a long diagonal segment added to BinnedDiffusion_transform
+  is cut into pieces of bounded extent which together sample the same
+  charge as the whole segment in one patch.
+ */
+
+#include "WireCellGen/BinnedDiffusion_transform.h"
+#include "WireCellIface/SimpleDepo.h"
+#include "WireCellUtil/Testing.h"
+#include "WireCellUtil/Units.h"
+
+#include <iostream>
+
+using namespace WireCell;
+using namespace std;
+
+const int nticks = 2000;
+const double tick = 0.5*units::us;
+const int nwires = 201;
+const double wire_pitch = 3*units::mm;
+const double qtot = -100000.0;
+
+struct Sampled {
+    Array::array_xxf charge;    // summed over impact groups
+    size_t npieces;
+    long max_area;              // largest (channel, tick) extent
+};
+
+Sampled sample(int max_bins)
+{
+    const double half = 0.5*(nwires-1)*wire_pitch;
+    Pimpos pimpos(nwires, -half, half);
+    Binning tbins(nticks, 0, nticks*tick);
+    Gen::BinnedDiffusion_transform bd(pimpos, tbins, 3.0);
+
+    // across most of the wires and ticks
+    auto depo = std::make_shared<SimpleDepo>(100*tick, Point(0, 0, -0.8*half), qtot);
+    Assert(bd.add_segment(depo, Point(0, 0, 0.8*half), 1800*tick, 2*tick, 1*units::mm, max_bins));
+
+    Sampled ret;
+    std::vector<std::array<int,4> > extents;
+    bd.get_charge_extents(extents);
+    ret.npieces = extents.size();
+    ret.max_area = 0;
+    for (const auto& ext : extents) {
+        ret.max_area = std::max(ret.max_area, long(ext[1]-ext[0])*(ext[3]-ext[2]));
+    }
+
+    std::vector<int> vec_impact;
+    for (int imp = -5; imp <= 5; ++imp) {
+        vec_impact.push_back(imp);
+    }
+    Gen::BinnedDiffusion_transform::ChargeGrid grid;
+    grid.start_ch = 0;
+    grid.start_tick = 0;
+    grid.cell_wires = nwires;
+    grid.cell_ticks = nticks;
+    grid.ncw = grid.nct = 1;
+    grid.cell_window.assign(1, 0);
+    grid.windows.push_back({0, 0, std::vector<Array::array_xxf>(vec_impact.size(),
+                                                                Array::array_xxf::Zero(nwires, nticks))});
+    bd.get_charge_grid(grid, vec_impact);
+    ret.charge = Array::array_xxf::Zero(nwires, nticks);
+    for (const auto& group : grid.windows[0].groups) {
+        ret.charge += group;
+    }
+    return ret;
+}
+
+int main()
+{
+    auto whole = sample(1000000);
+    auto split = sample(64);
+
+    const double qwhole = whole.charge.sum(), qsplit = split.charge.sum();
+    const double maxdiff = (whole.charge - split.charge).abs().maxCoeff() / std::abs(whole.charge.minCoeff());
+    cerr << "whole: " << whole.npieces << " piece over " << whole.max_area << " cells, charge " << qwhole << "\n"
+         << "split: " << split.npieces << " pieces over at most " << split.max_area << " cells, charge " << qsplit << "\n"
+         << "max diff: " << maxdiff << endl;
+
+    Assert(whole.npieces == 1);
+    Assert(split.npieces > 10);
+    Assert(split.max_area*10 < whole.max_area);
+    Assert(std::abs(qwhole - qtot) < 1e-3*std::abs(qtot));
+    Assert(std::abs(qsplit - qtot) < 1e-3*std::abs(qtot));
+    Assert(maxdiff < 0.01);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+  Check that the charge sampled by BinnedDiffusion_transform, with
+  fluctuations, does not depend on the number of threads.
+ */
+
+#include "WireCellGen/BinnedDiffusion_transform.h"
+#include "WireCellGen/Random.h"
+#include "WireCellIface/SimpleDepo.h"
+#include "WireCellUtil/Testing.h"
+#include "WireCellUtil/Units.h"
+
+#include <iostream>
+
+using namespace WireCell;
+using namespace std;
+
+const int nticks = 2000;
+const double tick = 0.5*units::us;
+const int nwires = 201;
+const double wire_pitch = 3*units::mm;
+
+Gen::BinnedDiffusion_transform::ChargeGrid make_grid(const std::vector<int>& vec_impact)
+{
+    Gen::BinnedDiffusion_transform::ChargeGrid grid;
+    grid.start_ch = 0;
+    grid.start_tick = 0;
+    grid.cell_wires = nwires;
+    grid.cell_ticks = nticks;
+    grid.ncw = grid.nct = 1;
+    grid.cell_window.assign(1, 0);
+    grid.windows.push_back({0, 0, std::vector<Array::array_xxf>(vec_impact.size(),
+                                                                Array::array_xxf::Zero(nwires, nticks))});
+    return grid;
+}
+
+std::vector<Array::array_xxf> sample(int nthreads)
+{
+    const double half = 0.5*(nwires-1)*wire_pitch;
+    Pimpos pimpos(nwires, -half, half);
+    Binning tbins(nticks, 0, nticks*tick);
+
+    // same seeds for each call
+    auto rng = std::make_shared<Gen::Random>("twister", std::vector<unsigned int>{1,2,3,4,5});
+    Gen::BinnedDiffusion_transform bd(pimpos, tbins, 3.0, rng);
+
+    // a diagonal track of many more depos than one sampling block
+    const int ndepos = 2000;
+    for (int ind=0; ind<ndepos; ++ind) {
+        const double frac = (ind+0.5)/ndepos;
+        const Point pt(0, 0, -0.8*half + 1.6*half*frac);
+        const double time = (100 + 1800*frac)*tick;
+        auto depo = std::make_shared<SimpleDepo>(time, pt, -5000.0);
+        bd.add(depo, 2*tick, 1*units::mm);
+    }
+
+    std::vector<int> vec_impact;
+    for (int imp = -5; imp <= 5; ++imp) {
+        vec_impact.push_back(imp);
+    }
+    auto grid = make_grid(vec_impact);
+    bd.get_charge_grid(grid, vec_impact, nthreads);
+    return grid.windows[0].groups;
+}
+
+int main()
+{
+    auto one = sample(1);
+    double total = 0;
+    for (const auto& group : one) {
+        total += group.sum();
+    }
+    cerr << "total sampled charge: " << total << endl;
+    Assert(total < 0);
+
+    for (int nthreads : {2, 3, 8}) {
+        auto many = sample(nthreads);
+        Assert(many.size() == one.size());
+        for (size_t ind=0; ind<one.size(); ++ind) {
+            Assert((many[ind] == one[ind]).all());
+        }
+        cerr << nthreads << " threads: identical\n";
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+  Check that DepoCoalescer merges a finely stepped track, keeps its
+  charge and time order and leaves separated depos alone.
+ */
+
+#include "WireCellGen/DepoCoalescer.h"
+#include "WireCellIface/SimpleDepo.h"
+#include "WireCellUtil/Testing.h"
+#include "WireCellUtil/Units.h"
+
+#include <cmath>
+#include <iostream>
+
+using namespace WireCell;
+using namespace std;
+
+int main()
+{
+    Gen::DepoCoalescer dc;
+    auto cfg = dc.default_configuration();
+    cfg["time_tolerance"] = 0.5*units::us;
+    cfg["space_tolerance"] = 1.0*units::mm;
+    dc.configure(cfg);
+
+    // A track along Z drifting parallel to the wires: many depos
+    // per cell, all with the same diffusion.
+    IDrifter::output_queue outq;
+    const int ndepos = 1000;
+    double qin = 0;
+    for (int ind=0; ind<ndepos; ++ind) {
+        const double time = 100*units::us + ind*0.01*units::us;
+        const Point pos(1*units::cm, 0.5*units::mm, 0.01*units::mm*ind);
+        auto depo = make_shared<SimpleDepo>(time, pos, -100.0, nullptr, 1*units::mm, 1*units::mm);
+        qin += depo->charge();
+        Assert(dc(depo, outq));
+    }
+
+    // A lone depo far away passes through.
+    auto lone = make_shared<SimpleDepo>(500*units::us, Point(1*units::cm, 1*units::m, 0),
+                                        -50.0, nullptr, 2*units::mm, 2*units::mm);
+    qin += lone->charge();
+    Assert(dc(lone, outq));
+    Assert(dc(nullptr, outq));
+
+    Assert(!outq.empty() && outq.back() == nullptr);
+    outq.pop_back();
+    cerr << ndepos+1 << " depos in, " << outq.size() << " out\n";
+    Assert(outq.size() < 100);
+    Assert(outq.back() == lone);
+
+    double qout = 0, last = 0;
+    int nmerged = 0;
+    for (auto depo : outq) {
+        qout += depo->charge();
+        Assert(depo->time() >= last);
+        last = depo->time();
+        // merged extents only grow
+        Assert(depo->extent_long() >= 0.999*units::mm);
+        Assert(depo->extent_tran() >= 0.999*units::mm);
+        // merged depos point back to a constituent
+        if (depo->prior()) {
+            ++nmerged;
+        }
+    }
+    Assert(nmerged > 0);
+    Assert(std::abs(qout - qin) < 1e-6*std::abs(qin));
+
+    // Depos differing only in X, eg drifted to either side of an
+    // APA, are not merged.
+    outq.clear();
+    auto left = make_shared<SimpleDepo>(100*units::us, Point(-1*units::cm, 0, 0),
+                                        -100.0, nullptr, 1*units::mm, 1*units::mm);
+    auto right = make_shared<SimpleDepo>(100*units::us, Point(1*units::cm, 0, 0),
+                                         -100.0, nullptr, 1*units::mm, 1*units::mm);
+    Assert(dc(left, outq));
+    Assert(dc(right, outq));
+    Assert(dc(nullptr, outq));
+    Assert(outq.size() == 3 && outq.back() == nullptr);
+    Assert(outq[0]->pos().x() != outq[1]->pos().x());
+    Assert((outq[0] == left && outq[1] == right) || (outq[0] == right && outq[1] == left));
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+  Check that DepoTransform streaming two time slabs of depos gives
+  frames which, laid end to end, match one transform over both.  The
+  short responses are split from the field response so the response
+  to charge at the end of the first slab reaches past the overall
+  short padding into the second frame.
+ */
+
+#include "WireCellUtil/PluginManager.h"
+#include "WireCellUtil/NamedFactory.h"
+#include "WireCellUtil/Testing.h"
+#include "WireCellUtil/Units.h"
+
+#include "WireCellIface/IConfigurable.h"
+#include "WireCellIface/IDepoFramer.h"
+#include "WireCellIface/SimpleDepo.h"
+#include "WireCellIface/SimpleDepoSet.h"
+
+#include "anode_loader.h"
+
+#include <cmath>
+#include <iostream>
+#include <map>
+
+using namespace WireCell;
+using namespace std;
+
+const double tick = 0.5*units::us;
+const double readout = 1*units::ms;
+const int nsamples = readout/tick;
+
+typedef std::map<int, std::vector<float> > channel_waves_t;
+
+// Add the frame's traces into waves starting at tick offset.
+void add_frame(channel_waves_t& waves, IFrame::pointer frame, int offset)
+{
+    for (auto trace : *frame->traces()) {
+        auto& wave = waves[trace->channel()];
+        wave.resize(2*nsamples, 0.0);
+        const auto& charge = trace->charge();
+        for (size_t ind=0; ind<charge.size(); ++ind) {
+            const int it = offset + trace->tbin() + ind;
+            if (it < 2*nsamples) {
+                wave[it] += charge[ind];
+            }
+        }
+    }
+}
+
+int main()
+{
+    auto anode_tns = anode_loader("uboone");
+
+    const std::string er_tn = "ElecResponse";
+    {
+        auto icfg = Factory::lookup_tn<IConfigurable>(er_tn);
+        auto cfg = icfg->default_configuration();
+        cfg["gain"] = 14.0*units::mV/units::fC;
+        cfg["shaping"] = 2.0*units::us;
+        cfg["nticks"] = 200;    // overall_short_padding
+        cfg["tick"] = tick;
+        icfg->configure(cfg);
+    }
+    Json::Value pirs = Json::arrayValue;
+    for (int iplane=0; iplane<3; ++iplane) {
+        const std::string tn = String::format("PlaneImpactResponse:%d", iplane);
+        auto icfg = Factory::lookup_tn<IConfigurable>(tn);
+        auto cfg = icfg->default_configuration();
+        cfg["plane"] = iplane;
+        cfg["nticks"] = 2*nsamples;
+        cfg["tick"] = tick;
+        cfg["overall_short_padding"] = 100*units::us;
+        cfg["short_responses"][0] = er_tn;
+        cfg["split_short_responses"] = true;
+        icfg->configure(cfg);
+        pirs.append(tn);
+    }
+
+    const std::vector<std::string> dt_tns{"DepoTransform:stream", "DepoTransform:long"};
+    for (size_t ind=0; ind<dt_tns.size(); ++ind) {
+        auto icfg = Factory::lookup_tn<IConfigurable>(dt_tns[ind]);
+        auto cfg = icfg->default_configuration();
+        cfg["anode"] = anode_tns[0];
+        cfg["pirs"] = pirs;
+        cfg["tick"] = tick;
+        cfg["start_time"] = 0.0;
+        cfg["readout_time"] = (ind == 0 ? 1 : 2)*readout;
+        cfg["streaming"] = (ind == 0);
+        icfg->configure(cfg);
+    }
+    auto stream = Factory::find_tn<IDepoFramer>(dt_tns[0]);
+    auto whole = Factory::find_tn<IDepoFramer>(dt_tns[1]);
+
+    // The first slab ends with charge just before the frame boundary.
+    IDepo::vector slabs[2], all;
+    for (int ind=0; ind<20; ++ind) {
+        const double time = ind < 10 ? readout - (10-ind)*5*tick : readout + ind*50*tick;
+        const Point pos(20*units::cm, (ind-10)*1*units::cm, 5*units::m + ind*7*units::mm);
+        auto depo = std::make_shared<SimpleDepo>(time, pos, -10000.0, nullptr, 1*units::mm, 1*units::mm);
+        slabs[ind < 10 ? 0 : 1].push_back(depo);
+        all.push_back(depo);
+    }
+
+    channel_waves_t streamed, expected;
+    for (int islab=0; islab<2; ++islab) {
+        IFrame::pointer frame;
+        Assert((*stream)(std::make_shared<SimpleDepoSet>(islab, slabs[islab]), frame));
+        Assert(frame);
+        add_frame(streamed, frame, islab*nsamples);
+    }
+    {
+        IFrame::pointer frame;
+        Assert((*whole)(std::make_shared<SimpleDepoSet>(0, all), frame));
+        add_frame(expected, frame, 0);
+    }
+
+    // The response to the first slab reaches into the second frame.
+    double peak = 0, maxdiff = 0, carried = 0;
+    for (const auto& chw : expected) {
+        auto& got = streamed[chw.first];
+        got.resize(2*nsamples, 0.0);
+        for (int it=0; it<2*nsamples; ++it) {
+            peak = std::max(peak, (double)std::abs(chw.second[it]));
+            maxdiff = std::max(maxdiff, (double)std::abs(got[it] - chw.second[it]));
+            if (it >= nsamples && it < nsamples + 40) {
+                carried = std::max(carried, (double)std::abs(got[it]));
+            }
+        }
+    }
+    cerr << "channels: " << expected.size() << " peak: " << peak
+         << " carried: " << carried << " max difference: " << maxdiff << endl;
+    Assert(peak > 0);
+    Assert(carried > 0.01*peak);
+    Assert(maxdiff < 1e-4*peak);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+  Check that GausKernelCache reuses kernels for depos of about the
+  same sigma and that its kernels are close to the exact ones.
+ */
+
+#include "WireCellGen/GausKernelCache.h"
+#include "WireCellGen/GaussKernels.h"
+#include "WireCellUtil/Testing.h"
+
+#include <cmath>
+#include <iostream>
+
+using namespace WireCell;
+using namespace std;
+
+int main()
+{
+    const double step = 0.5;    // eg one tick
+    const double precision = 0.01;
+    Gen::GausKernelCache cache(precision);
+
+    // A track of depos which drift about the same distance
+    const int ndepos = 5000;
+    const int nbins = 12;
+    double maxdiff = 0;
+    Gen::GausKernelCache::kernel_pointer last;
+    Gen::GausDesc last_desc(0, 0);
+    double last_start = 0;
+    for (int ind=0; ind<ndepos; ++ind) {
+        const double center = 100.0 + 0.0137*ind;
+        const double sigma = 1.0 + 1e-6*ind;
+        const double start = step*std::floor((center - 3*sigma)/step);
+        Gen::GausDesc desc(center, sigma);
+
+        auto kernel = cache.get(desc, start, step, nbins, true);
+        Assert(kernel);
+        Assert((int)kernel->bins.size() == nbins);
+        Assert((int)kernel->weights.size() == nbins);
+
+        std::vector<double> bins(nbins);
+        Gen::gauss_binint(center, sigma, start, step, nbins, bins.data());
+        for (int ibin=0; ibin<nbins; ++ibin) {
+            maxdiff = std::max(maxdiff, std::abs(bins[ibin] - kernel->bins[ibin]));
+        }
+        last = kernel;
+        last_desc = desc;
+        last_start = start;
+    }
+    const double rate = cache.hit_rate();
+    cerr << "hits=" << cache.hits() << " misses=" << cache.misses()
+         << " rate=" << rate << " max diff=" << maxdiff << endl;
+
+    // Rounding moves the Gaussian by at most half a quantum.
+    Assert(maxdiff < precision*step);
+    // One lookup per depo.
+    Assert(cache.hits() + cache.misses() == ndepos);
+    Assert(rate > 0.9);
+
+    // same key gives the same kernel
+    Assert(cache.get(last_desc, last_start, step, nbins, true) == last);
+
+    // Point sources are not cached.
+    Assert(!cache.get(Gen::GausDesc(1.0, 0.0), 0.0, step, 1));
+
+    cache.reset_counts();
+    Assert(cache.hits() == 0 && cache.misses() == 0);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+  Check that a diffused line segment sampled as one patch matches the
+  same charge chopped into many closely spaced point depos.
+ */
+
+#include "WireCellGen/GaussianDiffusion.h"
+#include "WireCellIface/SimpleDepo.h"
+#include "WireCellUtil/Testing.h"
+#include "WireCellUtil/Units.h"
+
+#include <cmath>
+#include <iostream>
+
+using namespace WireCell;
+using namespace std;
+
+// Compare a segment with npoints point depos along it, return the
+// largest difference relative to the largest bin.
+double compare(double tlen, double plen, unsigned int weightstrat)
+{
+    const Binning tbins(400, 0, 200*units::us);
+    const Binning pbins(600, 0, 180*units::mm);
+    const double t0 = 50*units::us, p0 = 40*units::mm;
+    const double tsig = 1.2*units::us, psig = 0.8*units::mm;
+    const double qtot = -10000.0;
+
+    auto depo = make_shared<SimpleDepo>(t0, Point(0, 0, p0), qtot);
+    Gen::GaussianDiffusion seg(depo, Gen::GausDesc(t0, tsig), Gen::GausDesc(p0, psig), tlen, plen);
+    Assert(seg.segment());
+    seg.set_sampling(tbins, pbins, 3.0, nullptr, weightstrat);
+    const auto& spatch = seg.patch();
+
+    // reference on the full domain
+    Array::array_xxf ref = Array::array_xxf::Zero(pbins.nbins(), tbins.nbins());
+    Array::array_xxf ref_w = Array::array_xxf::Zero(pbins.nbins(), 1);
+    const int npoints = 2000;
+    for (int ind=0; ind<npoints; ++ind) {
+        const double f = (ind+0.5)/npoints;
+        auto pd = make_shared<SimpleDepo>(t0 + f*tlen, Point(0, 0, p0 + f*plen), qtot/npoints);
+        Gen::GaussianDiffusion gd(pd, Gen::GausDesc(t0 + f*tlen, tsig), Gen::GausDesc(p0 + f*plen, psig));
+        gd.set_sampling(tbins, pbins, 6.0, nullptr, weightstrat);
+        const auto& patch = gd.patch();
+        const auto& wts = gd.weights();
+        for (int ip=0; ip<patch.rows(); ++ip) {
+            for (int it=0; it<patch.cols(); ++it) {
+                ref(ip+gd.poffset_bin(), it+gd.toffset_bin()) += patch(ip,it);
+                ref_w(ip+gd.poffset_bin(), 0) += patch(ip,it)*wts[ip];
+            }
+        }
+    }
+
+    double qseg = 0, maxdiff = 0, maxwdiff = 0;
+    const double qmax = std::abs(ref.minCoeff());
+    const auto& wts = seg.weights();
+    for (int ip=0; ip<spatch.rows(); ++ip) {
+        double row = 0;
+        for (int it=0; it<spatch.cols(); ++it) {
+            const double q = spatch(ip,it);
+            qseg += q;
+            row += q;
+            maxdiff = std::max(maxdiff, std::abs(q - ref(ip+seg.poffset_bin(), it+seg.toffset_bin()))/qmax);
+        }
+        const double refrow = ref.row(ip+seg.poffset_bin()).sum();
+        if (std::abs(refrow) > 1e-3*std::abs(qtot)) {
+            const double refw = ref_w(ip+seg.poffset_bin(), 0)/refrow;
+            maxwdiff = std::max(maxwdiff, std::abs(wts[ip] - refw));
+        }
+    }
+    cerr << "segment dt=" << tlen/units::us << "us dp=" << plen/units::mm << "mm: "
+         << spatch.rows() << "x" << spatch.cols() << " bins, separable=" << seg.separable()
+         << " charge=" << qseg << " max diff=" << maxdiff << " max weight diff=" << maxwdiff << endl;
+    Assert(std::abs(qseg - qtot) < 1e-3*std::abs(qtot));
+    Assert(maxwdiff < 0.005);
+    return maxdiff;
+}
+
+int main()
+{
+    // along time, along pitch, diagonal and short
+    Assert(compare(100*units::us, 0, 2) < 0.005);
+    Assert(compare(0, 100*units::mm, 2) < 0.005);
+    Assert(compare(80*units::us, 60*units::mm, 2) < 0.005);
+    Assert(compare(-30*units::us, 20*units::mm, 1) < 0.005);
+    Assert(compare(0.2*units::us, 0.1*units::mm, 2) < 0.005);
+    return 0;
+}
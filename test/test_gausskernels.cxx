@@ -0,0 +1,112 @@
+/*
+  Check the batched Gaussian kernels against the standard library and
+  bit for bit against their scalar references, which are built
+  without FMA, and time the bin integration against the scalar
+  std::erf version it replaces in GausDesc::binint().
+ */
+
+#include "WireCellGen/GaussKernels.h"
+#include "WireCellUtil/Testing.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace WireCell;
+using namespace std;
+
+// The original GausDesc::binint() arithmetic.
+void scalar_binint(double center, double sigma, double start, double step, int nbins, double* bins)
+{
+    std::vector<double> erfs(nbins+1);
+    const double sqrt2 = sqrt(2.0);
+    for (int ind=0; ind <= nbins; ++ind) {
+        erfs[ind] = 0.5*std::erf((start + step*ind - center)/(sqrt2*sigma));
+    }
+    for (int ibin=0; ibin < nbins; ++ibin) {
+        bins[ibin] = erfs[ibin+1] - erfs[ibin];
+    }
+}
+
+int main()
+{
+    const int npts = 100001;
+    std::vector<double> x(npts), y(npts);
+    for (int ind=0; ind<npts; ++ind) {
+        x[ind] = -8.0 + 16.0*ind/(npts-1);
+    }
+    Gen::erf_batch(x.data(), y.data(), npts);
+    double maxerr = 0;
+    for (int ind=0; ind<npts; ++ind) {
+        maxerr = std::max(maxerr, std::abs(y[ind] - std::erf(x[ind])));
+    }
+    cerr << "erf max abs error: " << maxerr << endl;
+    Assert(maxerr < 1e-14);
+
+    for (int ind=0; ind<npts; ++ind) {
+        x[ind] = -700.0 + 1400.0*ind/(npts-1);
+    }
+    Gen::exp_batch(x.data(), y.data(), npts);
+    maxerr = 0;
+    for (int ind=0; ind<npts; ++ind) {
+        const double want = std::exp(x[ind]);
+        maxerr = std::max(maxerr, std::abs(y[ind] - want)/want);
+    }
+    cerr << "exp max rel error: " << maxerr << endl;
+    Assert(maxerr < 1e-14);
+
+    // The batch version picked for this CPU, which may use wider
+    // vectors, must round as the scalar reference does.
+    const int nsame = 200000;
+    std::vector<double> xs(nsame), ys(nsame);
+    for (int ind=0; ind<nsame; ++ind) {
+        xs[ind] = -7.0 + 14.0*ind/(nsame-1) + 1e-9*(ind%7);
+    }
+    Gen::erf_batch(xs.data(), ys.data(), nsame);
+    int ndiff = 0;
+    for (int ind=0; ind<nsame; ++ind) {
+        ndiff += ys[ind] != Gen::erf_scalar(xs[ind]);
+    }
+    for (int ind=0; ind<nsame; ++ind) {
+        xs[ind] = -750.0 + 1500.0*ind/(nsame-1);
+    }
+    Gen::exp_batch(xs.data(), ys.data(), nsame);
+    for (int ind=0; ind<nsame; ++ind) {
+        ndiff += ys[ind] != Gen::exp_scalar(xs[ind]);
+    }
+    cerr << "batch values differing from scalar reference: " << ndiff << endl;
+    Assert(ndiff == 0);
+
+    // Typical diffusion patches span tens of bins.
+    const int ntries = 20000;
+    for (int nbins : {10, 20, 40, 60}) {
+        std::vector<double> want(nbins), got(nbins);
+        const double sigma = nbins/6.0, start = 0.0, step = 1.0;
+
+        auto t0 = chrono::high_resolution_clock::now();
+        double sum1 = 0;
+        for (int itry=0; itry<ntries; ++itry) {
+            scalar_binint(0.5*nbins + 0.001*itry/ntries, sigma, start, step, nbins, want.data());
+            sum1 += want[nbins/2];
+        }
+        auto t1 = chrono::high_resolution_clock::now();
+        double sum2 = 0;
+        for (int itry=0; itry<ntries; ++itry) {
+            Gen::gauss_binint(0.5*nbins + 0.001*itry/ntries, sigma, start, step, nbins, got.data());
+            sum2 += got[nbins/2];
+        }
+        auto t2 = chrono::high_resolution_clock::now();
+
+        for (int ibin=0; ibin<nbins; ++ibin) {
+            Assert(std::abs(want[ibin] - got[ibin]) < 1e-14);
+        }
+        Assert(std::abs(sum1 - sum2) < 1e-9);
+
+        const double dt1 = chrono::duration<double>(t1-t0).count();
+        const double dt2 = chrono::duration<double>(t2-t1).count();
+        cerr << nbins << " bins: std::erf " << dt1*1e9/ntries << " ns, batched "
+             << dt2*1e9/ntries << " ns, speedup " << dt1/dt2 << endl;
+    }
+    return 0;
+}
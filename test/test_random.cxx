@@ -3,6 +3,7 @@
  */
 
 
+#include "WireCellGen/Random.h"
 #include "WireCellUtil/PluginManager.h"
 #include "WireCellUtil/NamedFactory.h"
 #include "WireCellIface/IRandom.h"
@@ -13,6 +14,7 @@
 #include <iostream>
 #include <complex>
 #include <vector>
+#include <cmath>
 
 using namespace std;
 using namespace WireCell;
@@ -107,6 +109,33 @@ void test_repeat()
 
 }
 
+void test_multinomial()
+{
+    Gen::Random rnd("twister");
+    const std::vector<double> probs{0.001, 0.2, 0.0, 0.5, 0.299};
+    const int ntotal = 10000, ntries = 2000;
+    std::vector<double> mean(probs.size(), 0.0);
+    std::vector<int> counts;
+    for (int itry=0; itry<ntries; ++itry) {
+        Gen::multinomial(rnd, ntotal, probs, counts);
+        Assert(counts.size() == probs.size());
+        int sum = 0;
+        for (size_t ind=0; ind<counts.size(); ++ind) {
+            sum += counts[ind];
+            mean[ind] += counts[ind];
+        }
+        Assert(sum == ntotal);
+        Assert(counts[2] == 0);
+    }
+    for (size_t ind=0; ind<probs.size(); ++ind) {
+        mean[ind] /= ntries;
+        const double want = ntotal*probs[ind];
+        const double err = std::sqrt(want*(1-probs[ind])/ntries);
+        cerr << "multinomial bin " << ind << ": mean=" << mean[ind] << " want=" << want << endl;
+        Assert(std::abs(mean[ind] - want) <= 5*err + 1e-9);
+    }
+}
+
 int main()
 {
     ExecMon em("starting");
@@ -129,6 +158,9 @@ int main()
     test_repeat();
     em("test repeat");
 
+    test_multinomial();
+    em("test multinomial");
+
     cout << em.summary() << endl;
 
     return 0;
@@ -0,0 +1,96 @@
+/*
+  Check that ResponseSpectraCache builds each entry once when many
+  threads ask for it, stays within its byte bound and rounds shapes
+  to a few canonical lengths.
+ */
+
+#include "WireCellGen/ResponseSpectraCache.h"
+#include "WireCellGen/ThreadUtil.h"
+#include "WireCellUtil/Testing.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+using namespace WireCell;
+using namespace std;
+
+typedef Gen::ResponseSpectraCache::spectra_pointer spectra_pointer;
+
+static spectra_pointer make_spectra(int nspectra, int nwires, int nticks, std::atomic<int>& nbuilds)
+{
+    ++nbuilds;
+    // slow enough that the other threads find the build under way
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return std::make_shared<std::vector<Array::array_xxc> >(nspectra, Array::array_xxc::Zero(nwires, nticks));
+}
+
+int main()
+{
+    for (int n=1; n<5000; ++n) {
+        const int len = Gen::ResponseSpectraCache::canonical_length(n);
+        Assert(len >= n && len >= 8 && len%2 == 0);
+        Assert(n < 8 || 3*len < 4*n + 8);
+    }
+    Assert(Gen::ResponseSpectraCache::canonical_length(1000) == 1024);
+    Assert(Gen::ResponseSpectraCache::canonical_length(1100) == 1280);
+    Assert(Gen::ResponseSpectraCache::canonical_length(1500) == 1536);
+
+    const int nspectra = 6, nwires = 64, nticks = 128;
+    const size_t nbytes = size_t(nspectra)*nwires*nticks*sizeof(std::complex<float>);
+    const IPlaneImpactResponse* pir = nullptr; // only an address is used
+
+    // Room for two shapes.
+    Gen::ResponseSpectraCache cache(2*nbytes + nbytes/2);
+
+    // Many threads ask for the same shape at once and it is built once.
+    std::atomic<int> nbuilds(0);
+    const int ntasks = 16;
+    std::vector<spectra_pointer> got(ntasks);
+    Gen::parallel_chunks(ntasks, ntasks, [&](int, int beg, int end) {
+        for (int ind=beg; ind<end; ++ind) {
+            got[ind] = cache.spectra(pir, nspectra, nwires, nticks, [&]() {
+                return make_spectra(nspectra, nwires, nticks, nbuilds);
+            });
+        }
+    });
+    cerr << "builds: " << nbuilds << " hits: " << cache.hits() << " misses: " << cache.misses() << endl;
+    Assert(nbuilds == 1);
+    for (const auto& one : got) {
+        Assert(one == got.front());
+    }
+    Assert(cache.bytes() == nbytes);
+
+    // Two more shapes push out the least recently used one.
+    auto build = [&](int nt) {
+        return [&, nt]() { return make_spectra(nspectra, nwires, nt, nbuilds); };
+    };
+    cache.spectra(pir, nspectra, nwires, nticks+2, build(nticks+2));
+    cache.spectra(pir, nspectra, nwires, nticks+4, build(nticks+4));
+    Assert(nbuilds == 3);
+    Assert(cache.bytes() <= cache.max_bytes());
+    cache.spectra(pir, nspectra, nwires, nticks, build(nticks));
+    Assert(nbuilds == 4);
+    Assert(cache.bytes() <= cache.max_bytes());
+
+    // Spectra which would never fit are built but not held.
+    const size_t before = cache.bytes();
+    cache.spectra(pir, nspectra, nwires, 4*nticks, build(4*nticks));
+    Assert(nbuilds == 5);
+    Assert(cache.bytes() == before);
+
+    // A failed build is not cached.
+    bool threw = false;
+    try {
+        cache.spectra(pir, 1, 2, 2, []() -> spectra_pointer { throw std::runtime_error("no"); });
+    }
+    catch (const std::runtime_error&) {
+        threw = true;
+    }
+    Assert(threw);
+    auto again = cache.spectra(pir, 1, 2, 2, [&]() { return make_spectra(1, 2, 2, nbuilds); });
+    Assert(again && nbuilds == 6);
+
+    return 0;
+}
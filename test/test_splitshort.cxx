@@ -0,0 +1,144 @@
+/*
+  Check that the field and short responses which a PlaneImpactResponse
+  provides for a two stage convolution, when linearly convolved, stay
+  close to its combined response, and that an ImpactTransform doing
+  the two stages gives waveforms close to one using the combined
+  response.
+
+  They are not identical: the short responses are trimmed where they
+  fall below 1e-6 of their peak and the combined response is a
+  circular convolution over overall_short_padding so any part of it
+  past that wraps around to the start.
+ */
+
+#include "WireCellUtil/PluginManager.h"
+#include "WireCellUtil/NamedFactory.h"
+#include "WireCellUtil/Testing.h"
+#include "WireCellUtil/Units.h"
+
+#include "WireCellIface/IConfigurable.h"
+#include "WireCellIface/IPlaneImpactResponse.h"
+#include "WireCellIface/SimpleDepo.h"
+#include "WireCellGen/PlaneImpactResponse.h"
+#include "WireCellGen/BinnedDiffusion_transform.h"
+#include "WireCellGen/ImpactTransform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace WireCell;
+using namespace std;
+
+int main(int argc, const char* argv[])
+{
+    PluginManager& pm = PluginManager::instance();
+    pm.add("WireCellGen");
+
+    const double tick = 0.5*units::us;
+    const int nticks = 9595;
+
+    string response_file = "ub-10-half.json.bz2";
+    if (argc > 1) {
+        response_file = argv[1];
+    }
+    cerr << "Using response file: " << response_file << endl;
+
+    const std::string er_tn = "ElecResponse";
+    {
+        auto icfg = Factory::lookup_tn<IConfigurable>(er_tn);
+        auto cfg = icfg->default_configuration();
+        cfg["gain"] = 14.0*units::mV/units::fC;
+        cfg["shaping"] = 2.0*units::us;
+        cfg["nticks"] = 200;    // overall_short_padding
+        cfg["tick"] = tick;
+        icfg->configure(cfg);
+    }
+    {
+        auto icfg = Factory::lookup<IConfigurable>("FieldResponse");
+        auto cfg = icfg->default_configuration();
+        cfg["filename"] = response_file;
+        icfg->configure(cfg);
+    }
+
+    const std::vector<std::string> pir_tns{"PlaneImpactResponse:combined", "PlaneImpactResponse:split"};
+    for (size_t ind=0; ind<pir_tns.size(); ++ind) {
+        auto icfg = Factory::lookup_tn<IConfigurable>(pir_tns[ind]);
+        auto cfg = icfg->default_configuration();
+        cfg["plane"] = 2;
+        cfg["nticks"] = nticks;
+        cfg["tick"] = tick;
+        cfg["overall_short_padding"] = 100*units::us;
+        cfg["short_responses"][0] = er_tn;
+        cfg["split_short_responses"] = (ind == 1);
+        icfg->configure(cfg);
+    }
+    auto combined = Factory::find_tn<IPlaneImpactResponse>(pir_tns[0]);
+    auto split = std::dynamic_pointer_cast<const Gen::PlaneImpactResponse>(
+        Factory::find_tn<IPlaneImpactResponse>(pir_tns[1]));
+    Assert(split && split->split_short());
+
+    const auto& short_wf = split->short_waveform();
+    Assert(short_wf.size() > 0);
+    cerr << "field pad: " << split->field_pad() << " short pad: " << split->short_pad() << " ticks\n";
+
+    double peak = 0, maxdiff = 0;
+    const double half_pitch = 0.5*combined->pitch_range();
+    for (double pitch = -half_pitch; pitch <= half_pitch; pitch += combined->impact()) {
+        auto ir = combined->closest(pitch);
+        auto irs = split->closest(pitch);
+        if (!ir || !irs) {
+            continue;
+        }
+        const auto& base = ir->waveform();
+        const auto& field = split->field_waveform(irs->impact());
+
+        // the two stages as ImpactTransform does them, linearly
+        Waveform::realseq_t two(field.size() + short_wf.size() - 1, 0.0);
+        for (size_t it=0; it<field.size(); ++it) {
+            for (size_t is=0; is<short_wf.size(); ++is) {
+                two[it+is] += field[it]*short_wf[is];
+            }
+        }
+        two.resize(std::max(two.size(), base.size()), 0.0);
+        for (size_t it=0; it<base.size(); ++it) {
+            peak = std::max(peak, (double)std::abs(base[it]));
+            maxdiff = std::max(maxdiff, (double)std::abs(two[it] - base[it]));
+        }
+    }
+    cerr << "peak: " << peak << " max difference: " << maxdiff
+         << " (" << maxdiff/peak << " of peak)" << endl;
+    Assert(peak > 0);
+    Assert(maxdiff < 0.01*peak);
+
+    // The same through ImpactTransform, whose finish() applies the
+    // short responses to the field response convolution.
+    const int nwires = 41;
+    const double pitch = combined->pitch();
+    Pimpos pimpos(nwires, -0.5*(nwires-1)*pitch, 0.5*(nwires-1)*pitch);
+    Binning tbins(nticks, 0, nticks*tick);
+    std::vector<int> wire_rows(nwires);
+    for (int iwire=0; iwire<nwires; ++iwire) {
+        wire_rows[iwire] = iwire;
+    }
+    std::vector<Array::array_xxf> blocks;
+    for (const auto& tn : pir_tns) {
+        auto pir = Factory::find_tn<IPlaneImpactResponse>(tn);
+        Gen::BinnedDiffusion_transform bd(pimpos, tbins, 3.0);
+        for (int ind=0; ind<15; ++ind) {
+            auto depo = std::make_shared<SimpleDepo>((1000+200*ind)*tick, Point(0, 0, (ind-7)*2.3*units::mm), -5000.0);
+            bd.add(depo, 2*tick, 1*units::mm);
+        }
+        Gen::ImpactTransform transform(pir, bd);
+        blocks.push_back(Array::array_xxf::Zero(nwires, nticks));
+        transform.add_to(blocks.back(), wire_rows);
+    }
+    const double tpeak = blocks[0].abs().maxCoeff();
+    const double tdiff = (blocks[1] - blocks[0]).abs().maxCoeff();
+    cerr << "transform peak: " << tpeak << " max difference: " << tdiff
+         << " (" << tdiff/tpeak << " of peak)" << endl;
+    Assert(tpeak > 0);
+    Assert(tdiff < 0.01*tpeak);
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+  Check parallel_chunks() splits, nests and rethrows, that
+  parallel_tasks() runs each task once, and that the
+  Array and Waveform DFTs give the same results when called from
+  several threads at once as when called serially.
+ */
+
+#include "WireCellGen/ThreadUtil.h"
+#include "WireCellUtil/Array.h"
+#include "WireCellUtil/Waveform.h"
+#include "WireCellUtil/Exceptions.h"
+#include "WireCellUtil/Testing.h"
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+using namespace WireCell;
+using namespace std;
+
+Array::array_xxf make_array(int seed)
+{
+    Array::array_xxf arr(37, 250);
+    for (int irow=0; irow<arr.rows(); ++irow) {
+        for (int icol=0; icol<arr.cols(); ++icol) {
+            arr(irow, icol) = ((irow*131 + icol*71 + seed*17) % 101) - 50.0;
+        }
+    }
+    return arr;
+}
+
+int main()
+{
+    // chunks cover the range in order
+    std::vector<int> seen(1000, 0);
+    const int nchunks = Gen::parallel_chunks(7, seen.size(), [&](int, int beg, int end) {
+            for (int ind=beg; ind<end; ++ind) {
+                ++seen[ind];
+            }
+        });
+    Assert(nchunks == 7);
+    for (int count : seen) {
+        Assert(count == 1);
+    }
+
+    // nested calls finish and count each inner task once
+    std::atomic<int> ninner(0);
+    Gen::parallel_chunks(4, 16, [&](int, int beg, int end) {
+            for (int ind=beg; ind<end; ++ind) {
+                Gen::parallel_chunks(4, 10, [&](int, int b, int e) { ninner += e-b; });
+            }
+        });
+    Assert(ninner == 160);
+
+    // tasks are each run once
+    std::vector<std::atomic<int> > ran(500);
+    Gen::parallel_tasks(5, ran.size(), [&](int itask) { ++ran[itask]; });
+    for (const auto& count : ran) {
+        Assert(count == 1);
+    }
+
+    // exceptions reach the caller
+    bool caught = false;
+    try {
+        Gen::parallel_chunks(3, 3, [&](int ichunk, int, int) {
+                if (ichunk == 2) {
+                    THROW(ValueError() << errmsg{"test"});
+                }
+            });
+    }
+    catch (const ValueError&) {
+        caught = true;
+    }
+    Assert(caught);
+
+    // DFTs called concurrently match serial ones exactly
+    const int njobs = 32;
+    std::vector<Array::array_xxc> serial(njobs), threaded(njobs);
+    std::vector<Waveform::compseq_t> wserial(njobs), wthreaded(njobs);
+    auto work = [&](int ind, std::vector<Array::array_xxc>& out, std::vector<Waveform::compseq_t>& wout) {
+        Array::array_xxc spec = Array::dft_rc(make_array(ind), 0);
+        spec = Array::dft_cc(spec, 1);
+        out[ind] = Array::idft_cc(spec, 1);
+        Waveform::realseq_t wave(1000+ind);
+        for (size_t it=0; it<wave.size(); ++it) {
+            wave[it] = (it*37 + ind) % 23;
+        }
+        wout[ind] = Waveform::dft(wave);
+    };
+    for (int ind=0; ind<njobs; ++ind) {
+        work(ind, serial, wserial);
+    }
+    Gen::parallel_chunks(8, njobs, [&](int, int beg, int end) {
+            for (int ind=beg; ind<end; ++ind) {
+                work(ind, threaded, wthreaded);
+            }
+        });
+    for (int ind=0; ind<njobs; ++ind) {
+        Assert((serial[ind] == threaded[ind]).all());
+        Assert(wserial[ind] == wthreaded[ind]);
+    }
+    cerr << "parallel_chunks and DFTs OK\n";
+    return 0;
+}